@@ -23,6 +23,7 @@
 #include "Environment.h"
 #include <cmath>
 #include <algorithm>
+#include <sstream>
 
 //#define CHUNKED 1
 
@@ -50,6 +51,12 @@ void CVT::send( Session* session ){
   // Set up our output format handler
   Compressor *compressor = NULL;
   if( session->view->output_format == JPEG ) compressor = session->jpeg;
+#ifdef HAVE_PNG
+  else if( session->view->output_format == PNG ) compressor = session->png;
+#endif
+#ifdef HAVE_WEBP
+  else if( session->view->output_format == WEBP ) compressor = session->webp;
+#endif
   else return;
 
 
@@ -138,6 +145,23 @@ void CVT::send( Session* session ){
   }
 
 
+  // Requests for the same region and output size share a single response cache entry however they are expressed
+  ostringstream region;
+  region << "region:" << requested_res << ":" << view_left << "," << view_top << "," << view_width << ","
+	 << view_height << ":" << resampled_width << "x" << resampled_height;
+  string key = this->responseKey( region.str(), compressor );
+
+  // Our output is streamed before it is complete, so our entity tag is derived from the key.
+  // This lets us answer revalidation before touching any cache
+  string tag = etag( key );
+  if( this->notModified( tag ) ) throw( 304 );
+
+  if( this->sendCachedResponse( key ) ) return;
+
+  // Keep a copy of our output only if it can be cached, noting where our response begins
+  size_t start = this->captureResponse();
+
+
 #ifndef DEBUG
 
   // Define our separator depending on the OS
@@ -159,6 +183,7 @@ void CVT::send( Session* session ){
 	    "X-Powered-By: IIPImage\r\n"
 	    "%s\r\n"
 	    "Last-Modified: %s\r\n"
+	    "ETag: %s\r\n"
 	    "Content-Type: %s\r\n"
 	    "Content-Disposition: inline;filename=\"%s.%s\"\r\n"
 #ifdef CHUNKED
@@ -166,7 +191,7 @@ void CVT::send( Session* session ){
 #endif
 	    "\r\n",
 	    VERSION, session->response->getCacheControl().c_str(),
-	    (*session->image)->getTimestamp().c_str(),
+	    (*session->image)->getTimestamp().c_str(), tag.c_str(),
 	    compressor->getMimeType(), basename.c_str(), compressor->getSuffix() );
 
   session->out->printf( (const char*) str );
@@ -194,8 +219,14 @@ void CVT::send( Session* session ){
 
 
 
+  // PNG can hold 16 bit data, so send this losslessly if no processing or resizing is needed
+  bool png = ( session->view->output_format == PNG );
+  bool keep16 = png && complete_image.bpc == 16 && complete_image.sampleType == FIXEDPOINT &&
+    !session->view->floatProcessing() && (view_width == resampled_width) && (view_height == resampled_height);
+
+
   // Only use our floating point pipeline if necessary
-  if( complete_image.bpc > 8 || session->view->floatProcessing() ){
+  if( (complete_image.bpc > 8 && !keep16) || session->view->floatProcessing() ){
 
     // Apply normalization and perform float conversion
     {
@@ -299,8 +330,12 @@ void CVT::send( Session* session ){
   }
 
 
-  // Reduce to 1 or 3 bands if we have an alpha channel or a multi-band image
-  if( (complete_image.channels==2) || (complete_image.channels>3 ) ){
+  // Reduce to 1 or 3 bands if we have an alpha channel or a multi-band image. PNG and
+  // WebP can keep an alpha channel unless we also need to convert to greyscale
+  bool alpha = ( png || session->view->output_format == WEBP ) && ( (complete_image.channels==2) ||
+			( (complete_image.channels==4) && (session->view->colourspace != GREYSCALE) ) );
+
+  if( !alpha && ( (complete_image.channels==2) || (complete_image.channels>3) ) ){
 
     int output_channels = (complete_image.channels==2)? 1 : 3;
     if( session->loglevel >= 5 ) function_timer.start();
@@ -393,125 +428,170 @@ void CVT::send( Session* session ){
   }
 
 
-  // Initialise our output compression object
-  compressor->InitCompression( complete_image, resampled_height );
+  // If requested, compress the whole image in one go. This allows, for example, large
+  // JPEG images to be encoded in parallel
+  if( compressor->useWholeImage( resampled_width, resampled_height ) ){
+
+    if( session->loglevel >= 3 ) function_timer.start();
 
+    len = compressor->Compress( complete_image );
 
-  len = compressor->getHeaderSize();
+    if( session->loglevel >= 3 ){
+      *(session->logfile) << "CVT :: Compressed whole image to " << len << " bytes in "
+			  << function_timer.getTime() << " microseconds" << endl;
+    }
 
 #ifdef CHUNKED
-  snprintf( str, 1024, "%X\r\n", len );
-  if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Output Header Chunk : " << str;
-  session->out->printf( str );
+    snprintf( str, 1024, "%X\r\n", len );
+    if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Chunk : " << str;
+    session->out->printf( str );
 #endif
 
-  if( session->out->putStr( (const char*) compressor->getHeader(), len ) != len ){
-    if( session->loglevel >= 1 ){
-      *(session->logfile) << "CVT :: Error writing header" << endl;
+    if( session->out->putStr( (const char*) complete_image.data, len ) != len ){
+      if( session->loglevel >= 1 ){
+	*(session->logfile) << "CVT :: Error writing output" << endl;
+      }
     }
-  }
 
 #ifdef CHUNKED
-  session->out->printf( "\r\n" );
+    session->out->printf( "\r\n" );
+    session->out->printf( "0\r\n\r\n" );
 #endif
 
-  // Flush our block of data
-  if( session->out->flush() == -1 ) {
-    if( session->loglevel >= 1 ){
-      *(session->logfile) << "CVT :: Error flushing output data" << endl;
+    if( session->out->flush() == -1 ) {
+      if( session->loglevel >= 1 ){
+	*(session->logfile) << "CVT :: Error flushing output" << endl;
+      }
     }
   }
+  else{
 
+    // Initialise our output compression object
+    compressor->InitCompression( complete_image, resampled_height );
 
-  // Send out the data per strip of fixed height.
-  // Allocate enough memory for this plus an extra 64k for instances where compressed
-  // data is greater than uncompressed
-  unsigned int strip_height = 128;
-  unsigned int channels = complete_image.channels;
-  unsigned char* output = new unsigned char[resampled_width*channels*strip_height+65536];
-  int strips = (resampled_height/strip_height) + (resampled_height%strip_height == 0 ? 0 : 1);
-
-  for( int n=0; n<strips; n++ ){
-
-    // Get the starting index for this strip of data
-    unsigned char* input = &((unsigned char*)complete_image.data)[n*strip_height*resampled_width*channels];
-
-    // The last strip may have a different height
-    if( (n==strips-1) && (resampled_height%strip_height!=0) ) strip_height = resampled_height % strip_height;
 
-    if( session->loglevel >= 3 ){
-      *(session->logfile) << "CVT :: About to compress strip with height " << strip_height << endl;
-    }
-
-    // Compress the strip
-    len = compressor->CompressStrip( input, output, strip_height );
-
-    if( session->loglevel >= 3 ){
-      *(session->logfile) << "CVT :: Compressed data strip length is " << len << endl;
-    }
+    len = compressor->getHeaderSize();
 
 #ifdef CHUNKED
-    // Send chunk length in hex
     snprintf( str, 1024, "%X\r\n", len );
-    if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Chunk : " << str;
+    if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Output Header Chunk : " << str;
     session->out->printf( str );
 #endif
 
-    // Send this strip out to the client
-    if( len != session->out->putStr( (const char*) output, len ) ){
+    if( session->out->putStr( (const char*) compressor->getHeader(), len ) != len ){
       if( session->loglevel >= 1 ){
-	*(session->logfile) << "CVT :: Error writing strip: " << len << endl;
+	*(session->logfile) << "CVT :: Error writing header" << endl;
       }
     }
 
 #ifdef CHUNKED
-    // Send closing chunk CRLF
     session->out->printf( "\r\n" );
 #endif
 
     // Flush our block of data
     if( session->out->flush() == -1 ) {
       if( session->loglevel >= 1 ){
-	*(session->logfile) << "CVT :: Error flushing data" << endl;
+	*(session->logfile) << "CVT :: Error flushing output data" << endl;
       }
     }
 
-  }
 
-  // Finish off the image compression
-  len = compressor->Finish( output );
+    // Send out the data per strip of fixed height.
+    // Allocate enough memory for this plus headroom for instances where compressed data
+    // is greater than uncompressed: PNG adds a filter byte per row and, in the worst case,
+    // zlib stored block and IDAT chunk overheads, which grow with the size of the strip.
+    // Any metadata is written to the header by InitCompression rather than to this buffer
+    unsigned int strip_height = 128;
+    size_t row_bytes = (size_t) resampled_width * complete_image.channels * complete_image.bpc/8;
+    size_t strip_bytes = (row_bytes+1) * strip_height;
+    unsigned char* output = (unsigned char*) Arena::allocate( strip_bytes + strip_bytes/1024 + 65536 );
+    int strips = (resampled_height/strip_height) + (resampled_height%strip_height == 0 ? 0 : 1);
+
+    for( int n=0; n<strips; n++ ){
+
+      // Get the starting index for this strip of data
+      unsigned char* input = &((unsigned char*)complete_image.data)[n*strip_height*row_bytes];
+
+      // The last strip may have a different height
+      if( (n==strips-1) && (resampled_height%strip_height!=0) ) strip_height = resampled_height % strip_height;
+
+      if( session->loglevel >= 3 ){
+	*(session->logfile) << "CVT :: About to compress strip with height " << strip_height << endl;
+      }
+
+      // Compress the strip
+      len = compressor->CompressStrip( input, output, strip_height );
+
+      if( session->loglevel >= 3 ){
+	*(session->logfile) << "CVT :: Compressed data strip length is " << len << endl;
+      }
 
 #ifdef CHUNKED
-  snprintf( str, 1024, "%X\r\n", len );
-  if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Final Data Chunk : " << str << endl;
-  session->out->printf( str );
+      // Send chunk length in hex
+      snprintf( str, 1024, "%X\r\n", len );
+      if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Chunk : " << str;
+      session->out->printf( str );
 #endif
 
-  if( session->out->putStr( (const char*) output, len ) != len ){
-    if( session->loglevel >= 1 ){
-      *(session->logfile) << "CVT :: Error writing output" << endl;
+      // Send this strip out to the client
+      if( len != session->out->putStr( (const char*) output, len ) ){
+	if( session->loglevel >= 1 ){
+	  *(session->logfile) << "CVT :: Error writing strip: " << len << endl;
+	}
+      }
+
+#ifdef CHUNKED
+      // Send closing chunk CRLF
+      session->out->printf( "\r\n" );
+#endif
+
+      // Flush our block of data
+      if( session->out->flush() == -1 ) {
+	if( session->loglevel >= 1 ){
+	  *(session->logfile) << "CVT :: Error flushing data" << endl;
+	}
+      }
+
+    }
+
+    // Finish off the image compression
+    len = compressor->Finish( output );
+
+#ifdef CHUNKED
+    snprintf( str, 1024, "%X\r\n", len );
+    if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Final Data Chunk : " << str << endl;
+    session->out->printf( str );
+#endif
+
+    if( session->out->putStr( (const char*) output, len ) != len ){
+      if( session->loglevel >= 1 ){
+	*(session->logfile) << "CVT :: Error writing output" << endl;
+      }
     }
-  }
 
-  delete[] output;
 
 
 #ifdef CHUNKED
-  // Send closing chunk CRLF
-  session->out->printf( "\r\n" );
-  // Send closing blank chunk
-  session->out->printf( "0\r\n\r\n" );
+    // Send closing chunk CRLF
+    session->out->printf( "\r\n" );
+    // Send closing blank chunk
+    session->out->printf( "0\r\n\r\n" );
 #endif
 
-  if( session->out->flush()  == -1 ) {
-    if( session->loglevel >= 1 ){
-      *(session->logfile) << "CVT :: Error flushing output" << endl;
+    if( session->out->flush()  == -1 ) {
+      if( session->loglevel >= 1 ){
+	*(session->logfile) << "CVT :: Error flushing output" << endl;
+      }
     }
+
   }
 
   // Inform our response object that we have sent something to the client
   session->response->setImageSent();
 
+  // Cache our response for any equivalent request
+  this->cacheResponse( key, start, tag );
+
 
 
   // Total CVT response time
@@ -79,22 +79,127 @@ namespace __gnu_cxx {
 
 
 
+#include <cstdio>
 #include <iostream>
 #include <list>
 #include <string>
+#include <vector>
+#include <stdint.h>
 #include "RawTile.h"
+#include "Digest.h"
+
+
+
+/// Approximate access frequency counter for TinyLFU admission
+/** A count-min sketch of 4 rows of saturating 4 bit counters (held in bytes). All counters
+ *  are periodically halved so that the sketch tracks recent rather than all-time popularity
+ */
+
+class FrequencySketch {
+
+ private:
+
+  /// Counters: 4 rows of width entries
+  std::vector<unsigned char> table;
+
+  /// Row width minus one (width is a power of two)
+  size_t mask;
+
+  /// Number of increments since the counters were last halved and the limit
+  unsigned long additions, sampleSize;
+
+  /// FNV-1a hash of a key
+  static uint64_t hash( const std::string& key ) {
+    return Digest::fnv1a( key.data(), key.size() );
+  }
+
+  /// Index of a key's counter within a row
+  size_t index( uint64_t h, int row ) const {
+    uint64_t h2 = (h >> 32) | 1;
+    return row * (mask+1) + ( (h + row*h2) & mask );
+  }
+
+
+ public:
+
+  /// Constructor
+  /** @param entries expected number of items to track */
+  FrequencySketch( size_t entries = 0 ) { init( entries ); }
+
+  /// Size the sketch for a given number of items
+  void init( size_t entries ) {
+    size_t width = 1024;
+    while( width < entries ) width <<= 1;
+    table.assign( 4*width, 0 );
+    mask = width - 1;
+    additions = 0;
+    sampleSize = 10 * width;
+  }
+
+  /// Estimated access frequency of a key
+  unsigned int frequency( const std::string& key ) const {
+    uint64_t h = hash( key );
+    unsigned int f = 15;
+    for( int i = 0; i < 4; i++ ){
+      unsigned int n = table[ index( h, i ) ];
+      if( n < f ) f = n;
+    }
+    return f;
+  }
+
+  /// Record an access to a key
+  void increment( const std::string& key ) {
+    uint64_t h = hash( key );
+    for( int i = 0; i < 4; i++ ){
+      unsigned char& n = table[ index( h, i ) ];
+      if( n < 15 ) n++;
+    }
+    // Age all our counters
+    if( ++additions >= sampleSize ){
+      for( size_t i = 0; i < table.size(); i++ ) table[i] >>= 1;
+      additions /= 2;
+    }
+  }
+
+};
 
 
 
 /// Cache to store raw tile data
+/** The cache is split into two partitions, each with its own memory budget, eviction
+ *  lists and statistics: one for compressed tiles, which are sent directly to clients, and
+ *  one for raw (uncompressed or DEFLATE) tiles used for region compositing and image
+ *  processing. A partition may use any space left unused by the other, but once the cache
+ *  is full, tiles are first evicted from whichever partition has exceeded its budget. Large
+ *  region exports can therefore no longer flush the working set of tiles served to viewers.
+ *
+ *  Within each partition, one of several eviction policies can be used:
+ *   - LRU: least recently used
+ *   - SLRU: segmented LRU. New tiles enter a probationary segment and are only promoted
+ *     to a protected segment (80% of the budget) when accessed again, so a single scan
+ *     through an image cannot displace tiles which have been requested repeatedly
+ *   - TINYLFU: W-TinyLFU. New tiles enter a small LRU window (1% of the budget) in front
+ *     of an SLRU. Tiles leaving the window are only admitted into the SLRU if their
+ *     recent access frequency, estimated with a count-min sketch, exceeds that of the
+ *     tile which would otherwise be evicted
+ */
 
 class Cache {
 
 
+ public:
+
+  /// Cache partitions
+  enum PartitionType { COMPRESSED_TILES = 0, RAW_TILES = 1 };
+
+  /// Eviction policies
+  enum Policy { LRU = 0, SLRU = 1, TINYLFU = 2 };
+
+
  private:
 
-  /// Basic object storage size
-  int tileSize;
+  /// Heap memory used by the list and index nodes of each entry
+  unsigned long nodeSize;
 
   /// Max memory size in bytes
   unsigned long maxSize;
@@ -102,6 +207,15 @@ class Cache {
   /// Current memory running total
   unsigned long currentSize;
 
+  /// Eviction policy
+  Policy policy;
+
+  /// Access trace output
+  FILE* trace;
+
+  /// Segments within each partition
+  enum Segment { WINDOW = 0, PROBATION = 1, PROTECTED = 2 };
+
   /// Main cache storage typedef
 #ifdef HAVE_EXT_POOL_ALLOCATOR
   typedef std::list < std::pair<const std::string,RawTile>,
@@ -111,61 +225,197 @@ class Cache {
 #endif
 
   /// Main cache list iterator typedef
-  typedef std::list < std::pair<const std::string,RawTile> >::iterator List_Iter;
+  typedef TileList::iterator List_Iter;
+
+  /// Location of a tile within our storage
+  struct Entry {
+    List_Iter iter;
+    Segment segment;
+  };
 
   /// Index typedef
 #ifdef HAVE_EXT_POOL_ALLOCATOR
-  typedef HASHMAP < std::string, List_Iter,
+  typedef HASHMAP < std::string, Entry,
     __gnu_cxx::hash< const std::string >,
     std::equal_to< const std::string >,
-    __gnu_cxx::__pool_alloc< std::pair<const std::string, List_Iter> >
+    __gnu_cxx::__pool_alloc< std::pair<const std::string, Entry> >
     > TileMap;
 #else
-  typedef HASHMAP < std::string,List_Iter > TileMap;
+  typedef HASHMAP < std::string,Entry > TileMap;
 #endif
 
 
-  /// Main cache storage object
-  TileList tileList;
+  /// A cache partition with its own budget, storage and statistics
+  struct Partition {
+
+    /// Memory budget and current memory total in bytes
+    unsigned long maxSize, currentSize;
+
+    /// Cache storage objects for each segment, each in LRU order
+    TileList segments[3];
+
+    /// Memory total of each segment
+    unsigned long segmentSize[3];
+
+    /// Cache storage index object
+    TileMap tileMap;
+
+    /// Statistics
+    unsigned long hits, misses, insertions, evictions;
+
+  };
+
+
+  /// Our partitions
+  Partition partitions[2];
+
+  /// Access frequencies for TinyLFU admission
+  FrequencySketch sketch;
+
+
+  /// Partition in which tiles of a given compression type are held
+  static PartitionType _partition( CompressionType c ) {
+    return ( c == UNCOMPRESSED || c == DEFLATE ) ? RAW_TILES : COMPRESSED_TILES;
+  }
+
+
+  /// Heap memory used by a string, which is zero if held within the string object itself
+  static unsigned long _stringSize( const std::string& s ) {
+    const char* d = s.data();
+    const char* o = (const char*) &s;
+    if( d >= o && d < o + sizeof(std::string) ) return 0;
+    return MemoryPool::heapSize( s.capacity() + 1 );
+  }
+
+
+  /// Heap memory used by a cache entry
+  /** Covers the tile data as allocated, the list and index nodes, our key, which is held
+   *  in both, and the filename. Tiles without data, as used for trace replay, count their
+   *  nominal size
+   */
+  unsigned long _size( const std::pair<const std::string,RawTile>& e ) const {
+    unsigned long data = e.second.data ? MemoryPool::footprint( e.second.data ) : e.second.dataLength;
+    return data + 2*_stringSize( e.first ) + _stringSize( e.second.filename ) + nodeSize;
+  }
+
+
+  /// Heap memory used by the bucket arrays of our indexes
+  unsigned long _indexSize() const {
+    unsigned long size = 0;
+#if defined(HAVE_UNORDERED_MAP) || defined(HAVE_TR1_UNORDERED_MAP) || defined(HAVE_EXT_HASH_MAP)
+    for( int i=0; i<2; i++ ) size += MemoryPool::heapSize( partitions[i].tileMap.bucket_count() * sizeof(void*) );
+#endif
+    return size;
+  }
 
-  /// Main Cache storage index object
-  TileMap tileMap;
+
+  /// Move an entry to the head of a segment
+  void _move( Partition& p, Entry& e, Segment s ) {
+    unsigned long size = _size( *e.iter );
+    p.segmentSize[e.segment] -= size;
+    p.segmentSize[s] += size;
+    p.segments[s].splice( p.segments[s].begin(), p.segments[e.segment], e.iter );
+    e.segment = s;
+  }
 
 
   /// Internal touch function
-  /** Touches a key in the Cache and makes it the most recently used
+  /** Touches a key in the Cache and makes it the most recently used, promoting
+   *  it to the protected segment if our policy is segmented
+   *  @param p partition holding the key
    *  @param key to be touched
    *  @return a Map_Iter pointing to the key that was touched.
    */
-  TileMap::iterator _touch( const std::string &key ) {
-    TileMap::iterator miter = tileMap.find( key );
-    if( miter == tileMap.end() ) return miter;
-    // Move the found node to the head of the list.
-    tileList.splice( tileList.begin(), tileList, miter->second );
+  TileMap::iterator _touch( Partition& p, const std::string &key ) {
+    TileMap::iterator miter = p.tileMap.find( key );
+    if( miter == p.tileMap.end() ) return miter;
+
+    Entry& e = miter->second;
+    if( policy != LRU && e.segment == PROBATION ){
+      this->_move( p, e, PROTECTED );
+      // Demote the least recently used protected tiles once the segment exceeds its budget
+      while( p.segmentSize[PROTECTED] > p.maxSize - p.maxSize/5 && p.segments[PROTECTED].size() > 1 ){
+	List_Iter last = --p.segments[PROTECTED].end();
+	this->_move( p, p.tileMap[ last->first ], PROBATION );
+      }
+    }
+    // Move the found node to the head of its list.
+    else p.segments[e.segment].splice( p.segments[e.segment].begin(), p.segments[e.segment], e.iter );
+
     return miter;
   }
 
 
   /// Interal remove function
   /**
+   *  @param p partition holding the key
    *  @param miter Map_Iter that points to the key to remove
    *  @warning miter is no longer usable after being passed to this function.
    */
-  void _remove( const TileMap::iterator &miter ) {
-    // Reduce our current size counter
-    currentSize -= ( (miter->second->second).dataLength +
-		     ( (miter->second->second).filename.capacity() + (miter->second->first).capacity() )*sizeof(char) +
-		     tileSize );
-    tileList.erase( miter->second );
-    tileMap.erase( miter );
+  void _remove( Partition& p, const TileMap::iterator &miter ) {
+    // Reduce our current size counters
+    Entry& e = miter->second;
+    unsigned long size = _size( *e.iter );
+    p.segmentSize[e.segment] -= size;
+    p.currentSize -= size;
+    currentSize -= size;
+    p.segments[e.segment].erase( e.iter );
+    p.tileMap.erase( miter );
   }
 
 
   /// Interal remove function
-  /** @param key to remove */
-  void _remove( const std::string &key ) {
-    TileMap::iterator miter = tileMap.find( key );
-    this->_remove( miter );
+  /** @param p partition holding the key
+   *  @param key to remove
+   */
+  void _remove( Partition& p, const std::string &key ) {
+    TileMap::iterator miter = p.tileMap.find( key );
+    this->_remove( p, miter );
+  }
+
+
+  /// The tile our policy would evict next from a partition
+  /** @return pointer to the key of the tile or NULL if the partition is empty */
+  const std::string* _victim( Partition& p ) {
+    static const Segment order[3] = { PROBATION, PROTECTED, WINDOW };
+    for( int i=0; i<3; i++ ){
+      if( !p.segments[order[i]].empty() ) return &( (--p.segments[order[i]].end())->first );
+    }
+    return NULL;
+  }
+
+
+  /// Move tiles leaving the TinyLFU window into the main segments if they are admitted
+  /** @param p partition */
+  void _admit( Partition& p ) {
+    while( p.segmentSize[WINDOW] > p.maxSize/100 && p.segments[WINDOW].size() > 1 ){
+      List_Iter candidate = --p.segments[WINDOW].end();
+      TileMap::iterator miter = p.tileMap.find( candidate->first );
+      // Admit freely while the cache has room, otherwise only if the candidate is
+      // more popular than the tile it would displace
+      const std::string* victim = ( currentSize > maxSize ) ? _victim_main( p ) : NULL;
+      if( !victim || sketch.frequency( candidate->first ) > sketch.frequency( *victim ) ){
+	this->_move( p, miter->second, PROBATION );
+      }
+      else{
+	this->_remove( p, miter );
+	p.evictions++;
+      }
+    }
+  }
+
+
+  /// The next tile to be evicted from the main (non-window) segments of a partition
+  const std::string* _victim_main( Partition& p ) {
+    if( !p.segments[PROBATION].empty() ) return &( (--p.segments[PROBATION].end())->first );
+    if( !p.segments[PROTECTED].empty() ) return &( (--p.segments[PROTECTED].end())->first );
+    return NULL;
+  }
+
+
+  /// Write out an access to our trace
+  void _trace( char op, const std::string& f, int r, int t, int h, int v, CompressionType c, int q, unsigned long size ) {
+    fprintf( trace, "%c %d %d %d %d %d %d %lu %s\n", op, r, t, h, v, (int) c, q, size, f.c_str() );
   }
 
 
@@ -173,19 +423,52 @@ class Cache {
  public:
 
   /// Constructor
-  /** @param max Maximum cache size in MB */
-  Cache( float max ) {
-    maxSize = (unsigned long)(max*1024000) ; currentSize = 0;
-    // 64 chars added at the end represents an average string length
-    tileSize = sizeof( RawTile ) + sizeof( std::pair<const std::string,RawTile> ) +
-      sizeof( std::pair<const std::string, List_Iter> ) + sizeof(char)*64 + sizeof(List_Iter);
+  /** @param max Maximum cache size in MB
+   *  @param raw Fraction of the cache budgeted for raw tiles (0-1)
+   *  @param p Eviction policy
+   */
+  Cache( float max, float raw, Policy p = LRU ) {
+    maxSize = (unsigned long)(max*1024*1024) ; currentSize = 0;
+    policy = p;
+    trace = NULL;
+    if( raw < 0.0 ) raw = 0.0;
+    else if( raw > 1.0 ) raw = 1.0;
+    partitions[RAW_TILES].maxSize = (unsigned long)( maxSize * raw );
+    partitions[COMPRESSED_TILES].maxSize = maxSize - partitions[RAW_TILES].maxSize;
+    for( int i=0; i<2; i++ ){
+      partitions[i].currentSize = 0;
+      for( int j=0; j<3; j++ ) partitions[i].segmentSize[j] = 0;
+      partitions[i].hits = partitions[i].misses = partitions[i].insertions = partitions[i].evictions = 0;
+    }
+    // List nodes hold two links and index nodes a link and a cached hash code
+    nodeSize = MemoryPool::heapSize( 2*sizeof(void*) + sizeof( std::pair<const std::string,RawTile> ) ) +
+      MemoryPool::heapSize( sizeof(void*) + sizeof( std::pair<const std::string,Entry> ) + sizeof(size_t) );
+    // Track roughly as many tiles as a cache full of small compressed tiles
+    if( policy == TINYLFU ) sketch.init( maxSize / 8192 );
   };
 
 
   /// Destructor
   ~Cache() {
-    tileList.clear();
-    tileMap.clear();
+    for( int i=0; i<2; i++ ){
+      for( int j=0; j<3; j++ ) partitions[i].segments[j].clear();
+      partitions[i].tileMap.clear();
+    }
+  }
+
+
+  /// Record all cache accesses to a trace file for later replay
+  /** @param f open file or NULL to stop tracing */
+  void setTrace( FILE* f ) { trace = f; }
+
+
+  /// Return the name of a policy
+  static const char* getPolicyName( Policy p ) {
+    switch( p ){
+      case SLRU: return "slru";
+      case TINYLFU: return "tinylfu";
+      default: return "lru";
+    }
   }
 
 
@@ -195,17 +478,24 @@ class Cache {
 
     if( maxSize == 0 ) return;
 
+    PartitionType type = _partition( r.compressionType );
+    Partition& p = partitions[type];
+    Partition& other = partitions[1-type];
+
+    if( trace ) _trace( 'I', r.filename, r.resolution, r.tileNum, r.hSequence, r.vSequence,
+			r.compressionType, r.quality, r.dataLength );
+
     std::string key = this->getIndex( r.filename, r.resolution, r.tileNum,
 				      r.hSequence, r.vSequence, r.compressionType, r.quality );
 
     // Touch the key, if it exists
-    TileMap::iterator miter = this->_touch( key );
+    TileMap::iterator miter = this->_touch( p, key );
 
     // Check whether this tile exists in our cache
-    if( miter != tileMap.end() ){
+    if( miter != p.tileMap.end() ){
       // Check the timestamp and delete if necessary
-      if( miter->second->second.timestamp < r.timestamp ){
-	this->_remove( miter );
+      if( miter->second.iter->second.timestamp < r.timestamp ){
+	this->_remove( p, miter );
       }
       // If this index already exists and it is up to date, do nothing
       else return;
@@ -213,34 +503,73 @@ class Cache {
 
     // Store the key if it doesn't already exist in our cache
     // Ok, do the actual insert at the head of the list
-    tileList.push_front( std::make_pair(key,r) );
+    Segment s = ( policy == TINYLFU ) ? WINDOW : PROBATION;
+    p.segments[s].push_front( std::make_pair(key,r) );
 
     // And store this in our map
-    List_Iter liter = tileList.begin();
-    tileMap[ key ] = liter;
-
-    // Update our total current size variable. Use the string::capacity function
-    // rather than length() as std::string can allocate slightly more than necessary
-    // The +1 is for the terminating null byte
-    currentSize += (r.dataLength + (r.filename.capacity()+key.capacity())*sizeof(char) + tileSize);
-
-    // Check to see if we need to remove an element due to exceeding max_size
-    while( currentSize > maxSize ) {
-      // Remove the last element
-      liter = tileList.end();
-      --liter;
-      this->_remove( liter->first );
+    Entry e;
+    e.iter = p.segments[s].begin();
+    e.segment = s;
+    p.tileMap[ key ] = e;
+
+    // Update our total current size variables
+    unsigned long size = _size( *e.iter );
+    p.segmentSize[s] += size;
+    p.currentSize += size;
+    currentSize += size;
+    p.insertions++;
+
+    // Decide whether tiles leaving the window are worth keeping
+    if( policy == TINYLFU ) this->_admit( p );
+
+    // Check to see if we need to remove an element due to exceeding max_size.
+    // Reclaim space first from the other partition if it has overrun its budget
+    while( currentSize + _indexSize() > maxSize ) {
+      Partition& victim = ( other.currentSize > other.maxSize ) ? other : p;
+      const std::string* last = this->_victim( victim );
+      if( !last ) break;
+      this->_remove( victim, *last );
+      victim.evictions++;
     }
 
   }
 
 
   /// Return the number of tiles in the cache
-  unsigned int getNumElements() { return tileList.size(); }
+  unsigned int getNumElements() {
+    return partitions[COMPRESSED_TILES].tileMap.size() + partitions[RAW_TILES].tileMap.size();
+  }
 
 
   /// Return the number of MB stored
-  float getMemorySize() { return (float) ( currentSize / 1024000.0 ); }
+  float getMemorySize() { return (float) ( getMemoryBytes() / (1024.0*1024.0) ); }
+
+
+  /// Return the number of bytes of heap memory used by our tiles and their indexes
+  unsigned long getMemoryBytes() const { return currentSize + _indexSize(); }
+
+
+  /// Return the total number of cache hits and misses
+  void getHitCounts( unsigned long& hits, unsigned long& misses ) {
+    hits = partitions[COMPRESSED_TILES].hits + partitions[RAW_TILES].hits;
+    misses = partitions[COMPRESSED_TILES].misses + partitions[RAW_TILES].misses;
+  }
+
+
+  /// Return a summary of the contents and hit rate of each partition
+  std::string getStatistics() {
+    const char* names[2] = { "compressed", "raw" };
+    std::string s = std::string( getPolicyName( policy ) ) + " ";
+    for( int i=0; i<2; i++ ){
+      const Partition& p = partitions[i];
+      char tmp[256];
+      snprintf( tmp, 256, "%s%s: %lu tiles, %.2f/%.2f MB, %lu hits, %lu misses, %lu insertions, %lu evictions",
+		i ? "; " : "", names[i], (unsigned long) p.tileMap.size(), p.currentSize / (1024.0*1024.0),
+		p.maxSize / (1024.0*1024.0), p.hits, p.misses, p.insertions, p.evictions );
+      s += tmp;
+    }
+    return s;
+  }
 
 
   /// Get a tile from the cache
@@ -258,13 +587,44 @@ class Cache {
 
     if( maxSize == 0 ) return NULL;
 
+    Partition& p = partitions[ _partition( c ) ];
     std::string key = this->getIndex( f, r, t, h, v, c, q );
 
-    TileMap::iterator miter = tileMap.find( key );
-    if( miter == tileMap.end() ) return NULL;
-    this->_touch( key );
+    if( policy == TINYLFU ) sketch.increment( key );
+
+    TileMap::iterator miter = this->_touch( p, key );
+    if( miter == p.tileMap.end() ){
+      p.misses++;
+      if( trace ) _trace( 'G', f, r, t, h, v, c, q, 0 );
+      return NULL;
+    }
+    p.hits++;
+
+    RawTile* tile = &(miter->second.iter->second);
+    if( trace ) _trace( 'G', f, r, t, h, v, c, q, tile->dataLength );
+    return tile;
+  }
+
+
+  /// Look up a tile without counting the access or changing its position in the cache
+  /**
+   *  @param f filename
+   *  @param r resolution number
+   *  @param t tile number
+   *  @param h horizontal sequence number
+   *  @param v vertical sequence number
+   *  @param c compression type
+   *  @param q compression quality
+   *  @return pointer to the cached tile or NULL if not held
+   */
+  const RawTile* peekTile( const std::string& f, int r, int t, int h, int v, CompressionType c, int q ) const {
+
+    if( maxSize == 0 ) return NULL;
 
-    return &(miter->second->second);
+    const Partition& p = partitions[ _partition( c ) ];
+    TileMap::const_iterator miter = p.tileMap.find( this->getIndex( f, r, t, h, v, c, q ) );
+    if( miter == p.tileMap.end() ) return NULL;
+    return &(miter->second.iter->second);
   }
 
 
@@ -279,7 +639,7 @@ class Cache {
    *  @param q compression quality
    *  @return string
    */
-  std::string getIndex( std::string f, int r, int t, int h, int v, CompressionType c, int q ) {
+  static std::string getIndex( const std::string& f, int r, int t, int h, int v, CompressionType c, int q ) {
     char tmp[1024];
     snprintf( tmp, 1024, "%s:%d:%d:%d:%d:%d:%d", f.c_str(), r, t, h, v, c, q );
     return std::string( tmp );
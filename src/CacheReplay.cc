@@ -0,0 +1,171 @@
+/*  IIP Server: Tile cache trace replay
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <vector>
+#include "Cache.h"
+#include "CacheReplay.h"
+
+
+using namespace std;
+
+
+
+/// A single tile lookup from our trace
+struct TraceAccess {
+  int resolution, tile, hSequence, vSequence, quality;
+  CompressionType compression;
+  size_t filename;
+  unsigned long size;
+  bool first;                 // first lookup made for a tile request
+};
+
+
+
+int replayCacheTrace( const string& path, float size, float raw, ostream& out )
+{
+  FILE* f = fopen( path.c_str(), "r" );
+  if( !f ){
+    out << "Unable to open cache trace '" << path << "'" << endl;
+    return 1;
+  }
+
+  // Read in all our lookups. Record tile sizes from both insertions and hits,
+  // and share filename strings between accesses. A single tile request makes
+  // consecutive fallback lookups (JPEG, DEFLATE, UNCOMPRESSED) for the same tile,
+  // so group these together into one logical access
+  vector<TraceAccess> accesses;
+  vector< pair<int,int> > group;
+  map<string,unsigned long> sizes;
+  map<string,size_t> filenames;
+  vector<string> names;
+
+  char line[4096];
+  char name[4096];
+  while( fgets( line, sizeof(line), f ) ){
+    char op;
+    int r, t, h, v, c, q;
+    unsigned long s;
+    if( sscanf( line, "%c %d %d %d %d %d %d %lu %4095[^\n]", &op, &r, &t, &h, &v, &c, &q, &s, name ) != 9 ) continue;
+
+    string key = Cache::getIndex( name, r, t, h, v, (CompressionType) c, q );
+    if( s > 0 ) sizes[key] = s;
+    if( op != 'G' ) continue;
+
+    map<string,size_t>::iterator i = filenames.find( name );
+    if( i == filenames.end() ){
+      i = filenames.insert( make_pair( string(name), names.size() ) ).first;
+      names.push_back( name );
+    }
+
+    TraceAccess a;
+    a.resolution = r; a.tile = t; a.hSequence = h; a.vSequence = v;
+    a.compression = (CompressionType) c; a.quality = q;
+    a.filename = i->second;
+    a.size = 0;
+
+    // A new request starts with a different tile or with a repeated lookup of the same tile
+    const TraceAccess* last = accesses.empty() ? NULL : &accesses.back();
+    pair<int,int> type( c, q );
+    a.first = !last || last->filename != a.filename || last->resolution != r || last->tile != t ||
+      last->hSequence != h || last->vSequence != v || find( group.begin(), group.end(), type ) != group.end();
+    if( a.first ) group.clear();
+    group.push_back( type );
+
+    accesses.push_back( a );
+  }
+  fclose( f );
+
+  // Look up our tile sizes now that the whole trace has been read
+  for( size_t n = 0; n < accesses.size(); n++ ){
+    TraceAccess& a = accesses[n];
+    string key = Cache::getIndex( names[a.filename], a.resolution, a.tile, a.hSequence, a.vSequence, a.compression, a.quality );
+    map<string,unsigned long>::iterator i = sizes.find( key );
+    a.size = ( i == sizes.end() ) ? 0 : i->second;
+  }
+
+  out << "Replaying " << accesses.size() << " tile lookups from '" << path << "' with a "
+      << size << " MB cache (raw tile share " << raw << ")" << endl;
+
+  const Cache::Policy policies[3] = { Cache::LRU, Cache::SLRU, Cache::TINYLFU };
+
+  for( int p = 0; p < 3; p++ ){
+
+    Cache cache( size, raw, policies[p] );
+    unsigned long requests = 0, lookups = 0, hits = 0;
+    double bytes = 0, hitBytes = 0;
+
+    size_t n = 0;
+    while( n < accesses.size() ){
+
+      // Find the end of this request's group of fallback lookups
+      size_t end = n + 1;
+      while( end < accesses.size() && !accesses[end].first ) end++;
+
+      // Make the lookups in order until one of them hits. Skip lookups of tiles which
+      // were never seen in the trace. The first known tile is the one the request wanted
+      const TraceAccess* wanted = NULL;
+      bool hit = false;
+      for( ; n < end && !hit; n++ ){
+	const TraceAccess& a = accesses[n];
+	if( a.size == 0 ) continue;
+	if( !wanted ) wanted = &a;
+	lookups++;
+	if( cache.getTile( names[a.filename], a.resolution, a.tile, a.hSequence, a.vSequence, a.compression, a.quality ) ){
+	  hit = true;
+	}
+      }
+      n = end;
+
+      if( !wanted ) continue;
+
+      requests++;
+      bytes += wanted->size;
+
+      if( hit ){
+	hits++;
+	hitBytes += wanted->size;
+      }
+      else{
+	// Insert a placeholder tile of the right size - no data is needed for the simulation
+	RawTile tile( wanted->tile, wanted->resolution, wanted->hSequence, wanted->vSequence );
+	tile.filename = names[wanted->filename];
+	tile.compressionType = wanted->compression;
+	tile.quality = wanted->quality;
+	tile.dataLength = wanted->size;
+	cache.insert( tile );
+	tile.dataLength = 0;
+      }
+    }
+
+    char result[256];
+    snprintf( result, sizeof(result), "%-8s hit rate: %6.2f%% (%lu/%lu requests, %lu lookups)  byte hit rate: %6.2f%%",
+	      Cache::getPolicyName( policies[p] ),
+	      requests ? 100.0 * hits / requests : 0.0, hits, requests, lookups,
+	      bytes > 0 ? 100.0 * hitBytes / bytes : 0.0 );
+    out << result << endl
+	<< "         " << cache.getStatistics() << endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,45 @@
+/*  IIP Server: Tile cache trace replay
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _CACHEREPLAY_H
+#define _CACHEREPLAY_H
+
+
+#include <iostream>
+#include <string>
+
+
+
+/// Replay a tile cache access trace against each of our cache eviction policies
+/** Traces are recorded by setting the CACHE_TRACE environment variable. Each tile
+ *  lookup is replayed and, on a miss, a tile of the size recorded in the trace is
+ *  inserted, so that hit rates of the different policies can be compared for the
+ *  same cache size. Traces should be recorded from a cold start, as tiles whose
+ *  size was never recorded cannot be replayed and are ignored.
+ *  @param path trace file
+ *  @param size cache size in MB
+ *  @param raw fraction of the cache budgeted for raw tiles
+ *  @param out output stream for results
+ *  @return 0 on success, 1 if the trace cannot be read
+ */
+int replayCacheTrace( const std::string& path, float size, float raw, std::ostream& out );
+
+
+#endif
@@ -107,9 +107,20 @@ class Compressor {
 
   /// Compress an entire buffer of image data at once in one command
   /** @param t tile of image data
+      @param cache whether the result is to be cached and served repeatedly, in which
+             case a slower encoding giving smaller output may be used
       @return number of bytes used
    */
-  virtual int Compress( RawTile& t ) { return 0; };
+  virtual int Compress( RawTile& t, bool cache = false ) { return 0; };
+
+
+  /// Whether an image of a given size is better compressed in one go using Compress()
+  /// rather than strip by strip
+  /** @param width image width
+      @param height image height
+      @return true if Compress() should be used
+   */
+  virtual bool useWholeImage( unsigned int width, unsigned int height ) { return false; };
 
 
   /// Add metadata to the image header
@@ -271,8 +271,10 @@ RawTile DSOImage::getTile( int seq, int angle, unsigned int resolution, int laye
 
   RawTile rawtile( tile, resolution, seq, angle,
 		   w, h, 3, 8 );
-  rawtile.data = data;
-  rawtile.dataLength = data_len;
+  // Copy the module's buffer into our own pooled memory
+  rawtile.allocate( data_len );
+  memcpy( rawtile.data, data, data_len );
+  delete[] data;
   return rawtile;
 }  
 
@@ -0,0 +1,154 @@
+/*  IIP Server: Content digests
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _DIGEST_H
+#define _DIGEST_H
+
+
+#include <cstddef>
+#include <stdint.h>
+
+
+
+/// Fast non-cryptographic 64 bit digests of blocks of data
+/** xxh64() is the XXH64 algorithm of xxHash (https://github.com/Cyan4973/xxHash), whose
+ *  output it reproduces on all platforms, so that servers sharing a cache or sitting behind
+ *  the same CDN produce the same digest for the same content. It runs at several GB/s and
+ *  so costs little next to the encoding of the data it digests. fnv1a() is the simpler
+ *  FNV-1a hash used for short strings such as cache keys.
+ */
+
+class Digest {
+
+ private:
+
+  static const uint64_t PRIME1 = 11400714785074694791ULL;
+  static const uint64_t PRIME2 = 14029467366897019727ULL;
+  static const uint64_t PRIME3 = 1609587929392839161ULL;
+  static const uint64_t PRIME4 = 9650029242287828579ULL;
+  static const uint64_t PRIME5 = 2870177450012600261ULL;
+
+  static uint64_t rotl( uint64_t x, int r ){ return (x << r) | (x >> (64 - r)); }
+
+  /// Little-endian reads regardless of host byte order or alignment
+  static uint64_t read64( const unsigned char* p ){
+    return (uint64_t) p[0] | ((uint64_t) p[1] << 8) | ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24) |
+      ((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40) | ((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
+  }
+
+  static uint64_t read32( const unsigned char* p ){
+    return (uint64_t) p[0] | ((uint64_t) p[1] << 8) | ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24);
+  }
+
+  static uint64_t mix( uint64_t acc, uint64_t input ){
+    acc += input * PRIME2;
+    return rotl( acc, 31 ) * PRIME1;
+  }
+
+  static uint64_t merge( uint64_t acc, uint64_t val ){
+    acc ^= mix( 0, val );
+    return acc * PRIME1 + PRIME4;
+  }
+
+
+ public:
+
+  /// Compute the digest of a block of data
+  /** @param data data
+      @param len length of data in bytes
+      @param seed seed value
+      @return 64 bit digest
+   */
+  static uint64_t xxh64( const void* data, size_t len, uint64_t seed = 0 ){
+
+    const unsigned char* p = (const unsigned char*) data;
+    const unsigned char* end = p + len;
+    uint64_t h;
+
+    if( len >= 32 ){
+      const unsigned char* limit = end - 32;
+      uint64_t v1 = seed + PRIME1 + PRIME2;
+      uint64_t v2 = seed + PRIME2;
+      uint64_t v3 = seed;
+      uint64_t v4 = seed - PRIME1;
+      do{
+	v1 = mix( v1, read64( p ) );
+	v2 = mix( v2, read64( p + 8 ) );
+	v3 = mix( v3, read64( p + 16 ) );
+	v4 = mix( v4, read64( p + 24 ) );
+	p += 32;
+      }
+      while( p <= limit );
+
+      h = rotl( v1, 1 ) + rotl( v2, 7 ) + rotl( v3, 12 ) + rotl( v4, 18 );
+      h = merge( h, v1 );
+      h = merge( h, v2 );
+      h = merge( h, v3 );
+      h = merge( h, v4 );
+    }
+    else h = seed + PRIME5;
+
+    h += (uint64_t) len;
+
+    for( ; p + 8 <= end; p += 8 ){
+      h ^= mix( 0, read64( p ) );
+      h = rotl( h, 27 ) * PRIME1 + PRIME4;
+    }
+    if( p + 4 <= end ){
+      h ^= read32( p ) * PRIME1;
+      h = rotl( h, 23 ) * PRIME2 + PRIME3;
+      p += 4;
+    }
+    for( ; p < end; p++ ){
+      h ^= (*p) * PRIME5;
+      h = rotl( h, 11 ) * PRIME1;
+    }
+
+    // Final avalanche
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+
+    return h;
+  }
+
+
+  /// Compute the FNV-1a hash of a block of data
+  /** This is identical in every process, so can be used for keys in shared caches
+      @param data data
+      @param len length of data in bytes
+      @return 64 bit hash
+   */
+  static uint64_t fnv1a( const void* data, size_t len ){
+    const unsigned char* p = (const unsigned char*) data;
+    uint64_t h = 14695981039346656037ULL;
+    for( size_t i = 0; i < len; i++ ){
+      h ^= p[i];
+      h *= 1099511628211ULL;
+    }
+    return h;
+  }
+
+};
+
+
+#endif
@@ -0,0 +1,411 @@
+/*  IIP Server: Persistent disk tile cache
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "DiskCache.h"
+
+
+using namespace std;
+
+
+// Record marker: "IIPT"
+#define RECORD_MAGIC 0x54504949
+
+// Maximum number of processes which can share a cache directory
+#define MAX_SLOTS 64
+
+// Limits on the size of each segment file
+#define MIN_SEGMENT_SIZE 1024*1024
+#define MAX_SEGMENT_SIZE 64*1024*1024
+
+
+
+/// Header at the start of each record, followed by the key, the tile data and padding
+/** The checksum covers everything following it: the rest of the header, key and data */
+struct RecordHeader {
+  uint32_t magic;
+  uint32_t checksum;
+  uint32_t keyLength;
+  uint32_t dataLength;
+  int64_t timestamp;
+  int32_t tileNum, resolution, hSequence, vSequence;
+  int32_t width, height, channels, bpc;
+  int32_t sampleType, compressionType, quality, padded;
+};
+
+
+/// Length of a record, padded to keep headers 8 byte aligned
+static uint64_t recordLength( uint64_t keyLength, uint64_t dataLength ){
+  return ( sizeof(RecordHeader) + keyLength + dataLength + 7 ) & ~((uint64_t)7);
+}
+
+
+/// Checksum of a record
+static uint32_t recordChecksum( const unsigned char* record, const RecordHeader* header ){
+  size_t skip = 2*sizeof(uint32_t);
+  size_t length = sizeof(RecordHeader) - skip + header->keyLength + header->dataLength;
+  return crc32( crc32( 0L, Z_NULL, 0 ), record + skip, length );
+}
+
+
+/// Check that a record lies within a segment and is intact
+static bool validRecord( const unsigned char* data, uint64_t offset, uint64_t size, bool checksum ){
+  if( offset + sizeof(RecordHeader) > size ) return false;
+  const RecordHeader* header = (const RecordHeader*) &data[offset];
+  if( header->magic != RECORD_MAGIC ) return false;
+  if( offset + recordLength( header->keyLength, header->dataLength ) > size ) return false;
+  return !checksum || recordChecksum( &data[offset], header ) == header->checksum;
+}
+
+
+
+DiskCache::DiskCache( const string& p, float size )
+{
+  lock = -1;
+  totalSize = 0;
+  hits = misses = writes = stale = corrupt = compactions = 0;
+
+  maxSize = (uint64_t)( size * 1024.0 * 1024.0 );
+  segmentSize = maxSize / 8;
+  if( segmentSize < MIN_SEGMENT_SIZE ) segmentSize = MIN_SEGMENT_SIZE;
+  if( segmentSize > MAX_SEGMENT_SIZE ) segmentSize = MAX_SEGMENT_SIZE;
+
+  if( mkdir( p.c_str(), 0755 ) != 0 && errno != EEXIST ){
+    throw string( "DiskCache :: Unable to create cache directory " + p + ": " + strerror(errno) );
+  }
+
+  // Claim the first slot not locked by another process
+  for( int n = 0; n < MAX_SLOTS && lock < 0; n++ ){
+    ostringstream slot;
+    slot << p << "/slot-" << n;
+    if( mkdir( slot.str().c_str(), 0755 ) != 0 && errno != EEXIST ) continue;
+    int fd = open( (slot.str() + "/lock").c_str(), O_RDWR | O_CREAT, 0644 );
+    if( fd < 0 ) continue;
+    if( flock( fd, LOCK_EX | LOCK_NB ) == 0 ){
+      lock = fd;
+      path = slot.str();
+    }
+    else close( fd );
+  }
+
+  if( lock < 0 ) throw string( "DiskCache :: No free cache slot in " + p );
+
+  // Find our existing segments
+  DIR* dir = opendir( path.c_str() );
+  if( !dir ) throw string( "DiskCache :: Unable to read cache directory " + path );
+  struct dirent* entry;
+  while( (entry = readdir( dir )) ){
+    unsigned int n;
+    char suffix[8];
+    if( sscanf( entry->d_name, "segment-%u.%7s", &n, suffix ) == 2 && strcmp( suffix, "dat" ) == 0 ){
+      Segment s = { -1, NULL, 0, 0 };
+      segments[n] = s;
+    }
+  }
+  closedir( dir );
+
+  // Rebuild our index, oldest segments first so that newer records take precedence
+  for( map<uint32_t,Segment>::iterator i = segments.begin(); i != segments.end(); ++i ){
+    uint32_t n = i->first;
+    this->openSegment( n );
+    this->scanSegment( n );
+  }
+
+  // Our size limit may have been reduced
+  while( totalSize > maxSize && segments.size() > 1 ) this->compact();
+}
+
+
+
+DiskCache::~DiskCache()
+{
+  for( map<uint32_t,Segment>::iterator i = segments.begin(); i != segments.end(); ++i ){
+    if( i->second.data ) munmap( i->second.data, i->second.mapped );
+    if( i->second.fd >= 0 ) close( i->second.fd );
+  }
+  // Closing our lock file releases our slot
+  if( lock >= 0 ) close( lock );
+}
+
+
+
+string DiskCache::segmentName( uint32_t n ) const
+{
+  char name[32];
+  snprintf( name, sizeof(name), "/segment-%08u.dat", n );
+  return path + name;
+}
+
+
+
+DiskCache::Segment& DiskCache::openSegment( uint32_t n )
+{
+  string name = segmentName( n );
+  int fd = open( name.c_str(), O_RDWR | O_CREAT, 0644 );
+  if( fd < 0 ) throw string( "DiskCache :: Unable to open " + name + ": " + strerror(errno) );
+
+  struct stat st;
+  if( fstat( fd, &st ) != 0 ){
+    close( fd );
+    throw string( "DiskCache :: Unable to stat " + name );
+  }
+
+  // Map the full segment size so that appended records become visible through our
+  // mapping. Only the written part of the file is ever read
+  size_t mapped = ( (uint64_t) st.st_size > segmentSize ) ? st.st_size : segmentSize;
+  void* data = mmap( NULL, mapped, PROT_READ, MAP_SHARED, fd, 0 );
+  if( data == MAP_FAILED ){
+    close( fd );
+    throw string( "DiskCache :: Unable to map " + name + ": " + strerror(errno) );
+  }
+
+  Segment& s = segments[n];
+  s.fd = fd;
+  s.data = (unsigned char*) data;
+  s.mapped = mapped;
+  s.size = st.st_size;
+  totalSize += s.size;
+  return s;
+}
+
+
+
+void DiskCache::removeSegment( uint32_t n )
+{
+  map<uint32_t,Segment>::iterator i = segments.find( n );
+  if( i == segments.end() ) return;
+  munmap( i->second.data, i->second.mapped );
+  close( i->second.fd );
+  unlink( segmentName( n ).c_str() );
+  totalSize -= i->second.size;
+  segments.erase( i );
+}
+
+
+
+void DiskCache::scanSegment( uint32_t n )
+{
+  Segment& s = segments[n];
+  uint64_t offset = 0;
+
+  while( validRecord( s.data, offset, s.size, false ) ){
+    const RecordHeader* header = (const RecordHeader*) &s.data[offset];
+    uint32_t length = recordLength( header->keyLength, header->dataLength );
+    // Skip over records whose contents have been damaged
+    if( recordChecksum( &s.data[offset], header ) == header->checksum ){
+      string key( (const char*) &s.data[offset+sizeof(RecordHeader)], header->keyLength );
+      Location l = { n, length, offset, header->timestamp, false };
+      index[key] = l;
+    }
+    else corrupt++;
+    offset += length;
+  }
+
+  // Discard anything after the last complete record, such as a partial write
+  if( offset < s.size ){
+    corrupt++;
+    if( ftruncate( s.fd, offset ) == 0 ){
+      totalSize -= s.size - offset;
+      s.size = offset;
+    }
+  }
+}
+
+
+
+bool DiskCache::append( const unsigned char* record, uint32_t length, const string& key, int64_t timestamp )
+{
+  if( length > segmentSize ) return false;
+
+  // Start a new segment if our current one is full
+  if( segments.empty() || segments.rbegin()->second.size + length > segmentSize ){
+    uint32_t n = segments.empty() ? 1 : segments.rbegin()->first + 1;
+    this->openSegment( n );
+  }
+
+  uint32_t n = segments.rbegin()->first;
+  Segment& s = segments.rbegin()->second;
+
+  if( pwrite( s.fd, record, length, s.size ) != (ssize_t) length ){
+    // Remove anything partially written
+    if( ftruncate( s.fd, s.size ) != 0 ) corrupt++;
+    return false;
+  }
+
+  Location l = { n, length, s.size, timestamp, false };
+  index[key] = l;
+  s.size += length;
+  totalSize += length;
+  return true;
+}
+
+
+
+void DiskCache::compact()
+{
+  if( segments.size() < 2 ) return;
+
+  uint32_t n = segments.begin()->first;
+  const Segment& s = segments.begin()->second;
+  uint64_t offset = 0;
+
+  while( validRecord( s.data, offset, s.size, false ) ){
+    const RecordHeader* header = (const RecordHeader*) &s.data[offset];
+    string key( (const char*) &s.data[offset+sizeof(RecordHeader)], header->keyLength );
+    uint32_t length = recordLength( header->keyLength, header->dataLength );
+
+    // Only records still referenced by our index are live
+    Index::iterator i = index.find( key );
+    if( i != index.end() && i->second.segment == n && i->second.offset == offset ){
+      // Give tiles which have been read a second chance by copying them forward
+      if( !i->second.accessed || !this->append( &s.data[offset], length, key, header->timestamp ) ){
+	index.erase( i );
+      }
+    }
+    offset += length;
+  }
+
+  this->removeSegment( n );
+  compactions++;
+}
+
+
+
+void DiskCache::insert( const RawTile& r )
+{
+  if( !storable( r.compressionType ) || !r.data || r.dataLength <= 0 ) return;
+
+  string key = Cache::getIndex( r.filename, r.resolution, r.tileNum, r.hSequence, r.vSequence,
+				r.compressionType, r.quality );
+
+  // Don't rewrite tiles we already hold
+  Index::iterator i = index.find( key );
+  if( i != index.end() && i->second.timestamp >= r.timestamp ) return;
+
+  uint64_t length = recordLength( key.size(), r.dataLength );
+  if( length > segmentSize ) return;
+
+  unsigned char* record = (unsigned char*) MemoryPool::allocate( length );
+  memset( record, 0, sizeof(RecordHeader) );
+
+  RecordHeader* header = (RecordHeader*) record;
+  header->magic = RECORD_MAGIC;
+  header->keyLength = key.size();
+  header->dataLength = r.dataLength;
+  header->timestamp = r.timestamp;
+  header->tileNum = r.tileNum;
+  header->resolution = r.resolution;
+  header->hSequence = r.hSequence;
+  header->vSequence = r.vSequence;
+  header->width = r.width;
+  header->height = r.height;
+  header->channels = r.channels;
+  header->bpc = r.bpc;
+  header->sampleType = r.sampleType;
+  header->compressionType = r.compressionType;
+  header->quality = r.quality;
+  header->padded = r.padded;
+
+  unsigned char* ptr = record + sizeof(RecordHeader);
+  memcpy( ptr, key.data(), key.size() );
+  memcpy( ptr + key.size(), r.data, r.dataLength );
+  size_t used = sizeof(RecordHeader) + key.size() + r.dataLength;
+  memset( record + used, 0, length - used );
+  header->checksum = recordChecksum( record, header );
+
+  if( this->append( record, length, key, r.timestamp ) ) writes++;
+  MemoryPool::release( record );
+
+  // Reclaim space from our oldest segments
+  while( totalSize > maxSize && segments.size() > 1 ) this->compact();
+}
+
+
+
+bool DiskCache::getTile( const string& f, int r, int t, int h, int v, CompressionType c, int q,
+			 time_t timestamp, RawTile& tile )
+{
+  string key = Cache::getIndex( f, r, t, h, v, c, q );
+
+  Index::iterator i = index.find( key );
+  if( i == index.end() ){
+    misses++;
+    return false;
+  }
+
+  // Discard tiles from older versions of the image
+  if( i->second.timestamp < timestamp ){
+    stale++;
+    misses++;
+    index.erase( i );
+    return false;
+  }
+
+  map<uint32_t,Segment>::iterator s = segments.find( i->second.segment );
+  uint64_t offset = i->second.offset;
+
+  // Verify the record before use
+  if( s == segments.end() || !validRecord( s->second.data, offset, s->second.size, true ) ||
+      key.compare( 0, string::npos, (const char*) &s->second.data[offset+sizeof(RecordHeader)],
+		   ((const RecordHeader*) &s->second.data[offset])->keyLength ) != 0 ){
+    corrupt++;
+    misses++;
+    index.erase( i );
+    return false;
+  }
+
+  const RecordHeader* header = (const RecordHeader*) &s->second.data[offset];
+
+  tile = RawTile( header->tileNum, header->resolution, header->hSequence, header->vSequence,
+		  header->width, header->height, header->channels, header->bpc );
+  tile.sampleType = (SampleType) header->sampleType;
+  tile.compressionType = (CompressionType) header->compressionType;
+  tile.quality = header->quality;
+  tile.padded = header->padded;
+  tile.timestamp = header->timestamp;
+  tile.filename = f;
+  tile.allocate( header->dataLength );
+  memcpy( tile.data, &s->second.data[offset + sizeof(RecordHeader) + header->keyLength], header->dataLength );
+
+  i->second.accessed = true;
+  hits++;
+  return true;
+}
+
+
+
+string DiskCache::getStatistics() const
+{
+  ostringstream s;
+  s << index.size() << " tiles, " << totalSize / (1024.0*1024.0) << "/" << maxSize / (1024.0*1024.0)
+    << " MB in " << segments.size() << " segments, " << hits << " hits, " << misses << " misses, "
+    << writes << " writes, " << stale << " stale, " << corrupt << " corrupt, " << compactions << " compactions";
+  return s.str();
+}
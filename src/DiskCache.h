@@ -0,0 +1,167 @@
+/*  IIP Server: Persistent disk tile cache
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _DISKCACHE_H
+#define _DISKCACHE_H
+
+
+#include <map>
+#include <string>
+#include <stdint.h>
+#include "Cache.h"
+
+
+
+/// Second level tile cache held in memory-mapped segment files on local disk
+/** Encoded (JPEG, PNG, WebP and DEFLATE) tiles are appended to a log of segment files,
+ *  which are read back through read-only memory mappings. Each record carries its
+ *  cache key, tile metadata, the timestamp of its source image and a CRC-32 checksum.
+ *  The index is rebuilt by scanning the segments when the cache is opened, so tiles
+ *  survive restarts. Corrupted records are skipped and a partial record at the end of a segment is truncated.
+ *
+ *  Space is reclaimed by log-structured compaction: once the cache exceeds its size,
+ *  the oldest segment is deleted after any tiles in it which have been read since they
+ *  were written are copied forward to the current segment (second chance FIFO).
+ *
+ *  Each process uses its own slot sub-directory (slot-0, slot-1 etc.), claimed with an
+ *  exclusive lock, so that several server processes can share the same cache path.
+ *  Tiles are not shared between slots and the size limit applies to each slot, so the
+ *  disk space used by a cache path is up to its size multiplied by the number of processes.
+ */
+
+class DiskCache {
+
+ private:
+
+  /// A segment file
+  struct Segment {
+    int fd;                          /**< file descriptor */
+    unsigned char* data;             /**< read-only mapping of the whole segment */
+    size_t mapped;                   /**< size of mapping */
+    size_t size;                     /**< number of bytes written */
+  };
+
+  /// Location of a tile within our segments
+  struct Location {
+    uint32_t segment;                /**< segment number */
+    uint32_t length;                 /**< total record length */
+    uint64_t offset;                 /**< offset of record within segment */
+    int64_t timestamp;               /**< source image timestamp */
+    bool accessed;                   /**< read since written or last compaction */
+  };
+
+  /// Index typedef
+  typedef HASHMAP < std::string, Location > Index;
+
+  /// Our slot directory, its lock file descriptor and the maximum size of the cache and of each segment
+  std::string path;
+  int lock;
+  uint64_t maxSize, segmentSize;
+
+  /// Segments in order of age
+  std::map<uint32_t,Segment> segments;
+
+  /// Index of tiles
+  Index index;
+
+  /// Total bytes in all segments
+  uint64_t totalSize;
+
+  /// Statistics
+  unsigned long hits, misses, writes, stale, corrupt, compactions;
+
+
+  /// Return the file name of a segment
+  std::string segmentName( uint32_t n ) const;
+
+  /// Open and map a segment, creating it if necessary
+  Segment& openSegment( uint32_t n );
+
+  /// Unmap, close and delete a segment
+  void removeSegment( uint32_t n );
+
+  /// Scan a segment, adding valid records to our index and truncating any partial record at the end
+  void scanSegment( uint32_t n );
+
+  /// Append an encoded record to our current segment and index it
+  /** @param record record data
+   *  @param length record length
+   *  @param key cache key
+   *  @param timestamp source image timestamp
+   *  @return whether the record was written
+   */
+  bool append( const unsigned char* record, uint32_t length, const std::string& key, int64_t timestamp );
+
+  /// Compact the oldest segment
+  void compact();
+
+  /// Copy constructor and assignment - not permitted
+  DiskCache( const DiskCache& );
+  DiskCache& operator= ( const DiskCache& );
+
+
+ public:
+
+  /// Constructor
+  /** Opens or creates the cache, claiming a free slot and rebuilding its index
+   *  @param p cache directory
+   *  @param size maximum size in MB of this process's slot
+   */
+  DiskCache( const std::string& p, float size );
+
+  /// Destructor
+  ~DiskCache();
+
+  /// Whether a tile of this compression type is held on disk
+  static bool storable( CompressionType c ) { return c != UNCOMPRESSED; }
+
+  /// Insert a tile
+  /** @param r tile to store */
+  void insert( const RawTile& r );
+
+  /// Get a tile from the cache
+  /**
+   *  @param f filename
+   *  @param r resolution number
+   *  @param t tile number
+   *  @param h horizontal sequence number
+   *  @param v vertical sequence number
+   *  @param c compression type
+   *  @param q compression quality
+   *  @param timestamp timestamp of source image: older tiles are discarded
+   *  @param tile tile to receive our data
+   *  @return whether the tile was found
+   */
+  bool getTile( const std::string& f, int r, int t, int h, int v, CompressionType c, int q,
+		time_t timestamp, RawTile& tile );
+
+  /// Return the slot directory in use
+  const std::string& getPath() const { return path; }
+
+  /// Return the number of tiles in the cache
+  unsigned int getNumElements() const { return index.size(); }
+
+  /// Return a summary of the cache contents and statistics
+  std::string getStatistics() const;
+
+};
+
+
+#endif
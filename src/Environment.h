@@ -29,6 +29,9 @@
 #define MAX_IMAGE_CACHE_SIZE 10.0
 #define FILENAME_PATTERN "_pyr_"
 #define JPEG_QUALITY 75
+#define PNG_COMPRESSION_LEVEL 1
+#define WEBP_QUALITY 75
+#define WEBP_METHOD 2
 #define MAX_CVT 5000
 #define MAX_LAYERS 0
 #define FILESYSTEM_PREFIX ""
@@ -37,6 +40,8 @@
 #define WATERMARK_OPACITY 1.0
 #define LIBMEMCACHED_SERVERS "localhost"
 #define LIBMEMCACHED_TIMEOUT 86400  // 24 hours
+#define MEMCACHED_TILES false
+#define MEMCACHED_READ_TIMEOUT 50  // milliseconds
 #define INTERPOLATION 1  // 1: Bilinear
 #define CORS "";
 #define BASE_URL "";
@@ -44,9 +49,22 @@
 #define ALLOW_UPSCALING true
 #define URI_MAP ""
 #define EMBED_ICC true
+#define MEMORY_POOL_SIZE 64.0
+#define JPEG_PARALLEL_SIZE 0
+#define CACHE_JPEG_ENCODING 1
+#define CACHE_DEFLATE_LEVEL 1
+#define CACHE_RAW_SHARE 0.25
+#define CACHE_POLICY "lru"
+#define RESPONSE_CACHE_SIZE 8.0
+#define RESPONSE_CACHE_MAX_ITEM 128
+#define NEGATIVE_CACHE_TTL 10
+#define HTTP_KEEPALIVE_TIMEOUT 15
+#define DISK_CACHE_SIZE 1024.0
+#define SHARED_CACHE_SIZE 256.0
 
 
 #include <string>
+#include <algorithm>
 
 
 /// Class to obtain environment variables
@@ -84,6 +102,50 @@ class Environment {
   }
 
 
+  static float getResponseCacheSize(){
+    float size = RESPONSE_CACHE_SIZE;
+    char* envpara = getenv( "RESPONSE_CACHE_SIZE" );
+    if( envpara ){
+      size = atof( envpara );
+      if( size < 0 ) size = RESPONSE_CACHE_SIZE;
+    }
+    return size;
+  }
+
+
+  static unsigned int getResponseCacheMaxItem(){
+    int max_item = RESPONSE_CACHE_MAX_ITEM;
+    char* envpara = getenv( "RESPONSE_CACHE_MAX_ITEM" );
+    if( envpara ){
+      max_item = atoi( envpara );
+      if( max_item <= 0 ) max_item = RESPONSE_CACHE_MAX_ITEM;
+    }
+    return max_item;
+  }
+
+
+  static unsigned int getNegativeCacheTTL(){
+    int ttl = NEGATIVE_CACHE_TTL;
+    char* envpara = getenv( "NEGATIVE_CACHE_TTL" );
+    if( envpara ){
+      ttl = atoi( envpara );
+      if( ttl < 0 ) ttl = NEGATIVE_CACHE_TTL;
+    }
+    return ttl;
+  }
+
+
+  static unsigned int getHTTPKeepAliveTimeout(){
+    int timeout = HTTP_KEEPALIVE_TIMEOUT;
+    char* envpara = getenv( "HTTP_KEEPALIVE_TIMEOUT" );
+    if( envpara ){
+      timeout = atoi( envpara );
+      if( timeout < 1 ) timeout = HTTP_KEEPALIVE_TIMEOUT;
+    }
+    return timeout;
+  }
+
+
   static std::string getFileNamePattern(){
     char* envpara = getenv( "FILENAME_PATTERN" );
     std::string filename_pattern;
@@ -110,6 +172,48 @@ class Environment {
   }
 
 
+  static int getPNGCompressionLevel(){
+    char* envpara = getenv( "PNG_COMPRESSION_LEVEL" );
+    int level;
+    if( envpara ){
+      level = atoi( envpara );
+      if( level > 9 ) level = 9;
+      if( level < 0 ) level = 0;
+    }
+    else level = PNG_COMPRESSION_LEVEL;
+
+    return level;
+  }
+
+
+  static int getWebPQuality(){
+    char* envpara = getenv( "WEBP_QUALITY" );
+    int quality;
+    if( envpara ){
+      quality = atoi( envpara );
+      if( quality > 100 ) quality = 100;
+      if( quality < 0 ) quality = 0;
+    }
+    else quality = WEBP_QUALITY;
+
+    return quality;
+  }
+
+
+  static int getWebPMethod(){
+    char* envpara = getenv( "WEBP_METHOD" );
+    int method;
+    if( envpara ){
+      method = atoi( envpara );
+      if( method > 6 ) method = 6;
+      if( method < 0 ) method = 0;
+    }
+    else method = WEBP_METHOD;
+
+    return method;
+  }
+
+
   static int getMaxCVT(){
     char* envpara = getenv( "MAX_CVT" );
     int max_CVT;
@@ -207,6 +311,25 @@ class Environment {
   }
 
 
+  static unsigned int getMemcachedReadTimeout(){
+    char* envpara = getenv( "MEMCACHED_READ_TIMEOUT" );
+    int read_timeout = MEMCACHED_READ_TIMEOUT;
+    if( envpara ){
+      read_timeout = atoi( envpara );
+      if( read_timeout <= 0 ) read_timeout = MEMCACHED_READ_TIMEOUT;
+    }
+    return read_timeout;
+  }
+
+
+  static bool getMemcachedTiles(){
+    char* envpara = getenv( "MEMCACHED_TILES" );
+    bool memcached_tiles = MEMCACHED_TILES;
+    if( envpara ) memcached_tiles = ( atoi( envpara ) != 0 );
+    return memcached_tiles;
+  }
+
+
   static unsigned int getInterpolation(){
     char* envpara = getenv( "INTERPOLATION" );
     unsigned int interpolation;
@@ -270,6 +393,116 @@ class Environment {
     return embed;
   }
 
+
+  static float getMemoryPoolSize(){
+    float memory_pool_size = MEMORY_POOL_SIZE;
+    char* envpara = getenv( "MEMORY_POOL_SIZE" );
+    if( envpara ){
+      memory_pool_size = atof( envpara );
+      if( memory_pool_size < 0 ) memory_pool_size = 0;
+    }
+    return memory_pool_size;
+  }
+
+
+  static float getJPEGParallelSize(){
+    float jpeg_parallel_size = JPEG_PARALLEL_SIZE;
+    char* envpara = getenv( "JPEG_PARALLEL_SIZE" );
+    if( envpara ){
+      jpeg_parallel_size = atof( envpara );
+      if( jpeg_parallel_size < 0 ) jpeg_parallel_size = 0;
+    }
+    return jpeg_parallel_size;
+  }
+
+
+  static int getCacheJPEGEncoding(){
+    int encoding = CACHE_JPEG_ENCODING;
+    char* envpara = getenv( "CACHE_JPEG_ENCODING" );
+    if( envpara ){
+      encoding = atoi( envpara );
+      if( encoding < 0 || encoding > 2 ) encoding = CACHE_JPEG_ENCODING;
+    }
+    return encoding;
+  }
+
+
+  static int getCacheDeflateLevel(){
+    int level = CACHE_DEFLATE_LEVEL;
+    char* envpara = getenv( "CACHE_DEFLATE_LEVEL" );
+    if( envpara ){
+      level = atoi( envpara );
+      if( level < 0 || level > 9 ) level = CACHE_DEFLATE_LEVEL;
+    }
+    return level;
+  }
+
+
+  static float getCacheRawShare(){
+    float share = CACHE_RAW_SHARE;
+    char* envpara = getenv( "CACHE_RAW_SHARE" );
+    if( envpara ){
+      share = atof( envpara );
+      if( share < 0.0 || share > 1.0 ) share = CACHE_RAW_SHARE;
+    }
+    return share;
+  }
+
+
+  static std::string getCachePolicy(){
+    char* envpara = getenv( "CACHE_POLICY" );
+    std::string policy = CACHE_POLICY;
+    if( envpara ){
+      policy = std::string( envpara );
+      transform( policy.begin(), policy.end(), policy.begin(), ::tolower );
+      if( policy != "lru" && policy != "slru" && policy != "tinylfu" ) policy = CACHE_POLICY;
+    }
+    return policy;
+  }
+
+
+  static std::string getDiskCachePath(){
+    char* envpara = getenv( "DISK_CACHE_PATH" );
+    if( envpara ) return std::string( envpara );
+    else return std::string();
+  }
+
+
+  static float getDiskCacheSize(){
+    float size = DISK_CACHE_SIZE;
+    char* envpara = getenv( "DISK_CACHE_SIZE" );
+    if( envpara ){
+      size = atof( envpara );
+      if( size <= 0 ) size = DISK_CACHE_SIZE;
+    }
+    return size;
+  }
+
+
+  static std::string getSharedCacheName(){
+    char* envpara = getenv( "SHARED_CACHE_NAME" );
+    if( envpara ) return std::string( envpara );
+    else return std::string();
+  }
+
+
+  static float getSharedCacheSize(){
+    float size = SHARED_CACHE_SIZE;
+    char* envpara = getenv( "SHARED_CACHE_SIZE" );
+    if( envpara ){
+      size = atof( envpara );
+      if( size <= 0 ) size = SHARED_CACHE_SIZE;
+    }
+    return size;
+  }
+
+
+  static std::string getCacheTrace(){
+    char* envpara = getenv( "CACHE_TRACE" );
+    if( envpara ) return std::string( envpara );
+    else return std::string();
+  }
+
 };
 
 
@@ -78,10 +78,21 @@ void FIF::run( Session* session, const string& src ){
   // Timestamp of cached image
   time_t timestamp = 0;
 
+  // Whether this image is already known to be missing
+  bool missing = false;
+
 
   // Put the image setup into a try block as object creation can throw an exception
   try{
 
+    // Refuse images which we have recently failed to find without touching the file system
+    string message;
+    if( session->negativeCache && session->negativeCache->find( argument, message ) ){
+      if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: Negative cache hit" << endl;
+      missing = true;
+      throw file_error( message );
+    }
+
     // Check whether cache is empty
     if( session->imageCache->empty() ){
       if( session->loglevel >= 1 ) *(session->logfile) << "FIF :: Image cache initialization" << endl;
@@ -208,14 +219,20 @@ void FIF::run( Session* session, const string& src ){
 
   }
   catch( const file_error& error ){
+    // Remember the failure, watching the directory in which we looked for the image
+    if( session->negativeCache && !missing ){
+      session->negativeCache->insert( argument, filesystem_prefix + argument, error.what() );
+    }
     // Unavailable file error code is 1 3
     session->response->setError( "1 3", "FIF" );
     throw error;
   }
 
 
-  // Check whether we have had an if_modified_since header. If so, compare to our image timestamp
-  if( session->headers.find("HTTP_IF_MODIFIED_SINCE") != session->headers.end() ){
+  // Check whether we have had an if_modified_since header. If so, compare to our image timestamp.
+  // An if_none_match header takes precedence and is checked against the response entity tag later
+  if( session->headers.find("HTTP_IF_MODIFIED_SINCE") != session->headers.end() &&
+      session->headers.find("HTTP_IF_NONE_MATCH") == session->headers.end() ){
 
     tm mod_t;
     time_t t;
@@ -0,0 +1,661 @@
+/*  IIP Server: Native HTTP/1.1 front end
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "HTTPServer.h"
+
+
+using namespace std;
+
+
+// Largest request header block we accept
+#define MAX_HEADER_SIZE 16384
+
+// Largest request body we will read and discard
+#define MAX_BODY_SIZE 65536
+
+// Stop reading from a connection once this much unparsed input is waiting
+#define MAX_INPUT (MAX_HEADER_SIZE + MAX_BODY_SIZE)
+
+// Do not start on a connection's next pipelined request while this much output is unsent
+#define MAX_PENDING_OUTPUT (1024*1024)
+
+// Maximum number of open connections: further connections are closed straight away
+#define MAX_CONNECTIONS 8192
+
+// Number of events handled per epoll_wait() call
+#define MAX_EVENTS 256
+
+
+
+/// Case insensitive comparison of header names and tokens
+static bool iequals( const string& a, const char* b ){
+  size_t n = strlen( b );
+  if( a.size() != n ) return false;
+  for( size_t i = 0; i < n; i++ ){
+    if( tolower( (unsigned char) a[i] ) != tolower( (unsigned char) b[i] ) ) return false;
+  }
+  return true;
+}
+
+
+/// Whether a comma separated header value contains a token
+static bool hasToken( const string& value, const char* token ){
+  size_t start = 0;
+  while( start <= value.size() ){
+    size_t end = value.find( ',', start );
+    if( end == string::npos ) end = value.size();
+    string t = value.substr( start, end - start );
+    size_t first = t.find_first_not_of( " \t" );
+    if( first != string::npos ){
+      t = t.substr( first, t.find_last_not_of( " \t" ) - first + 1 );
+      if( iequals( t, token ) ) return true;
+    }
+    start = end + 1;
+  }
+  return false;
+}
+
+
+/// Current time as an HTTP date, formatted once per second
+static const string& httpDate( time_t now ){
+  static time_t last = 0;
+  static string date;
+  if( now != last ){
+    struct tm t;
+    char str[64];
+    gmtime_r( &now, &t );
+    strftime( str, sizeof(str), "%a, %d %b %Y %H:%M:%S GMT", &t );
+    date = str;
+    last = now;
+  }
+  return date;
+}
+
+
+
+HTTPServer::HTTPServer( const string& address, int backlog, unsigned int t, bool reuseport ) :
+  listener( -1 ), epoll( -1 ), timeout( t ), responseWriter( response ), swept( 0 ),
+  accepted( 0 ), requests( 0 ), reused( 0 ), pipelined( 0 ), rejected( 0 ), timeouts( 0 ), bytes( 0 )
+{
+  // Split our address into host and port: an empty host means all interfaces
+  size_t colon = address.find_last_of( ':' );
+  string host = ( colon == string::npos ) ? "" : address.substr( 0, colon );
+  string port = ( colon == string::npos ) ? address : address.substr( colon + 1 );
+  if( host.size() > 1 && host[0] == '[' && host[host.size()-1] == ']' ) host = host.substr( 1, host.size() - 2 );
+  if( port.empty() ) throw string( "HTTPServer :: No port given in '" + address + "'" );
+
+  struct addrinfo hints, *result;
+  memset( &hints, 0, sizeof(hints) );
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  int error = getaddrinfo( host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &result );
+  if( error != 0 ){
+    throw string( "HTTPServer :: Unable to resolve '" + address + "': " + gai_strerror( error ) );
+  }
+
+  // Use the first address we can bind to
+  for( struct addrinfo* a = result; a && listener == -1; a = a->ai_next ){
+    listener = socket( a->ai_family, a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, a->ai_protocol );
+    if( listener == -1 ) continue;
+    int on = 1;
+    setsockopt( listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+#ifdef SO_REUSEPORT
+    if( reuseport ) setsockopt( listener, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on) );
+#endif
+    if( bind( listener, a->ai_addr, a->ai_addrlen ) == -1 || listen( listener, backlog ) == -1 ){
+      close( listener );
+      listener = -1;
+    }
+  }
+  freeaddrinfo( result );
+
+  if( listener == -1 ){
+    throw string( "HTTPServer :: Unable to listen on '" + address + "': " + strerror( errno ) );
+  }
+
+  epoll = epoll_create1( EPOLL_CLOEXEC );
+  if( epoll == -1 ){
+    close( listener );
+    throw string( "HTTPServer :: Unable to create epoll instance: " + string( strerror( errno ) ) );
+  }
+
+  struct epoll_event event;
+  memset( &event, 0, sizeof(event) );
+  event.events = EPOLLIN;
+  event.data.fd = listener;
+  epoll_ctl( epoll, EPOLL_CTL_ADD, listener, &event );
+
+  envp.push_back( NULL );
+}
+
+
+
+HTTPServer::~HTTPServer()
+{
+  for( map<int,Connection>::const_iterator c = connections.begin(); c != connections.end(); ++c ){
+    close( c->first );
+  }
+  if( epoll != -1 ) close( epoll );
+  if( listener != -1 ) close( listener );
+}
+
+
+
+void HTTPServer::acceptConnections()
+{
+  while( true ){
+
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    int fd = accept4( listener, (struct sockaddr*) &address, &length, SOCK_NONBLOCK | SOCK_CLOEXEC );
+    if( fd == -1 ){
+      if( errno == EINTR || errno == ECONNABORTED ) continue;
+      // EAGAIN means we have accepted everything. On errors such as EMFILE, we try again later
+      return;
+    }
+
+    if( connections.size() >= MAX_CONNECTIONS ){
+      close( fd );
+      rejected++;
+      continue;
+    }
+
+    // Our responses are written in one go, so there is nothing to gain from delaying small packets
+    int on = 1;
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on) );
+
+    char host[NI_MAXHOST];
+    if( getnameinfo( (struct sockaddr*) &address, length, host, sizeof(host), NULL, 0, NI_NUMERICHOST ) != 0 ) host[0] = '\0';
+
+    Connection& c = connections[fd];
+    c.fd = fd;
+    c.address = host;
+    c.sent = 0;
+    c.active = time( NULL );
+    c.events = 0;
+    c.served = 0;
+    c.busy = c.close = c.eof = c.dead = false;
+    update( c );
+    accepted++;
+  }
+}
+
+
+
+void HTTPServer::readConnection( Connection& c )
+{
+  char buffer[16384];
+
+  while( c.in.size() < MAX_INPUT ){
+    ssize_t n = recv( c.fd, buffer, sizeof(buffer), 0 );
+    if( n > 0 ){
+      c.in.append( buffer, n );
+      c.active = time( NULL );
+      continue;
+    }
+    if( n == -1 && errno == EINTR ) continue;
+    if( n == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) break;
+    if( n == -1 ){
+      closeConnection( c.fd );
+      return;
+    }
+    c.eof = true;
+    break;
+  }
+
+  parse( c );
+
+  // A client which has finished sending still gets responses to all the requests it has completed
+  if( finished( c ) ){
+    closeConnection( c.fd );
+    return;
+  }
+  update( c );
+}
+
+
+
+bool HTTPServer::writeConnection( Connection& c )
+{
+  while( c.sent < c.out.size() ){
+    ssize_t n = send( c.fd, c.out.data() + c.sent, c.out.size() - c.sent, MSG_NOSIGNAL );
+    if( n > 0 ){
+      c.sent += n;
+      bytes += n;
+      c.active = time( NULL );
+      continue;
+    }
+    if( n == -1 && errno == EINTR ) continue;
+    if( n == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) return true;
+    return false;
+  }
+
+  c.out.clear();
+  c.sent = 0;
+  return true;
+}
+
+
+
+void HTTPServer::parse( Connection& c )
+{
+  // Requests on a connection are processed one at a time and in order
+  if( c.busy || c.close || c.in.empty() || c.out.size() - c.sent > MAX_PENDING_OUTPUT ) return;
+
+  // Ignore empty lines before a request line, as RFC 7230 asks
+  size_t skip = c.in.find_first_not_of( "\r\n" );
+  if( skip == string::npos ){
+    c.in.clear();
+    return;
+  }
+  if( skip > 0 ) c.in.erase( 0, skip );
+
+  size_t end = c.in.find( "\r\n\r\n" );
+  if( end == string::npos ){
+    if( c.in.size() > MAX_HEADER_SIZE ) reject( c, "431 Request Header Fields Too Large" );
+    return;
+  }
+  if( end > MAX_HEADER_SIZE ){
+    reject( c, "431 Request Header Fields Too Large" );
+    return;
+  }
+
+  Request r;
+  r.fd = c.fd;
+
+  // Request line: method, target and protocol
+  size_t eol = c.in.find( "\r\n" );
+  string line = c.in.substr( 0, eol );
+  size_t s1 = line.find( ' ' );
+  size_t s2 = ( s1 == string::npos ) ? string::npos : line.find( ' ', s1 + 1 );
+  if( s2 == string::npos || line.find( ' ', s2 + 1 ) != string::npos ){
+    reject( c, "400 Bad Request" );
+    return;
+  }
+  r.method = line.substr( 0, s1 );
+  r.target = line.substr( s1 + 1, s2 - s1 - 1 );
+  r.protocol = line.substr( s2 + 1 );
+
+  if( r.protocol != "HTTP/1.1" && r.protocol != "HTTP/1.0" ){
+    reject( c, "505 HTTP Version Not Supported" );
+    return;
+  }
+
+  // Reduce any absolute form target to its path and query
+  if( r.target.compare( 0, 7, "http://" ) == 0 || r.target.compare( 0, 8, "https://" ) == 0 ){
+    size_t path = r.target.find( '/', r.target.find( "//" ) + 2 );
+    r.target = ( path == string::npos ) ? "/" : r.target.substr( path );
+  }
+  if( r.target.empty() || r.target[0] != '/' ){
+    reject( c, "400 Bad Request" );
+    return;
+  }
+
+  // Headers, which we pass on as CGI meta-variables
+  map<string,string> headers;
+  size_t contentLength = 0;
+  bool chunked = false;
+  string connection;
+
+  for( size_t pos = eol + 2; pos < end; ){
+    size_t next = c.in.find( "\r\n", pos );
+    if( next == string::npos || next > end ) next = end;
+    string header = c.in.substr( pos, next - pos );
+    pos = next + 2;
+
+    size_t colon = header.find( ':' );
+    if( colon == string::npos || colon == 0 ){
+      reject( c, "400 Bad Request" );
+      return;
+    }
+    string name = header.substr( 0, colon );
+    size_t first = header.find_first_not_of( " \t", colon + 1 );
+    string value = ( first == string::npos ) ? "" : header.substr( first, header.find_last_not_of( " \t" ) - first + 1 );
+
+    if( iequals( name, "Content-Length" ) ) contentLength = strtoul( value.c_str(), NULL, 10 );
+    else if( iequals( name, "Transfer-Encoding" ) ) chunked = true;
+    else if( iequals( name, "Connection" ) ) connection = value;
+
+    string variable = "HTTP_" + name;
+    for( size_t i = 5; i < variable.size(); i++ ){
+      variable[i] = ( variable[i] == '-' ) ? '_' : toupper( (unsigned char) variable[i] );
+    }
+    if( headers.find( variable ) != headers.end() ) headers[variable] += ", " + value;
+    else headers[variable] = value;
+  }
+
+  // We only serve GET and HEAD requests, so only need to skip any body we have been sent
+  if( chunked ){
+    reject( c, "501 Not Implemented" );
+    return;
+  }
+  if( contentLength > MAX_BODY_SIZE ){
+    reject( c, "413 Payload Too Large" );
+    return;
+  }
+  if( c.in.size() < end + 4 + contentLength ) return;
+
+  if( r.method != "GET" && r.method != "HEAD" ){
+    c.in.erase( 0, end + 4 + contentLength );
+    reject( c, "405 Method Not Allowed", "Allow: GET, HEAD\r\n" );
+    return;
+  }
+
+  // HTTP/1.1 connections are persistent unless the client says otherwise, HTTP/1.0 ones only if it asks
+  if( r.protocol == "HTTP/1.1" ) r.keepAlive = !hasToken( connection, "close" );
+  else r.keepAlive = hasToken( connection, "keep-alive" );
+
+  if( c.in.size() > end + 4 + contentLength ) pipelined++;
+  c.in.erase( 0, end + 4 + contentLength );
+
+  size_t q = r.target.find( '?' );
+  r.environment.push_back( "QUERY_STRING=" + ( q == string::npos ? string() : r.target.substr( q + 1 ) ) );
+  r.environment.push_back( "REQUEST_URI=" + r.target );
+  r.environment.push_back( "REQUEST_METHOD=" + r.method );
+  r.environment.push_back( "SERVER_PROTOCOL=" + r.protocol );
+  r.environment.push_back( "REMOTE_ADDR=" + c.address );
+  for( map<string,string>::const_iterator h = headers.begin(); h != headers.end(); ++h ){
+    r.environment.push_back( h->first + "=" + h->second );
+  }
+
+  c.busy = true;
+  ready.push_back( r );
+}
+
+
+
+void HTTPServer::reject( Connection& c, const string& status, const string& extra )
+{
+  string body = status + "\r\n";
+  c.out += "HTTP/1.1 " + status + "\r\n"
+    "Date: " + httpDate( time( NULL ) ) + "\r\n" + extra +
+    "Content-Type: text/plain\r\n";
+  char length[64];
+  snprintf( length, sizeof(length), "Content-Length: %lu\r\n", (unsigned long) body.size() );
+  c.out += string( length ) + "Connection: close\r\n\r\n" + body;
+  c.in.clear();
+  c.close = true;
+  rejected++;
+}
+
+
+
+void HTTPServer::update( Connection& c )
+{
+  unsigned int events = 0;
+  if( !c.close && !c.eof && c.in.size() < MAX_INPUT ) events |= EPOLLIN;
+  if( c.sent < c.out.size() ) events |= EPOLLOUT;
+  // We always hear about errors and hang ups
+  if( events == 0 ) events = EPOLLRDHUP;
+
+  if( events == c.events ) return;
+
+  struct epoll_event event;
+  memset( &event, 0, sizeof(event) );
+  event.events = events;
+  event.data.fd = c.fd;
+  epoll_ctl( epoll, c.events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c.fd, &event );
+  c.events = events;
+}
+
+
+
+void HTTPServer::closeConnection( int fd )
+{
+  map<int,Connection>::iterator c = connections.find( fd );
+  if( c == connections.end() ) return;
+
+  // Keep the socket open until we have finished with its request so that its descriptor cannot be reused
+  if( c->second.busy ){
+    c->second.dead = true;
+    c->second.close = true;
+    return;
+  }
+
+  epoll_ctl( epoll, EPOLL_CTL_DEL, fd, NULL );
+  close( fd );
+  connections.erase( c );
+}
+
+
+
+void HTTPServer::sweep( time_t now )
+{
+  vector<int> idle;
+  for( map<int,Connection>::const_iterator c = connections.begin(); c != connections.end(); ++c ){
+    if( !c->second.busy && now - c->second.active >= (time_t) timeout ) idle.push_back( c->first );
+  }
+  for( vector<int>::const_iterator fd = idle.begin(); fd != idle.end(); ++fd ){
+    closeConnection( *fd );
+    timeouts++;
+  }
+  swept = now;
+}
+
+
+
+bool HTTPServer::accept()
+{
+  struct epoll_event events[MAX_EVENTS];
+
+  while( ready.empty() ){
+
+    // Return if interrupted by a signal so that our caller can act on it
+    int n = epoll_wait( epoll, events, MAX_EVENTS, 1000 );
+    if( n == -1 ) return false;
+
+    for( int i = 0; i < n; i++ ){
+
+      int fd = events[i].data.fd;
+      if( fd == listener ){
+	acceptConnections();
+	continue;
+      }
+
+      map<int,Connection>::iterator it = connections.find( fd );
+      if( it == connections.end() ) continue;
+      Connection& c = it->second;
+
+      if( events[i].events & EPOLLOUT ){
+	if( !writeConnection( c ) ){
+	  closeConnection( fd );
+	  continue;
+	}
+	if( c.out.empty() && c.close ){
+	  closeConnection( fd );
+	  continue;
+	}
+	// Output has drained, so we may be able to start on a pipelined request
+	parse( c );
+	if( finished( c ) ){
+	  closeConnection( fd );
+	  continue;
+	}
+	update( c );
+      }
+
+      if( events[i].events & EPOLLIN ) readConnection( c );
+      else if( events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP) ) closeConnection( fd );
+    }
+
+    time_t now = time( NULL );
+    if( now != swept ) sweep( now );
+  }
+
+  current = ready.front();
+  ready.pop_front();
+
+  envp.clear();
+  for( vector<string>::iterator e = current.environment.begin(); e != current.environment.end(); ++e ){
+    envp.push_back( &(*e)[0] );
+  }
+  envp.push_back( NULL );
+
+  response.clear();
+  responseWriter.release();
+  return true;
+}
+
+
+
+void HTTPServer::finish()
+{
+  requests++;
+
+  map<int,Connection>::iterator it = connections.find( current.fd );
+  if( it == connections.end() ) return;
+  Connection& c = it->second;
+  c.busy = false;
+
+  if( c.dead ){
+    closeConnection( c.fd );
+    return;
+  }
+  if( c.served++ > 0 ) reused++;
+
+  // Split our CGI response into its headers and body
+  size_t end = response.find( "\r\n\r\n" );
+  size_t bodyStart = ( end == string::npos ) ? 0 : end + 4;
+  string status = "200 OK";
+  string head;
+  bool framed = false;
+
+  if( end != string::npos ){
+    for( size_t pos = 0; pos < end; ){
+      size_t next = response.find( "\r\n", pos );
+      if( next == string::npos || next > end ) next = end;
+      size_t colon = response.find( ':', pos );
+      if( colon != string::npos && colon < next ){
+	string name = response.substr( pos, colon - pos );
+	size_t first = response.find_first_not_of( " \t", colon + 1 );
+	string value = ( first == string::npos || first > next ) ? "" : response.substr( first, next - first );
+	if( iequals( name, "Status" ) ) status = value;
+	else if( iequals( name, "Content-Length" ) || iequals( name, "Connection" ) ){}
+	else{
+	  if( iequals( name, "Transfer-Encoding" ) ) framed = true;
+	  head.append( response, pos, next - pos );
+	  head += "\r\n";
+	}
+      }
+      pos = next + 2;
+    }
+  }
+
+  // Responses to HEAD requests and 1xx, 204 and 304 responses never have a body. HEAD
+  // responses still give the length of the body which a GET would have received
+  int code = atoi( status.c_str() );
+  bool nobody = ( code < 200 || code == 204 || code == 304 );
+  size_t length = response.size() - bodyStart;
+  if( nobody ) framed = true;
+  size_t count = ( nobody || current.method == "HEAD" ) ? 0 : length;
+
+  // Without a Content-Length, a response can only be ended by closing the connection
+  if( !current.keepAlive ) c.close = true;
+
+  string header = "HTTP/1.1 " + status + "\r\nDate: " + httpDate( time( NULL ) ) + "\r\n" + head;
+  if( !framed ){
+    char str[64];
+    snprintf( str, sizeof(str), "Content-Length: %lu\r\n", (unsigned long) length );
+    header += str;
+  }
+  header += c.close ? "Connection: close\r\n\r\n" : "Connection: keep-alive\r\n\r\n";
+
+  // Send straight from our response buffer if nothing is waiting ahead of us, keeping whatever the socket will not take
+  if( c.out.empty() ){
+    struct iovec iov[2];
+    iov[0].iov_base = (void*) header.data();
+    iov[0].iov_len = header.size();
+    iov[1].iov_base = (void*) ( response.data() + bodyStart );
+    iov[1].iov_len = count;
+
+    struct msghdr message;
+    memset( &message, 0, sizeof(message) );
+    message.msg_iov = iov;
+    message.msg_iovlen = 2;
+
+    ssize_t n;
+    do n = sendmsg( c.fd, &message, MSG_NOSIGNAL );
+    while( n == -1 && errno == EINTR );
+
+    if( n == -1 && errno != EAGAIN && errno != EWOULDBLOCK ){
+      closeConnection( c.fd );
+      return;
+    }
+    size_t sent = ( n > 0 ) ? n : 0;
+    bytes += sent;
+    if( sent < header.size() ){
+      c.out.append( header, sent, string::npos );
+      c.out.append( response, bodyStart, count );
+    }
+    else c.out.append( response, bodyStart + sent - header.size(), count - ( sent - header.size() ) );
+  }
+  else{
+    c.out += header;
+    c.out.append( response, bodyStart, count );
+    if( !writeConnection( c ) ){
+      closeConnection( c.fd );
+      return;
+    }
+  }
+
+  c.active = time( NULL );
+
+  if( c.out.empty() && c.close ){
+    closeConnection( c.fd );
+    return;
+  }
+
+  // Start on any request the client has already pipelined
+  parse( c );
+  if( finished( c ) ){
+    closeConnection( c.fd );
+    return;
+  }
+  update( c );
+}
+
+
+
+string HTTPServer::getStatistics() const
+{
+  char tmp[256];
+  snprintf( tmp, sizeof(tmp), "%lu connections open, %lu accepted, %lu requests, %lu on reused connections, "
+	    "%lu pipelined, %lu rejected, %lu timed out, %.2f MB sent",
+	    (unsigned long) connections.size(), accepted, requests, reused, pipelined, rejected, timeouts,
+	    bytes / (1024.0*1024.0) );
+  return string( tmp );
+}
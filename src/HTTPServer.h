@@ -0,0 +1,211 @@
+/*  IIP Server: Native HTTP/1.1 front end
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _HTTPSERVER_H
+#define _HTTPSERVER_H
+
+
+#include <ctime>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include "Writer.h"
+
+
+
+/// Writer which collects a CGI style response in memory for the HTTP server to send
+class HTTPWriter : public Writer {
+
+ private:
+
+  std::string& out;
+
+ public:
+
+  /// Constructor
+  /** @param o buffer to which our response is appended */
+  HTTPWriter( std::string& o ) : out( o ) {};
+
+  int putStr( const char* msg, int len ){
+    cpy2buf( msg, len );
+    out.append( msg, len );
+    return len;
+  };
+  int putStr( const char* header, int hlen, const char* body, int blen ){
+    cpy2buf( header, hlen );
+    cpy2buf( body, blen );
+    out.append( header, hlen );
+    out.append( body, blen );
+    return blen;
+  };
+  int putS( const char* msg ){
+    return putStr( msg, strlen(msg) );
+  };
+  int printf( const char* msg ){
+    return putStr( msg, strlen(msg) );
+  };
+
+  /// Nothing is sent until the whole response is complete
+  int flush(){ return 0; };
+
+};
+
+
+
+/// Event driven HTTP/1.1 server
+/** Accepts connections and parses requests on non-blocking sockets with an epoll event
+ *  loop, and hands complete requests one at a time to the same request processing loop
+ *  used for FastCGI: accept() waits for a request and provides its CGI style environment
+ *  and a writer, and finish() sends what was written. Connections are kept alive and
+ *  pipelined requests are answered in order, while sockets are only ever read or written
+ *  when ready, so slow clients never hold up others.
+ *
+ *  Our request handlers write CGI responses, so finish() turns any Status header into the
+ *  HTTP status line and sets the framing headers itself.
+ */
+
+class HTTPServer {
+
+ private:
+
+  /// A client connection
+  struct Connection {
+    int fd;
+    std::string address;             /**< client address */
+    std::string in;                  /**< data received and not yet parsed */
+    std::string out;                 /**< response data not yet sent */
+    size_t sent;                     /**< bytes of out already sent */
+    time_t active;                   /**< time of last activity */
+    unsigned int events;             /**< events for which we are registered */
+    unsigned int served;             /**< number of requests answered */
+    bool busy;                       /**< a request from this connection is being processed */
+    bool close;                      /**< close once our output has been sent */
+    bool eof;                        /**< client has finished sending */
+    bool dead;                       /**< client has gone away during processing */
+  };
+
+  /// A parsed request
+  struct Request {
+    int fd;
+    std::string method, target, protocol;
+    std::vector<std::string> environment;
+    bool keepAlive;
+  };
+
+  /// Listening socket, epoll instance and idle connection timeout in seconds
+  int listener;
+  int epoll;
+  unsigned int timeout;
+
+  /// Our connections, indexed by socket
+  std::map<int,Connection> connections;
+
+  /// Requests waiting to be processed and the one being processed
+  std::deque<Request> ready;
+  Request current;
+  std::vector<char*> envp;
+
+  /// Response being written and its writer
+  std::string response;
+  HTTPWriter responseWriter;
+
+  /// Time of our last check for idle connections
+  time_t swept;
+
+  /// Statistics
+  unsigned long accepted, requests, reused, pipelined, rejected, timeouts;
+  unsigned long long bytes;
+
+
+  /// Accept all pending connections
+  void acceptConnections();
+
+  /// Read from a connection
+  void readConnection( Connection& c );
+
+  /// Send as much pending output as the socket will take
+  /** @return false if the connection failed */
+  bool writeConnection( Connection& c );
+
+  /// Parse the next request in a connection's input if it can be processed now
+  void parse( Connection& c );
+
+  /// Queue a response generated by the server itself and close the connection after it
+  void reject( Connection& c, const std::string& status, const std::string& extra = "" );
+
+  /// Register the events we currently need for a connection
+  void update( Connection& c );
+
+  /// Whether a connection can be closed as all its output has been sent and nothing more is to follow
+  /** This is the case once it is marked for closing, or once a client which has finished sending has
+      had responses to every complete request it sent */
+  bool finished( const Connection& c ) const {
+    return !c.busy && c.sent >= c.out.size() && ( c.close || c.eof );
+  }
+
+  /// Close a connection, or mark it for closing if it is being processed
+  void closeConnection( int fd );
+
+  /// Close connections which have been idle for too long
+  void sweep( time_t now );
+
+  /// Copy constructor and assignment - not permitted
+  HTTPServer( const HTTPServer& );
+  HTTPServer& operator= ( const HTTPServer& );
+
+
+ public:
+
+  /// Constructor
+  /** Opens our listening socket
+      @param address address to listen on in the form "host:port" or ":port"
+      @param backlog listen backlog
+      @param t idle connection timeout in seconds
+      @param reuseport whether to share the port with other processes through SO_REUSEPORT
+   */
+  HTTPServer( const std::string& address, int backlog, unsigned int t, bool reuseport = false );
+
+  /// Destructor: closes all connections
+  ~HTTPServer();
+
+  /// Wait for the next request
+  /** @return false on a fatal error or if interrupted by a signal, in which case errno is EINTR */
+  bool accept();
+
+  /// Return the CGI style environment of the current request for use with FCGX_GetParam()
+  char** environment(){ return &envp[0]; };
+
+  /// Return the writer for the response to the current request
+  Writer& writer(){ return responseWriter; };
+
+  /// Send the response written for the current request
+  void finish();
+
+  /// Return the number of open connections
+  unsigned int getNumConnections() const { return connections.size(); }
+
+  /// Return a summary of our statistics
+  std::string getStatistics() const;
+
+};
+
+
+#endif
@@ -205,7 +205,14 @@ void IIIF::run( Session* session, const string& src )
                      << "  ]," << endl
                      << "  \"profile\" : [" << endl
                      << "     \"" << IIIF_PROFILE << "\"," << endl
-                     << "     { \"formats\" : [ \"jpg\" ]," << endl
+                     << "     { \"formats\" : [ \"jpg\""
+#ifdef HAVE_PNG
+                     << ", \"png\""
+#endif
+#ifdef HAVE_WEBP
+                     << ", \"webp\""
+#endif
+                     << " ]," << endl
                      << "       \"qualities\" : [ \"native\",\"color\",\"gray\" ]," << endl
                      << "       \"supports\" : [\"regionByPct\",\"regionSquare\",\"sizeByForcedWh\",\"sizeByWh\",\"sizeAboveFull\",\"rotationBy90s\",\"mirroring\"] }" << endl
                      << "  ]" << endl
@@ -466,12 +473,25 @@ void IIIF::run( Session* session, const string& src )
 
       size_t pos = quality.find_last_of(".");
 
-      // Format - if dot is not present, we use default and currently only supported format - JPEG
+      // Format - if dot is not present, we use the default format - JPEG
       if ( pos != string::npos ){
         format = quality.substr( pos + 1, string::npos );
         quality.erase( pos, string::npos );
-        if ( format != "jpg" ){
-          throw invalid_argument( "IIIF :: Only JPEG output supported" );
+        if ( format == "jpg" ){
+          session->view->output_format = JPEG;
+        }
+#ifdef HAVE_PNG
+        else if ( format == "png" ){
+          session->view->output_format = PNG;
+        }
+#endif
+#ifdef HAVE_WEBP
+        else if ( format == "webp" ){
+          session->view->output_format = WEBP;
+        }
+#endif
+        else{
+          throw invalid_argument( "IIIF :: Unsupported output format: " + format );
         }
       }
 
@@ -34,6 +34,7 @@ IIPResponse::IIPResponse(){
   server = "Server: iipsrv/" + string(VERSION);
   powered = "X-Powered-By: IIPImage";
   modified = "";
+  etag = "";
   mimeType = "Content-Type: application/vnd.netfpx";
   cors = "";
   eof = "\r\n";
@@ -46,6 +46,7 @@ class IIPResponse{
   std::string powered;             // Powered By header
   std::string modified;            // Last modified header
   std::string cacheControl;        // Cache control header
+  std::string etag;                // Entity tag header
   std::string mimeType;            // Mime type header
   std::string eof;                 // End of response delimitter eg "\r\n"
   std::string protocol;            // IIP protocol version
@@ -133,6 +134,15 @@ class IIPResponse{
   std::string getCacheControl(){ return cacheControl; };
 
 
+  /// Set the ETag header
+  /** @param e entity tag */
+  void setETag( const std::string& e ){ etag = "ETag: " + e; };
+
+
+  /// Get the ETag header or an empty string if none has been set
+  std::string getETag(){ return etag; };
+
+
   /// Get a formatted string to send back
   std::string formatResponse();
 
@@ -20,6 +20,11 @@
 
 
 #include "JPEGCompressor.h"
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 using namespace std;
@@ -27,6 +32,10 @@ using namespace std;
 
 #define MX 65535
 
+/* Maximum size of working buffer to hold on to between images
+ */
+#define MAX_RETAINED_BUFFER 4*1024*1024
+
 
 /* Since an ICC profile can be larger than the maximum size of a JPEG marker
  * (64K), we need provisions to split it into multiple markers.  The format
@@ -58,9 +67,10 @@ METHODDEF(void) iip_error_exit( j_common_ptr cinfo )
    */
   (*cinfo->err->format_message) ( cinfo, buffer );
 
-  /* Let the memory manager delete any temp files before we die
+  /* Abort the current image, freeing its memory and any temp files, but
+     keep the JPEG object itself so that it can be reused
    */
-  jpeg_destroy( cinfo );
+  jpeg_abort( cinfo );
 
   /* throw an exception rather than print out a message and exit
    */
@@ -74,6 +84,10 @@ extern "C" {
   void setup_error_functions( jpeg_compress_struct *a ){
     a->err->error_exit = iip_error_exit; 
   }
+
+  void setup_decompress_error_functions( jpeg_decompress_struct *a ){
+    a->err->error_exit = iip_error_exit;
+  }
 }
 
 
@@ -107,14 +121,14 @@ iip_init_destination (j_compress_ptr cinfo)
   */
   mx += MX;
 
-  /* Allocate the output buffer --- it will be released when done with image   
-  dest->buffer = (JOCTET *)
-    (*cinfo->mem->alloc_small) ( (j_common_ptr) cinfo, JPOOL_IMAGE,
-				 mx * sizeof(JOCTET) );
+  /* Our working buffer is kept between images and only reallocated if it is
+     too small
   */
-
-  // In fact just allocate with new
-  dest->buffer = new JOCTET[mx];
+  if( dest->capacity < mx ){
+    MemoryPool::release( dest->buffer );
+    dest->buffer = (JOCTET*) MemoryPool::allocate( mx );
+    dest->capacity = mx;
+  }
   dest->size = mx;
 
   // Set compressor pointers for library
@@ -131,6 +145,19 @@ iip_empty_output_buffer( j_compress_ptr cinfo )
   iip_dest_ptr dest = (iip_dest_ptr) cinfo->dest;
   size_t datacount = dest->size;
 
+  // For whole image compression, simply enlarge our buffer
+  if( dest->strip_height == 0 ){
+    JOCTET *buffer = (JOCTET*) MemoryPool::allocate( datacount * 2 );
+    memcpy( buffer, dest->buffer, datacount );
+    MemoryPool::release( dest->buffer );
+    dest->buffer = buffer;
+    dest->capacity = datacount * 2;
+    dest->size = datacount * 2;
+    dest->pub.next_output_byte = buffer + datacount;
+    dest->pub.free_in_buffer = datacount;
+    return TRUE;
+  }
+
   // Copy the JPEG data to our output tile buffer
   if( datacount > 0 ){
     if( datacount > cinfo->image_width*dest->strip_height*cinfo->input_components + MX ){
@@ -163,39 +190,225 @@ void iip_term_destination( j_compress_ptr cinfo )
   iip_dest_ptr dest = (iip_dest_ptr) cinfo->dest;
   size_t datacount = dest->size - dest->pub.free_in_buffer;
 
-  // Copy the JPEG data to our output tile buffer
-  if( datacount > 0 ){
+  // Copy the JPEG data to our output strip buffer. For whole images, the data
+  // is taken directly from our working buffer
+  if( datacount > 0 && dest->strip_height > 0 ){
     memcpy( dest->source, dest->buffer, datacount );
   }
 
   dest->size = datacount;
+}
+
+
+
+
+/*
+ * Source and destination managers for lossless transformation of in-memory
+ * JPEG data. The source simply points to the existing compressed tile, while
+ * the destination grows a pooled buffer as needed.
+ */
+
+METHODDEF(void)
+iip_init_source( j_decompress_ptr cinfo ){}
 
-  delete[] dest->buffer;
+
+METHODDEF(boolean)
+iip_fill_input_buffer( j_decompress_ptr cinfo )
+{
+  // We have already supplied all our data, so the stream must be truncated.
+  // Insert a fake EOI marker, as recommended by the IJG documentation
+  static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+  cinfo->src->next_input_byte = eoi;
+  cinfo->src->bytes_in_buffer = 2;
+  return TRUE;
 }
 
 
+METHODDEF(void)
+iip_skip_input_data( j_decompress_ptr cinfo, long num_bytes )
+{
+  if( num_bytes <= 0 ) return;
+  if( (size_t) num_bytes > cinfo->src->bytes_in_buffer ){
+    iip_fill_input_buffer( cinfo );
+    return;
+  }
+  cinfo->src->next_input_byte += num_bytes;
+  cinfo->src->bytes_in_buffer -= num_bytes;
+}
 
 
-void JPEGCompressor::InitCompression( const RawTile& rawtile, unsigned int strip_height )
+METHODDEF(void)
+iip_term_source( j_decompress_ptr cinfo ){}
+
+
+
+METHODDEF(void)
+iip_init_transform_destination( j_compress_ptr cinfo )
 {
-  // Do some initialisation
-  dest = &dest_mgr;
+  iip_memory_destination_mgr *dest = (iip_memory_destination_mgr*) cinfo->dest;
+  dest->buffer = (JOCTET*) MemoryPool::allocate( dest->capacity );
+  dest->pub.next_output_byte = dest->buffer;
+  dest->pub.free_in_buffer = dest->capacity;
+}
 
-  // Set up the correct width and height for this particular tile
-  width = rawtile.width;
-  height = rawtile.height;
-  channels = rawtile.channels;
+
+METHODDEF(boolean)
+iip_empty_transform_buffer( j_compress_ptr cinfo )
+{
+  // Our buffer is full, so double its size
+  iip_memory_destination_mgr *dest = (iip_memory_destination_mgr*) cinfo->dest;
+  JOCTET *buffer = (JOCTET*) MemoryPool::allocate( dest->capacity * 2 );
+  memcpy( buffer, dest->buffer, dest->capacity );
+  MemoryPool::release( dest->buffer );
+  dest->buffer = buffer;
+  dest->pub.next_output_byte = buffer + dest->capacity;
+  dest->pub.free_in_buffer = dest->capacity;
+  dest->capacity *= 2;
+  return TRUE;
+}
 
 
-  // Make sure we only try to compress images with 1 or 3 channels
-  if( ! ( (channels==1) || (channels==3) )  ){
-    throw string( "JPEGCompressor: JPEG can only handle images of either 1 or 3 channels" );
+METHODDEF(void)
+iip_term_transform_destination( j_compress_ptr cinfo )
+{
+  iip_memory_destination_mgr *dest = (iip_memory_destination_mgr*) cinfo->dest;
+  dest->size = dest->capacity - dest->pub.free_in_buffer;
+}
+
+
+
+
+/*
+ * Destination manager for parallel band encoding. As our MemoryPool is not
+ * thread-safe, band buffers are allocated directly with malloc and realloc
+ */
+
+METHODDEF(void)
+iip_init_band_destination( j_compress_ptr cinfo )
+{
+  iip_memory_destination_mgr *dest = (iip_memory_destination_mgr*) cinfo->dest;
+  dest->buffer = (JOCTET*) malloc( dest->capacity );
+  if( !dest->buffer ) throw string( "JPEGCompressor :: Unable to allocate band buffer" );
+  dest->pub.next_output_byte = dest->buffer;
+  dest->pub.free_in_buffer = dest->capacity;
+}
+
+
+METHODDEF(boolean)
+iip_empty_band_buffer( j_compress_ptr cinfo )
+{
+  iip_memory_destination_mgr *dest = (iip_memory_destination_mgr*) cinfo->dest;
+  JOCTET *buffer = (JOCTET*) realloc( dest->buffer, dest->capacity * 2 );
+  if( !buffer ) throw string( "JPEGCompressor :: Unable to enlarge band buffer" );
+  dest->buffer = buffer;
+  dest->pub.next_output_byte = buffer + dest->capacity;
+  dest->pub.free_in_buffer = dest->capacity;
+  dest->capacity *= 2;
+  return TRUE;
+}
+
+
+
+
+/* Return the offset just after the SOI marker and any JFIF APP0 segment of a
+   JPEG stream. This is where we insert our own markers into output from
+   encoders that do not write them for us
+ */
+static size_t app0End( const unsigned char* jpeg, size_t length )
+{
+  if( length > 6 && jpeg[2] == 0xFF && jpeg[3] == JPEG_APP0 ){
+    return 4 + ( (jpeg[4] << 8) | jpeg[5] );
   }
+  return 2;
+}
 
-  // JPEG can only handle 8 bit data
-  if( rawtile.bpc != 8 ) throw string( "JPEGCompressor: JPEG can only handle 8 bit images" );
 
 
+
+/* Return the offset of the entropy-coded data following the SOS header
+   of a JPEG stream and, optionally, the offset of the SOF marker
+ */
+static size_t scanDataStart( const unsigned char* jpeg, size_t length, size_t* sof )
+{
+  size_t i = 2;
+  while( i + 4 <= length && jpeg[i] == 0xFF ){
+    unsigned char marker = jpeg[i+1];
+    size_t len = (jpeg[i+2] << 8) | jpeg[i+3];
+    if( sof && marker >= 0xC0 && marker <= 0xC2 ) *sof = i;
+    i += 2 + len;
+    if( marker == 0xDA ) return i;
+  }
+  throw string( "JPEGCompressor :: Unable to find scan data in JPEG band" );
+}
+
+
+
+
+/* Encode a single horizontal band as a complete JPEG image with a restart
+   marker at the end of every MCU row. Each band uses its own JPEG object, so
+   this can safely be called in parallel
+ */
+static void compressBand( unsigned char* data, unsigned int width, unsigned int height,
+			  unsigned int channels, int quality, iip_memory_destination_mgr* dest )
+{
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+
+  cinfo.err = jpeg_std_error( &jerr );
+  setup_error_functions( &cinfo );
+  jpeg_create_compress( &cinfo );
+
+  cinfo.dest = (struct jpeg_destination_mgr*) dest;
+  dest->pub.init_destination = iip_init_band_destination;
+  dest->pub.empty_output_buffer = iip_empty_band_buffer;
+  dest->pub.term_destination = iip_term_transform_destination;
+  dest->capacity = width * height * channels / 4 + MX;
+
+  try{
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = channels;
+    cinfo.in_color_space = ( channels == 3 ? JCS_RGB : JCS_GRAYSCALE );
+    jpeg_set_defaults( &cinfo );
+    cinfo.dct_method = JDCT_FASTEST;
+    jpeg_set_quality( &cinfo, quality, TRUE );
+    cinfo.restart_in_rows = 1;
+
+    jpeg_start_compress( &cinfo, TRUE );
+
+    JSAMPROW rows[16];
+    unsigned int row_stride = width * channels;
+    while( cinfo.next_scanline < cinfo.image_height ){
+      unsigned int n = 0;
+      while( n < 16 && cinfo.next_scanline + n < cinfo.image_height ){
+	rows[n] = &data[ (size_t)( cinfo.next_scanline + n ) * row_stride ];
+	n++;
+      }
+      jpeg_write_scanlines( &cinfo, rows, n );
+    }
+
+    jpeg_finish_compress( &cinfo );
+  }
+  catch( ... ){
+    jpeg_destroy_compress( &cinfo );
+    throw;
+  }
+
+  jpeg_destroy_compress( &cinfo );
+}
+
+
+
+
+JPEGCompressor::JPEGCompressor( int quality )
+{
+  Q = quality;
+  table_quality = -1;
+  table_channels = 0;
+  huffman_optimized = false;
+  parallel_size = 0;
+  cache_encoding = JPEG_STANDARD;
+
   // We set up the normal JPEG error routines, then override error_exit.
   cinfo.err = jpeg_std_error( &jerr );
 
@@ -211,38 +424,128 @@ void JPEGCompressor::InitCompression( const RawTile& rawtile, unsigned int strip
 
   jpeg_create_compress( &cinfo );
 
+  // Keep a copy of the standard Huffman tables, which are overwritten in place
+  // by libjpeg whenever optimized tables are generated
+  cinfo.in_color_space = JCS_RGB;
+  cinfo.input_components = 3;
+  jpeg_set_defaults( &cinfo );
+  for( int i = 0; i < 2; i++ ){
+    standard_dc[i] = *cinfo.dc_huff_tbl_ptrs[i];
+    standard_ac[i] = *cinfo.ac_huff_tbl_ptrs[i];
+  }
+
 
   /* The destination object is made permanent so that multiple JPEG images
-   * can be written to the same file without re-executing jpeg_stdio_dest.
-   * This makes it dangerous to use this manager and a different destination
-   * manager serially with the same JPEG object, because their private object
-   * sizes may be different.  Caveat programmer.
+   * can be written with the same JPEG object. Its working buffer is allocated
+   * on first use and kept between images.
    */
-  if( !cinfo.dest ){
-    // first time for this JPEG object?
-    cinfo.dest = ( struct jpeg_destination_mgr* )
-      ( *cinfo.mem->alloc_small )
-      ( (j_common_ptr) &cinfo, JPOOL_PERMANENT, sizeof( iip_destination_mgr ) );
-  }
-
+  cinfo.dest = ( struct jpeg_destination_mgr* )
+    ( *cinfo.mem->alloc_small )
+    ( (j_common_ptr) &cinfo, JPOOL_PERMANENT, sizeof( iip_destination_mgr ) );
 
   dest = (iip_dest_ptr) cinfo.dest;
   dest->pub.init_destination = iip_init_destination;
-  //dest->pub.empty_output_buffer = iip_empty_output_buffer;
+  dest->pub.empty_output_buffer = iip_empty_output_buffer;
   dest->pub.term_destination = iip_term_destination;
-  dest->strip_height = strip_height;
+  dest->buffer = NULL;
+  dest->capacity = 0;
+  dest->size = 0;
+  dest->source = NULL;
+  dest->strip_height = 0;
+
+#ifdef HAVE_TURBOJPEG
+  tj = tjInitCompress();
+  tj_buffer = NULL;
+  tj_buffer_size = 0;
+#endif
+}
+
+
 
+
+JPEGCompressor::~JPEGCompressor()
+{
+  MemoryPool::release( dest->buffer );
+  jpeg_destroy_compress( &cinfo );
+
+#ifdef HAVE_TURBOJPEG
+  if( tj_buffer ) tjFree( tj_buffer );
+  if( tj ) tjDestroy( tj );
+#endif
+}
+
+
+
+
+void JPEGCompressor::setParameters( JPEGEncoding encoding )
+{
   cinfo.image_width = width;
   cinfo.image_height = height;
   cinfo.input_components = channels;
   cinfo.in_color_space = ( channels == 3 ? JCS_RGB : JCS_GRAYSCALE );
-  jpeg_set_defaults( &cinfo );
 
-  // Set compression point quality (highest, but possibly slower depending
-  //  on hardware) - must do this after we've set the defaults!
-  cinfo.dct_method = JDCT_FASTEST;
+  // Defaults depend on the colour space, so only reset these if the number of
+  // channels has changed. This also resets our quantization tables
+  if( (int) channels != table_channels ){
+    jpeg_set_defaults( &cinfo );
+
+    // Set DCT method (fastest, but possibly less accurate depending
+    //  on hardware) - must do this after we've set the defaults!
+    cinfo.dct_method = JDCT_FASTEST;
+
+    table_channels = channels;
+    table_quality = -1;
+  }
+
+  // libjpeg stores optimized Huffman tables in place of the standard ones, so
+  // these must be restored before we can use standard encoding again
+  if( encoding == JPEG_STANDARD && huffman_optimized ){
+    for( int i = 0; i < 2; i++ ){
+      *cinfo.dc_huff_tbl_ptrs[i] = standard_dc[i];
+      *cinfo.ac_huff_tbl_ptrs[i] = standard_ac[i];
+    }
+    huffman_optimized = false;
+  }
+
+  // Only rebuild our quantization tables when the quality changes
+  if( Q != table_quality ){
+    jpeg_set_quality( &cinfo, Q, TRUE );
+    table_quality = Q;
+  }
+
+  // Huffman table optimization requires an extra pass over the data, but is
+  // automatically used by libjpeg for progressive encoding
+  cinfo.optimize_coding = ( encoding != JPEG_STANDARD ) ? TRUE : FALSE;
+  if( encoding != JPEG_STANDARD ) huffman_optimized = true;
+  if( encoding == JPEG_PROGRESSIVE ) jpeg_simple_progression( &cinfo );
+  else{
+    cinfo.scan_info = NULL;
+    cinfo.num_scans = 0;
+  }
+}
+
+
+
+
+void JPEGCompressor::InitCompression( const RawTile& rawtile, unsigned int strip_height )
+{
+  // Set up the correct width and height for this particular tile
+  width = rawtile.width;
+  height = rawtile.height;
+  channels = rawtile.channels;
+
+
+  // Make sure we only try to compress images with 1 or 3 channels
+  if( ! ( (channels==1) || (channels==3) )  ){
+    throw string( "JPEGCompressor: JPEG can only handle images of either 1 or 3 channels" );
+  }
+
+  // JPEG can only handle 8 bit data
+  if( rawtile.bpc != 8 ) throw string( "JPEGCompressor: JPEG can only handle 8 bit images" );
+
+  dest->strip_height = strip_height;
 
-  jpeg_set_quality( &cinfo, Q, TRUE );
+  setParameters();
 
   jpeg_start_compress( &cinfo, TRUE );
 
@@ -321,7 +624,8 @@ unsigned int JPEGCompressor::Finish( unsigned char* output )
 
   size_t datacount = dest->size;
 
-  jpeg_destroy_compress( &cinfo );
+  // Our object is kept for the next image, so just reset our strip mode
+  dest->strip_height = 0;
 
   return datacount;
 }
@@ -329,13 +633,10 @@ unsigned int JPEGCompressor::Finish( unsigned char* output )
 
 
 
-int JPEGCompressor::Compress( RawTile& rawtile )
+int JPEGCompressor::Compress( RawTile& rawtile, bool cache )
 {
   // Do some initialisation
   data = (unsigned char*) rawtile.data;
-  struct jpeg_error_mgr jerr;
-  iip_destination_mgr dest_mgr;
-  iip_dest_ptr dest = &dest_mgr;
 
 
   // Set up the correct width and height for this particular tile
@@ -352,59 +653,23 @@ int JPEGCompressor::Compress( RawTile& rawtile )
   // JPEG can only handle 8 bit data
   if( rawtile.bpc != 8 ) throw string( "JPEGCompressor: JPEG can only handle 8 bit images" );
 
-  // We set up the normal JPEG error routines, then override error_exit.
-  cinfo.err = jpeg_std_error( &jerr );
 
+  // Tiles destined for our cache can use a slower, but more compact encoding
+  JPEGEncoding encoding = cache ? cache_encoding : JPEG_STANDARD;
 
-  // Overide the error_exit function with our own.
-  // Hmmm, we have to do this assignment in C due to the strong type checking of C++
-  //  or something like that. So, we use an extern "C" function declared at the top
-  //  of this file and pass our arguments through this. I'm sure there's a better
-  //  way of doing this, but this seems to work :/
-
-  //   cinfo.err.error_exit = iip_error_exit;
-  setup_error_functions( &cinfo );
-
-  jpeg_create_compress( &cinfo );
+  // Encode large images in parallel bands. This requires identical standard
+  // Huffman tables for each band
+  if( encoding == JPEG_STANDARD && useWholeImage( width, height ) ) return CompressBands( rawtile );
 
+#ifdef HAVE_TURBOJPEG
+  if( tj && encoding == JPEG_STANDARD ) return CompressTurbo( rawtile );
+#endif
 
-  /* The destination object is made permanent so that multiple JPEG images
-   * can be written to the same file without re-executing jpeg_stdio_dest.
-   * This makes it dangerous to use this manager and a different destination
-   * manager serially with the same JPEG object, because their private object
-   * sizes may be different.  Caveat programmer.
-   */
-  if( !cinfo.dest ){
-
-    // first time for this JPEG object?
-    cinfo.dest = ( struct jpeg_destination_mgr* )
-      ( *cinfo.mem->alloc_small )
-      ( (j_common_ptr) &cinfo, JPOOL_PERMANENT, sizeof( iip_destination_mgr ) );
-  }
 
-
-  dest = (iip_dest_ptr) cinfo.dest;
-  dest->pub.init_destination = iip_init_destination;
-  dest->pub.empty_output_buffer = iip_empty_output_buffer;
-  dest->pub.term_destination = iip_term_destination;
+  // Output goes directly into our working buffer
   dest->strip_height = 0;
 
-  // Allocate memory for our destination
-  dest->source = new unsigned char[width*height*channels + MX]; // Add some extra buffering
-
-  // Set floating point quality (highest, but possibly slower depending
-  //  on hardware)
-  cinfo.image_width = width;
-  cinfo.image_height = height;
-  cinfo.input_components = channels;
-  cinfo.in_color_space = ( channels == 3 ? JCS_RGB : JCS_GRAYSCALE );
-  jpeg_set_defaults( &cinfo );
-
-  // Set compression quality (highest, but possibly slower depending
-  //  on hardware) - must do this after we've set the defaults!
-  cinfo.dct_method = JDCT_FASTEST;
-
-  jpeg_set_quality( &cinfo, Q, TRUE );
+  setParameters( encoding );
 
   jpeg_start_compress( &cinfo, TRUE );
 
@@ -426,12 +691,11 @@ int JPEGCompressor::Compress( RawTile& rawtile )
   // Should be faster than scanlines.
   if( (row_stride * height) <= (512*512*channels) ){
 
-    JSAMPROW *array = new JSAMPROW[height];
+    JSAMPROW *array = (JSAMPROW*) Arena::allocate( height*sizeof(JSAMPROW) );
     for( y=0; y < height; y++ ){
       array[y] = &data[ y * row_stride ];
     }
     jpeg_write_scanlines( &cinfo, array, height );
-    delete[] array;
 
   }
   else{
@@ -443,26 +707,26 @@ int JPEGCompressor::Compress( RawTile& rawtile )
   }
 
 
-  // Tidy up, get the compressed data size and de-allocate memory
+  // Tidy up and get the compressed data size
   jpeg_finish_compress( &cinfo );
 
-  // Check that we have enough memory in our tile for the JPEG data.
-  // This can happen on small tiles with high quality factors. If so
-  // delete and reallocate memory.
+  // Copy the JPEG data into a buffer of exactly the right size, which replaces
+  // the tile's raw data. Never write back into the raw buffer itself as this
+  // may be a borrowed view of data we do not own
   y = dest->size;
-  if( y > rawtile.width*rawtile.height*rawtile.channels ){
-    delete[] (unsigned char*) rawtile.data;
-    rawtile.data = new unsigned char[y];
+  void* buffer = MemoryPool::allocate( y );
+  memcpy( buffer, dest->buffer, y );
+
+  // Don't hold on to exceptionally large working buffers
+  if( dest->capacity > MAX_RETAINED_BUFFER ){
+    MemoryPool::release( dest->buffer );
+    dest->buffer = NULL;
+    dest->capacity = 0;
   }
 
-  // Copy memory back to the tile
-  memcpy( rawtile.data, dest->source, y );
-  delete[] dest->source;
-  jpeg_destroy_compress( &cinfo );
-
 
   // Set the tile compression parameters
-  rawtile.dataLength = y;
+  rawtile.adopt( buffer, y );
   rawtile.compressionType = JPEG;
   rawtile.quality = Q;
 
@@ -474,6 +738,379 @@ int JPEGCompressor::Compress( RawTile& rawtile )
 
 
 
+
+#ifdef HAVE_TURBOJPEG
+
+int JPEGCompressor::CompressTurbo( RawTile& rawtile )
+{
+  int subsampling = ( channels == 3 ) ? TJSAMP_420 : TJSAMP_GRAY;
+
+  // Make sure our reusable output buffer is large enough for the worst case
+  unsigned long max_size = tjBufSize( width, height, subsampling );
+  if( max_size > tj_buffer_size ){
+    if( tj_buffer ) tjFree( tj_buffer );
+    tj_buffer = tjAlloc( max_size );
+    if( !tj_buffer ){
+      tj_buffer_size = 0;
+      throw string( "JPEGCompressor :: Unable to allocate TurboJPEG buffer" );
+    }
+    tj_buffer_size = max_size;
+  }
+
+  unsigned char* jpeg = tj_buffer;
+  unsigned long jpeg_size = tj_buffer_size;
+
+  if( tjCompress2( tj, data, width, 0, height, ( channels == 3 ) ? TJPF_RGB : TJPF_GRAY,
+		   &jpeg, &jpeg_size, subsampling, Q, TJFLAG_FASTDCT | TJFLAG_NOREALLOC ) != 0 ){
+    throw string( "JPEGCompressor :: TurboJPEG error: " ) + tjGetErrorStr2( tj );
+  }
+
+  // TurboJPEG cannot write markers of its own, so splice ours in after
+  // the SOI marker and any JFIF APP0 segment
+  string markers = getMarkers();
+  size_t offset = app0End( jpeg, jpeg_size );
+
+  size_t length = jpeg_size + markers.size();
+  unsigned char* buffer = (unsigned char*) MemoryPool::allocate( length );
+  memcpy( buffer, jpeg, offset );
+  memcpy( buffer + offset, markers.data(), markers.size() );
+  memcpy( buffer + offset + markers.size(), jpeg + offset, jpeg_size - offset );
+
+  // Set the tile compression parameters
+  rawtile.adopt( buffer, length );
+  rawtile.compressionType = JPEG;
+  rawtile.quality = Q;
+
+  return length;
+}
+
+#endif
+
+
+
+
+bool JPEGCompressor::useWholeImage( unsigned int w, unsigned int h )
+{
+#ifdef _OPENMP
+  return ( parallel_size > 0 && (unsigned long) w * h >= parallel_size && omp_get_max_threads() > 1 );
+#else
+  return false;
+#endif
+}
+
+
+
+
+int JPEGCompressor::CompressBands( RawTile& rawtile )
+{
+  int threads = 1;
+#ifdef _OPENMP
+  threads = omp_get_max_threads();
+#endif
+
+  // Bands must be a whole number of MCU rows high. In addition, make them a
+  // multiple of 8 MCU rows, so that the restart markers at the end of each row,
+  // which cycle through RST0-RST7, run on seamlessly from one band to the next.
+  // libjpeg uses 2x2 chroma subsampling for colour images by default
+  unsigned int mcu_height = ( channels == 3 ) ? 16 : 8;
+  unsigned int unit = 8 * mcu_height;
+  unsigned int band_height = ( height + threads - 1 ) / threads;
+  band_height = ( ( band_height + unit - 1 ) / unit ) * unit;
+  int bands = ( height + band_height - 1 ) / band_height;
+
+  vector<iip_memory_destination_mgr> dest( bands );
+  vector<string> errors( bands );
+  for( int b=0; b<bands; b++ ) dest[b].buffer = NULL;
+
+
+  // Exceptions must not escape from the parallel region, so catch them per band
+#if defined(_OPENMP)
+#pragma omp parallel for schedule(dynamic,1)
+#endif
+  for( int b=0; b<bands; b++ ){
+    unsigned int rows = ( b == bands-1 ) ? height - b*band_height : band_height;
+    try{
+      compressBand( &data[ (size_t) b * band_height * width * channels ], width, rows, channels, Q, &dest[b] );
+    }
+    catch( const string& error ){
+      errors[b] = error;
+    }
+    catch( ... ){
+      errors[b] = "JPEGCompressor :: Unknown error encoding band";
+    }
+  }
+
+
+  // Stitch our bands together: the headers from the first band with the image height
+  // corrected, followed by the entropy-coded data from each band separated by RST7
+  // markers and a final EOI marker
+  string error;
+  size_t length = 0;
+  vector<size_t> start( bands );
+  size_t sof = 0;
+
+  for( int b=0; b<bands && error.empty(); b++ ){
+    if( !errors[b].empty() ){
+      error = errors[b];
+      break;
+    }
+    try{
+      start[b] = scanDataStart( dest[b].buffer, dest[b].size, (b==0) ? &sof : NULL );
+    }
+    catch( const string& e ){
+      error = e;
+      break;
+    }
+    length += dest[b].size - 2 - start[b] + 2;
+  }
+
+  if( !error.empty() ){
+    for( int b=0; b<bands; b++ ) free( dest[b].buffer );
+    throw error;
+  }
+
+  string markers = getMarkers();
+  size_t offset = app0End( dest[0].buffer, dest[0].size );
+  length += start[0] + markers.size();
+
+  unsigned char* buffer = (unsigned char*) MemoryPool::allocate( length );
+  unsigned char* p = buffer;
+
+  memcpy( p, dest[0].buffer, offset );
+  p += offset;
+  memcpy( p, markers.data(), markers.size() );
+  p += markers.size();
+  memcpy( p, dest[0].buffer + offset, start[0] - offset );
+
+  // Height is at bytes 5 and 6 of the SOF segment
+  p[ sof - offset + 5 ] = ( height >> 8 ) & 0xFF;
+  p[ sof - offset + 6 ] = height & 0xFF;
+  p += start[0] - offset;
+
+  for( int b=0; b<bands; b++ ){
+    size_t len = dest[b].size - 2 - start[b];
+    memcpy( p, dest[b].buffer + start[b], len );
+    p += len;
+    *p++ = 0xFF;
+    *p++ = ( b == bands-1 ) ? JPEG_EOI : (JPEG_RST0 + 7);
+    free( dest[b].buffer );
+  }
+
+  // Set the tile compression parameters
+  rawtile.adopt( buffer, length );
+  rawtile.compressionType = JPEG;
+  rawtile.quality = Q;
+
+  return length;
+}
+
+
+
+
+bool JPEGCompressor::Transform( RawTile& rawtile, int rotation, int flip )
+{
+  if( rawtile.compressionType != JPEG ) return false;
+
+  // Express the combined flip and rotation as an optional transpose followed by
+  // mirroring of the output columns and/or rows. The flip is applied first, so
+  // under a transpose, a horizontal flip becomes a mirroring of the output rows
+  rotation = rotation % 360;
+  if( rotation < 0 ) rotation += 360;
+  if( rotation % 90 != 0 ) return false;
+
+  bool transpose = ( rotation == 90 || rotation == 270 );
+  bool mirror_x = ( rotation == 90 || rotation == 180 );
+  bool mirror_y = ( rotation == 180 || rotation == 270 );
+  if( flip == 1 ){
+    if( transpose ) mirror_y = !mirror_y;
+    else mirror_x = !mirror_x;
+  }
+  else if( flip == 2 ){
+    if( transpose ) mirror_x = !mirror_x;
+    else mirror_y = !mirror_y;
+  }
+
+  // Nothing to do
+  if( !transpose && !mirror_x && !mirror_y ) return true;
+
+
+  struct jpeg_decompress_struct dinfo;
+  struct jpeg_compress_struct tinfo;
+  struct jpeg_error_mgr djerr, tjerr;
+  iip_memory_destination_mgr tdest;
+  tdest.buffer = NULL;
+
+  dinfo.err = jpeg_std_error( &djerr );
+  setup_decompress_error_functions( &dinfo );
+  jpeg_create_decompress( &dinfo );
+
+  tinfo.err = jpeg_std_error( &tjerr );
+  setup_error_functions( &tinfo );
+  jpeg_create_compress( &tinfo );
+
+  try{
+
+    // Read directly from our tile data
+    dinfo.src = (struct jpeg_source_mgr*)
+      ( *dinfo.mem->alloc_small ) ( (j_common_ptr) &dinfo, JPOOL_PERMANENT, sizeof( struct jpeg_source_mgr ) );
+    dinfo.src->init_source = iip_init_source;
+    dinfo.src->fill_input_buffer = iip_fill_input_buffer;
+    dinfo.src->skip_input_data = iip_skip_input_data;
+    dinfo.src->resync_to_restart = jpeg_resync_to_restart;
+    dinfo.src->term_source = iip_term_source;
+    dinfo.src->next_input_byte = (const JOCTET*) rawtile.data;
+    dinfo.src->bytes_in_buffer = rawtile.dataLength;
+
+    // Keep any comment and APPn markers other than JFIF and Adobe markers, which
+    // the library regenerates itself
+    jpeg_save_markers( &dinfo, JPEG_COM, 0xFFFF );
+    for( int m=1; m<16; m++ ){
+      if( m != 14 ) jpeg_save_markers( &dinfo, JPEG_APP0+m, 0xFFFF );
+    }
+
+    jpeg_read_header( &dinfo, TRUE );
+
+    // Find our MCU size in the output orientation
+    int max_h = 1, max_v = 1;
+    for( int ci=0; ci<dinfo.num_components; ci++ ){
+      int h = transpose ? dinfo.comp_info[ci].v_samp_factor : dinfo.comp_info[ci].h_samp_factor;
+      int v = transpose ? dinfo.comp_info[ci].h_samp_factor : dinfo.comp_info[ci].v_samp_factor;
+      if( h > max_h ) max_h = h;
+      if( v > max_v ) max_v = v;
+    }
+
+    unsigned int out_width = transpose ? dinfo.image_height : dinfo.image_width;
+    unsigned int out_height = transpose ? dinfo.image_width : dinfo.image_height;
+
+    // Partial MCUs on an edge being mirrored would move padding into the image, so
+    // give up if this is the case
+    if( ( mirror_x && out_width % (max_h*DCTSIZE) != 0 ) ||
+	( mirror_y && out_height % (max_v*DCTSIZE) != 0 ) ){
+      jpeg_destroy_compress( &tinfo );
+      jpeg_destroy_decompress( &dinfo );
+      return false;
+    }
+
+    // Request our output coefficient arrays before the input is read in, padded
+    // to whole MCUs in the same way as the library does internally
+    jvirt_barray_ptr *dst_coef = (jvirt_barray_ptr*)
+      ( *dinfo.mem->alloc_small ) ( (j_common_ptr) &dinfo, JPOOL_IMAGE, sizeof(jvirt_barray_ptr) * dinfo.num_components );
+    JDIMENSION *dst_w = (JDIMENSION*) Arena::allocate( sizeof(JDIMENSION) * dinfo.num_components );
+    JDIMENSION *dst_h = (JDIMENSION*) Arena::allocate( sizeof(JDIMENSION) * dinfo.num_components );
+
+    for( int ci=0; ci<dinfo.num_components; ci++ ){
+      int h = transpose ? dinfo.comp_info[ci].v_samp_factor : dinfo.comp_info[ci].h_samp_factor;
+      int v = transpose ? dinfo.comp_info[ci].h_samp_factor : dinfo.comp_info[ci].v_samp_factor;
+      JDIMENSION w_blocks = ( out_width*h + max_h*DCTSIZE - 1 ) / ( max_h*DCTSIZE );
+      JDIMENSION h_blocks = ( out_height*v + max_v*DCTSIZE - 1 ) / ( max_v*DCTSIZE );
+      dst_w[ci] = ( (w_blocks + h - 1) / h ) * h;
+      dst_h[ci] = ( (h_blocks + v - 1) / v ) * v;
+      dst_coef[ci] = ( *dinfo.mem->request_virt_barray )
+	( (j_common_ptr) &dinfo, JPOOL_IMAGE, FALSE, dst_w[ci], dst_h[ci], (JDIMENSION) v );
+    }
+
+    jvirt_barray_ptr *src_coef = jpeg_read_coefficients( &dinfo );
+
+
+    // Set up our output with the same quantization and sampling as our input
+    jpeg_copy_critical_parameters( &dinfo, &tinfo );
+
+    if( transpose ){
+      tinfo.image_width = out_width;
+      tinfo.image_height = out_height;
+      for( int ci=0; ci<tinfo.num_components; ci++ ){
+	int h = tinfo.comp_info[ci].h_samp_factor;
+	tinfo.comp_info[ci].h_samp_factor = tinfo.comp_info[ci].v_samp_factor;
+	tinfo.comp_info[ci].v_samp_factor = h;
+      }
+      // Quantization tables are also transposed
+      for( int t=0; t<NUM_QUANT_TBLS; t++ ){
+	JQUANT_TBL *qtbl = tinfo.quant_tbl_ptrs[t];
+	if( !qtbl ) continue;
+	for( int i=0; i<DCTSIZE; i++ ){
+	  for( int j=0; j<i; j++ ){
+	    UINT16 q = qtbl->quantval[i*DCTSIZE+j];
+	    qtbl->quantval[i*DCTSIZE+j] = qtbl->quantval[j*DCTSIZE+i];
+	    qtbl->quantval[j*DCTSIZE+i] = q;
+	  }
+	}
+      }
+    }
+
+
+    // Shuffle and transform our blocks. Output rows must be written in order.
+    // Mirroring a block negates its odd horizontal or vertical frequencies
+    for( int ci=0; ci<dinfo.num_components; ci++ ){
+      for( JDIMENSION oy=0; oy<dst_h[ci]; oy++ ){
+
+	JBLOCKROW dst_row = *( *dinfo.mem->access_virt_barray )
+	  ( (j_common_ptr) &dinfo, dst_coef[ci], oy, 1, TRUE );
+
+	JDIMENSION py = mirror_y ? dst_h[ci]-1-oy : oy;
+
+	for( JDIMENSION ox=0; ox<dst_w[ci]; ox++ ){
+
+	  JDIMENSION px = mirror_x ? dst_w[ci]-1-ox : ox;
+	  JDIMENSION sx = transpose ? py : px;
+	  JDIMENSION sy = transpose ? px : py;
+
+	  JBLOCKROW src_row = *( *dinfo.mem->access_virt_barray )
+	    ( (j_common_ptr) &dinfo, src_coef[ci], sy, 1, FALSE );
+	  JCOEFPTR in = src_row[sx];
+	  JCOEFPTR out = dst_row[ox];
+
+	  for( int v=0; v<DCTSIZE; v++ ){
+	    for( int u=0; u<DCTSIZE; u++ ){
+	      JCOEF c = transpose ? in[u*DCTSIZE+v] : in[v*DCTSIZE+u];
+	      if( ( mirror_x && (u & 1) ) != ( mirror_y && (v & 1) ) ) c = -c;
+	      out[v*DCTSIZE+u] = c;
+	    }
+	  }
+	}
+      }
+    }
+
+
+    // Write out our transformed coefficients
+    tinfo.dest = (struct jpeg_destination_mgr*) &tdest;
+    tdest.pub.init_destination = iip_init_transform_destination;
+    tdest.pub.empty_output_buffer = iip_empty_transform_buffer;
+    tdest.pub.term_destination = iip_term_transform_destination;
+    tdest.capacity = rawtile.dataLength + MX;
+    tdest.size = 0;
+
+    jpeg_write_coefficients( &tinfo, dst_coef );
+
+    // Copy across any saved markers
+    for( jpeg_saved_marker_ptr marker = dinfo.marker_list; marker; marker = marker->next ){
+      jpeg_write_marker( &tinfo, marker->marker, marker->data, marker->data_length );
+    }
+
+    jpeg_finish_compress( &tinfo );
+    jpeg_destroy_compress( &tinfo );
+    jpeg_destroy_decompress( &dinfo );
+  }
+  catch( const string& error ){
+    jpeg_destroy_compress( &tinfo );
+    jpeg_destroy_decompress( &dinfo );
+    if( tdest.buffer ) MemoryPool::release( tdest.buffer );
+    throw string( "JPEGCompressor :: Lossless transform error: " + error );
+  }
+
+
+  // Replace our tile data with the transformed tile
+  rawtile.adopt( tdest.buffer, tdest.size );
+  if( transpose ){
+    unsigned int w = rawtile.width;
+    rawtile.width = rawtile.height;
+    rawtile.height = w;
+  }
+
+  return true;
+}
+
+
+
 // Write ICC profile into JPEG header if profile has been set
 // Function *must* be called AFTER calling jpeg_start_compress() and BEFORE
 // the first call to jpeg_write_scanlines().
@@ -545,7 +1182,8 @@ void JPEGCompressor::writeICCProfile()
 
 void JPEGCompressor::writeXMPMetadata()
 {
-  if( xmp.size() == 0 ) return;
+  // XMP packets too large for a single marker segment cannot be embedded
+  if( xmp.size() == 0 || 29 + xmp.size() > MAX_BYTES_IN_MARKER ) return;
 
   // The XMP data in a JPEG stream needs to be prefixed with a zero-terminated ID string
   // ref http://www.adobe.com/content/dam/Adobe/en/devnet/xmp/pdfs/cs6/XMPSpecificationPart3.pdf (pp13-14)
@@ -560,3 +1198,47 @@ void JPEGCompressor::writeXMPMetadata()
   // Can't use regular addMetadata, because of the zero term after the namespace id; and the APP1 marker
   jpeg_write_marker( &cinfo, JPEG_APP0+1, (const JOCTET*) xmpstr, 29 + xmp.size() );
 }
+
+
+
+// Append a complete marker segment to a string
+static void appendMarker( string& out, int marker, const char* data, unsigned int length )
+{
+  out += (char) 0xFF;
+  out += (char) marker;
+  out += (char) ( ( length + 2 ) >> 8 );
+  out += (char) ( ( length + 2 ) & 0xFF );
+  out.append( data, length );
+}
+
+
+
+string JPEGCompressor::getMarkers()
+{
+  string markers;
+
+  // Identifying comment
+  appendMarker( markers, JPEG_COM, "Generated by IIPImage", 21 );
+
+  // ICC profile split into APP2 chunks as for writeICCProfile()
+  if( icc.size() > 0 ){
+    unsigned int num_markers = ( icc.size() + MAX_DATA_BYTES_IN_MARKER - 1 ) / MAX_DATA_BYTES_IN_MARKER;
+    for( unsigned int n = 0; n < num_markers; n++ ){
+      string chunk( "ICC_PROFILE", 12 );
+      chunk += (char) (n+1);
+      chunk += (char) num_markers;
+      chunk += icc.substr( n*MAX_DATA_BYTES_IN_MARKER, MAX_DATA_BYTES_IN_MARKER );
+      appendMarker( markers, ICC_MARKER, chunk.data(), chunk.size() );
+    }
+  }
+
+  // XMP metadata with its zero-terminated namespace prefix, skipped as for writeXMPMetadata()
+  // if too large for the 16 bit length of a single marker segment
+  if( xmp.size() > 0 && 29 + xmp.size() <= MAX_BYTES_IN_MARKER ){
+    string x( "http://ns.adobe.com/xap/1.0/", 29 );
+    x += xmp;
+    appendMarker( markers, JPEG_APP0+1, x.data(), x.size() );
+  }
+
+  return markers;
+}
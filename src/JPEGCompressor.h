@@ -35,6 +35,10 @@ extern "C"{
 #include <jpeglib.h>
 }
 
+#ifdef HAVE_TURBOJPEG
+#include <turbojpeg.h>
+#endif
+
 
 
 /// Expanded data destination object for buffered output used by IJG JPEG library
@@ -45,6 +49,7 @@ typedef struct {
 
   size_t size;                       /**< size of source data */
   JOCTET *buffer;		     /**< working buffer */
+  size_t capacity;                   /**< allocated size of working buffer */
   unsigned char* source;             /**< source data */
   unsigned int strip_height;         /**< used for stream-based encoding */
 
@@ -54,8 +59,31 @@ typedef iip_destination_mgr * iip_dest_ptr;
 
 
 
-/// Wrapper class to the IJG JPEG library
+/// Growable in-memory destination used for lossless transformations and band encoding
+
+typedef struct {
+  struct jpeg_destination_mgr pub;   /**< public fields */
+
+  JOCTET *buffer;                    /**< pooled output buffer */
+  size_t capacity;                   /**< allocated size of buffer */
+  size_t size;                       /**< size of output data once finished */
+
+} iip_memory_destination_mgr;
+
+
 
+/// JPEG encodings: standard Huffman tables, optimized Huffman tables or progressive
+enum JPEGEncoding { JPEG_STANDARD, JPEG_OPTIMIZED, JPEG_PROGRESSIVE };
+
+
+
+/// Wrapper class to the IJG JPEG library
+/** A single long-lived compressor is intended to be reused for all requests:
+    the underlying libjpeg object and its working buffer are created once and the
+    quantization and Huffman tables are only rebuilt when the quality or number of
+    channels changes. Where the TurboJPEG API from libjpeg-turbo is available, whole
+    tiles are encoded through this instead.
+*/
 class JPEGCompressor: public Compressor{
 	
  private:
@@ -63,9 +91,6 @@ class JPEGCompressor: public Compressor{
   /// the width, height and number of channels per sample for the image
   unsigned int width, height, channels;
 
-  /// The JPEG quality factor
-  int Q;
-
   /// Buffer for the JPEG header
   unsigned char header[1024];
 
@@ -78,21 +103,62 @@ class JPEGCompressor: public Compressor{
   /// JPEG library objects
   struct jpeg_compress_struct cinfo;
   struct jpeg_error_mgr jerr;
-  iip_destination_mgr dest_mgr;
   iip_dest_ptr dest;
 
+  /// Quality and number of channels for which our current tables were set up
+  int table_quality, table_channels;
+
+  /// Whether our standard Huffman tables have been overwritten by an optimized encoding
+  bool huffman_optimized;
+
+  /// Copies of the standard luminance and chrominance Huffman tables
+  JHUFF_TBL standard_dc[2], standard_ac[2];
+
+  /// Minimum image size in pixels for parallel band encoding (0 to disable)
+  unsigned long parallel_size;
+
+  /// Encoding to use for tiles that are to be cached
+  JPEGEncoding cache_encoding;
+
+  /// Compress an image as independent horizontal bands in parallel
+  int CompressBands( RawTile& t );
+
+#ifdef HAVE_TURBOJPEG
+  /// TurboJPEG compressor handle and reusable output buffer
+  tjhandle tj;
+  unsigned char *tj_buffer;
+  unsigned long tj_buffer_size;
+
+  /// Compress a tile with TurboJPEG
+  int CompressTurbo( RawTile& t );
+#endif
+
+  /// Set up compression parameters for the current image, only rebuilding tables if necessary
+  /** @param encoding Huffman table and scan encoding to use */
+  void setParameters( JPEGEncoding encoding = JPEG_STANDARD );
+
   /// Write ICC profile
   void writeICCProfile();
 
   /// Write XMP metadata
   void writeXMPMetadata();
 
+  /// Serialize our comment, ICC profile and XMP metadata as complete JPEG marker segments
+  std::string getMarkers();
+
+  /// Copying is not allowed
+  JPEGCompressor( const JPEGCompressor& );
+  JPEGCompressor& operator= ( const JPEGCompressor& );
+
 
  public:
 
   /// Constructor
   /** @param quality JPEG Quality factor (0-100) */
-  JPEGCompressor( int quality ) { Q = quality; dest = NULL; };
+  JPEGCompressor( int quality );
+
+  /// Destructor
+  ~JPEGCompressor();
 
 
   /// Set the compression quality
@@ -132,8 +198,45 @@ class JPEGCompressor: public Compressor{
   unsigned int Finish( unsigned char* output );
 
   /// Compress an entire buffer of image data at once in one command
-  /** @param t tile of image data */
-  int Compress( RawTile& t );
+  /** @param t tile of image data
+      @param cache whether the tile is to be cached, in which case our cache encoding is used
+   */
+  int Compress( RawTile& t, bool cache = false );
+
+  /// Set the encoding used for tiles that are to be cached
+  /** Optimized Huffman tables typically reduce tile size by 5-15% at the cost
+      of a second pass over the data, which is only paid once for cached tiles.
+      Progressive encoding implies optimized tables.
+      @param e encoding
+   */
+  inline void setCacheEncoding( JPEGEncoding e ){ cache_encoding = e; };
+
+  /// Rotate and/or mirror an already compressed JPEG tile losslessly
+  /** The transformation is carried out on the DCT coefficients without decoding
+      or re-quantizing the image, in the same way as jpegtran. This is only possible
+      where every edge being mirrored falls on an MCU boundary: partial edge MCUs
+      cannot be moved without corrupting the image, so in this case nothing is done
+      and the caller should fall back to decoding and recompressing the tile.
+      The flip is applied before the rotation.
+      @param t JPEG compressed tile, which is replaced by the transformed tile
+      @param rotation clockwise rotation angle in degrees (multiple of 90)
+      @param flip mirroring (0=none, 1=horizontal, 2=vertical)
+      @return true if the tile was transformed, false if not possible losslessly
+   */
+  bool Transform( RawTile& t, int rotation, int flip );
+
+  /// Set the minimum image size above which images are encoded in parallel
+  /** Large images are split into horizontal bands, which are encoded independently
+      with OpenMP using restart markers and then stitched together into a single
+      baseline JPEG stream
+      @param megapixels minimum image size in megapixels or 0 to disable
+   */
+  inline void setParallelSize( float megapixels ){
+    parallel_size = (megapixels > 0) ? (unsigned long)( megapixels * 1000000 ) : 0;
+  };
+
+  /// Whether to compress images of a given size in one go using parallel band encoding
+  bool useWholeImage( unsigned int width, unsigned int height );
 
   /// Return the JPEG header size
   inline unsigned int getHeaderSize() { return header_size; }
@@ -20,9 +20,12 @@
 
 #include "Task.h"
 #include "Transforms.h"
+#include "Digest.h"
 
 #include <cmath>
+#include <cerrno>
 #include <sstream>
+#include <sys/stat.h>
 
 using namespace std;
 
@@ -69,18 +72,99 @@ void JTL::send( Session* session, int resolution, int tile ){
   }
 
 
-  TileManager tilemanager( session->tileCache, *session->image, session->watermark, session->jpeg, session->logfile, session->loglevel );
+  // Tiles which do not exist in this version of the image are refused without going back to the image
+  ostringstream invalid;
+  invalid << (*session->image)->getImagePath() << ":" << (*session->image)->timestamp << ":"
+	  << resolution << ":" << tile << ":" << session->view->xangle << ":" << session->view->yangle << ":"
+	  << session->view->getLayers();
+  string message;
+  if( session->negativeCache && session->negativeCache->find( invalid.str(), message ) ){
+    if( session->loglevel >= 2 ) *(session->logfile) << "JTL :: Negative cache hit" << endl;
+    throw file_error( message );
+  }
+
+  // Requests for resolutions or tiles beyond the extent of the image will always fail, so remember them
+  unsigned int num_res = (*session->image)->getNumResolutions();
+  ostringstream nonexistent;
+  if( (unsigned int) resolution >= num_res ){
+    nonexistent << "JTL :: Asked for non-existent resolution: " << resolution;
+  }
+  else{
+    unsigned int im_width = (*session->image)->image_widths[num_res-resolution-1];
+    unsigned int im_height = (*session->image)->image_heights[num_res-resolution-1];
+    unsigned int tw = (*session->image)->getTileWidth();
+    unsigned int th = (*session->image)->getTileHeight();
+    if( tw > 0 && th > 0 ){
+      unsigned int ntiles = ( (im_width + tw - 1) / tw ) * ( (im_height + th - 1) / th );
+      if( (unsigned int) tile >= ntiles ) nonexistent << "JTL :: Asked for non-existent tile: " << tile;
+    }
+  }
+  if( !nonexistent.str().empty() ){
+    if( session->negativeCache ) session->negativeCache->insert( invalid.str(), "", nonexistent.str() );
+    throw file_error( nonexistent.str() );
+  }
 
-  CompressionType ct;
 
+  // Set up our output format handler
+  Compressor* compressor = session->jpeg;
+  CompressionType format = JPEG;
+#ifdef HAVE_PNG
+  if( session->view->output_format == PNG ){
+    compressor = session->png;
+    format = PNG;
+  }
+#endif
+#ifdef HAVE_WEBP
+  if( session->view->output_format == WEBP ){
+    compressor = session->webp;
+    format = WEBP;
+  }
+#endif
+
+
+  // Equivalent tile requests made through any protocol share a single memcached entry. Tiles
+  // are already held in our tile cache, so are not kept in our in-process response cache as well
+  ostringstream region;
+  region << "tile:" << resolution << ":" << tile;
+  string key = this->responseKey( region.str(), compressor );
+  if( this->sendCachedResponse( key, false ) ) return;
+
+  // Keep a copy of our output only if it can be cached, noting where our response begins
+  size_t start = this->captureResponse( false );
+
+
+  TileManager tilemanager( session->tileCache, *session->image, session->watermark, compressor, session->logfile, session->loglevel );
+
+  CompressionType ct;
+  float rotation = session->view->getRotation();
+  bool lossless = false;
+
+  // PNG and WebP tiles can be sent as they are for images with up to 4 channels and
+  // 16 (PNG) or 8 (WebP) bits per channel if no processing is required
+  if( format == PNG || format == WEBP ){
+    if( (*session->image)->getNumBitsPerPixel() > (format == PNG ? 16 : 8)
+	|| (*session->image)->getColourSpace() == CIELAB
+	|| (*session->image)->getNumChannels() > 4
+	|| ( session->view->colourspace==GREYSCALE && (*session->image)->getNumChannels()>=3 )
+	|| session->view->floatProcessing() || rotation != 0.0 || session->view->flip != 0
+	) ct = UNCOMPRESSED;
+    else ct = format;
+  }
   // Request uncompressed tile if raw pixel data is required for processing
-  if( (*session->image)->getNumBitsPerPixel() > 8 || (*session->image)->getColourSpace() == CIELAB
+  else if( (*session->image)->getNumBitsPerPixel() > 8 || (*session->image)->getColourSpace() == CIELAB
       || (*session->image)->getNumChannels() == 2 || (*session->image)->getNumChannels() > 3
       || ( session->view->colourspace==GREYSCALE && (*session->image)->getNumChannels()==3 &&
 	   (*session->image)->getNumBitsPerPixel()==8 )
       || session->view->floatProcessing()
-      || session->view->getRotation() != 0.0 || session->view->flip != 0
       ) ct = UNCOMPRESSED;
+  // Rotations by multiples of 90 degrees and flips can be done losslessly on a JPEG tile
+  else if( rotation != 0.0 || session->view->flip != 0 ){
+    if( (int) rotation % 90 == 0 ){
+      ct = JPEG;
+      lossless = true;
+    }
+    else ct = UNCOMPRESSED;
+  }
   else ct = JPEG;
 
 
@@ -90,12 +174,61 @@ void JTL::send( Session* session, int resolution, int tile ){
       *(session->logfile) << "JTL :: Embedding ICC profile with size "
 			  << (*session->image)->getMetadata("icc").size() << " bytes" << endl;
     }
-    session->jpeg->setICCProfile( (*session->image)->getMetadata("icc") );
+    compressor->setICCProfile( (*session->image)->getMetadata("icc") );
   }
 
 
-  RawTile rawtile = tilemanager.getTile( resolution, tile, session->view->xangle,
-					 session->view->yangle, session->view->getLayers(), ct );
+  // Tiles sent just as they are held in our tile cache are tagged with the digest recorded when
+  // they entered the cache, while processed tiles, which are only encoded once fetched, carry a
+  // weak tag derived from our request. Either way, revalidations are answered before any decoding
+  bool processed = ( ct != format ) || lossless;
+  string tag;
+  if( processed ) tag = etag( key );
+  else{
+    uint64_t digest = tilemanager.getDigest( resolution, tile, session->view->xangle, session->view->yangle, format );
+    if( digest ) tag = etag( digest );
+  }
+  if( this->notModified( tag ) ) throw( 304 );
+
+
+  RawTile rawtile;
+  try{
+    rawtile = tilemanager.getTile( resolution, tile, session->view->xangle,
+				   session->view->yangle, session->view->getLayers(), ct );
+  }
+  catch( const file_error& error ){
+    // Only remember a missing file within an image sequence: other errors may be transient.
+    // The key contains the image timestamp, so there is no need to watch the file
+    struct stat sb;
+    if( session->negativeCache &&
+	stat( (*session->image)->getFileName( session->view->xangle, session->view->yangle ).c_str(), &sb ) != 0 &&
+	errno == ENOENT ){
+      session->negativeCache->insert( invalid.str(), "", error.what() );
+    }
+    throw;
+  }
+
+
+  // Rotate and/or flip our JPEG tile in the DCT domain if possible. Otherwise, if the tile
+  // has partial MCUs on an edge to be mirrored, fall back to decoding and recompressing
+  if( lossless ){
+    if( session->loglevel >= 4 ) function_timer.start();
+    if( session->jpeg->Transform( rawtile, (int) rotation, session->view->flip ) ){
+      if( session->loglevel >= 4 ){
+	*(session->logfile) << "JTL :: Lossless JPEG rotation by " << rotation << " degrees";
+	if( session->view->flip != 0 ) *(session->logfile) << " with flip";
+	*(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
+      }
+    }
+    else{
+      if( session->loglevel >= 4 ){
+	*(session->logfile) << "JTL :: Lossless JPEG transform not possible for tile with partial edge MCU. "
+			    << "Requesting uncompressed tile" << endl;
+      }
+      rawtile = tilemanager.getTile( resolution, tile, session->view->xangle,
+				     session->view->yangle, session->view->getLayers(), UNCOMPRESSED );
+    }
+  }
 
 
   int len = rawtile.dataLength;
@@ -122,8 +255,12 @@ void JTL::send( Session* session, int resolution, int tile ){
   }
 
 
+  // PNG can hold 16 bit data, so send this losslessly if no processing is needed
+  bool keep16 = (format == PNG) && rawtile.bpc == 16 && rawtile.sampleType == FIXEDPOINT && !session->view->floatProcessing();
+
+
   // Only use our float pipeline if necessary
-  if( rawtile.bpc > 8 || session->view->floatProcessing() ){
+  if( (rawtile.bpc > 8 && !keep16) || session->view->floatProcessing() ){
 
     // Apply normalization and float conversion
     if( session->loglevel >= 4 ){
@@ -216,8 +353,12 @@ void JTL::send( Session* session, int resolution, int tile ){
   }
 
 
-  // Reduce to 1 or 3 bands if we have an alpha channel or a multi-band image
-  if( rawtile.channels == 2 || rawtile.channels > 3 ){
+  // Reduce to 1 or 3 bands if we have an alpha channel or a multi-band image. PNG and
+  // WebP can keep an alpha channel unless we also need to convert to greyscale
+  bool alpha = (format == PNG || format == WEBP) && ( rawtile.channels == 2 ||
+			( rawtile.channels == 4 && session->view->colourspace != GREYSCALE ) );
+
+  if( !alpha && ( rawtile.channels == 2 || rawtile.channels > 3 ) ){
     unsigned int bands = (rawtile.channels==2) ? 1 : 3;
     if( session->loglevel >= 4 ){
       *(session->logfile) << "JTL :: Flattening channels to " << bands;
@@ -244,7 +385,7 @@ void JTL::send( Session* session, int resolution, int tile ){
 
 
   // Apply flip
-  if( session->view->flip != 0 ){
+  if( session->view->flip != 0 && rawtile.compressionType == UNCOMPRESSED ){
     Timer flip_timer;
     if( session->loglevel >= 5 ){
       flip_timer.start();
@@ -262,8 +403,7 @@ void JTL::send( Session* session, int resolution, int tile ){
 
 
   // Apply rotation - can apply this safely after gamma and contrast adjustment
-  if( session->view->getRotation() != 0.0 ){
-    float rotation = session->view->getRotation();
+  if( rotation != 0.0 && rawtile.compressionType == UNCOMPRESSED ){
     if( session->loglevel >= 4 ){
       *(session->logfile) << "JTL :: Rotating image by " << rotation << " degrees";
       function_timer.start();
@@ -275,13 +415,14 @@ void JTL::send( Session* session, int resolution, int tile ){
   }
 
 
-  // Compress to JPEG
+  // Compress to JPEG, PNG or WebP
   if( rawtile.compressionType == UNCOMPRESSED ){
     if( session->loglevel >= 4 ){
-      *(session->logfile) << "JTL :: Compressing UNCOMPRESSED to JPEG";
+      *(session->logfile) << "JTL :: Compressing UNCOMPRESSED to "
+			  << ( format == PNG ? "PNG" : ( format == WEBP ? "WebP" : "JPEG" ) );
       function_timer.start();
     }
-    len = session->jpeg->Compress( rawtile );
+    len = compressor->Compress( rawtile );
     if( session->loglevel >= 4 ){
       *(session->logfile) << " in " << function_timer.getTime() << " microseconds to "
                           << rawtile.dataLength << " bytes" << endl;
@@ -290,33 +431,48 @@ void JTL::send( Session* session, int resolution, int tile ){
   }
 
 
+  // Tiles which were not yet in our cache or which we have just encoded need their tag now
+  if( tag.empty() ){
+    tag = etag( rawtile.digest ? rawtile.digest : Digest::xxh64( rawtile.data, len ) );
+    if( this->notModified( tag ) ) throw( 304 );
+  }
+
+
+  int written;
+
 #ifndef DEBUG
   char str[1024];
 
-  snprintf( str, 1024,
+  int hlen = snprintf( str, 1024,
 	    "Server: iipsrv/%s\r\n"
 	    "X-Powered-By: IIPImage\r\n"
-	    "Content-Type: image/jpeg\r\n"
+	    "Content-Type: %s\r\n"
             "Content-Length: %d\r\n"
 	    "Last-Modified: %s\r\n"
+	    "ETag: %s\r\n"
 	    "%s\r\n"
 	    "\r\n",
-	    VERSION, len,(*session->image)->getTimestamp().c_str(), session->response->getCacheControl().c_str() );
-
-  session->out->printf( str );
+	    VERSION, compressor->getMimeType(), len,(*session->image)->getTimestamp().c_str(),
+	    tag.c_str(), session->response->getCacheControl().c_str() );
+  if( hlen < 0 || hlen >= 1024 ) hlen = strlen( str );
+
+  // Send our header and tile together straight from the tile buffer
+  written = session->out->putStr( str, hlen, static_cast<const char*>(rawtile.data), len );
+#else
+  written = session->out->putStr( static_cast<const char*>(rawtile.data), len );
 #endif
 
 
-  if( session->out->putStr( static_cast<const char*>(rawtile.data), len ) != len ){
+  if( written != len ){
     if( session->loglevel >= 1 ){
-      *(session->logfile) << "JTL :: Error writing jpeg tile" << endl;
+      *(session->logfile) << "JTL :: Error writing tile" << endl;
     }
   }
 
 
   if( session->out->flush() == -1 ) {
     if( session->loglevel >= 1 ){
-      *(session->logfile) << "JTL :: Error flushing jpeg tile" << endl;
+      *(session->logfile) << "JTL :: Error flushing tile" << endl;
     }
   }
 
@@ -324,6 +480,9 @@ void JTL::send( Session* session, int resolution, int tile ){
   // Inform our response object that we have sent something to the client
   session->response->setImageSent();
 
+  // Cache our response for any equivalent request
+  this->cacheResponse( key, start, tag, false );
+
   // Total JTL response time
   if( session->loglevel >= 2 ){
     *(session->logfile) << "JTL :: Total command time " << command_timer.getTime() << " microseconds" << endl;
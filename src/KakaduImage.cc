@@ -376,11 +376,9 @@ RawTile KakaduImage::getTile( int seq, int ang, unsigned int res, int layers, un
 
 
   // Create our raw tile buffer and initialize some values
-  if( obpc == 16 ) rawtile.data = new unsigned short[tw*th*channels];
-  else if( obpc == 8 ) rawtile.data = new unsigned char[tw*th*channels];
+  if( obpc == 16 || obpc == 8 ) rawtile.allocate( tw*th*channels*obpc/8 );
   else throw file_error( "Kakadu :: Unsupported number of bits" );
 
-  rawtile.dataLength = tw*th*channels*obpc/8;
   rawtile.filename = getImagePath();
   rawtile.timestamp = timestamp;
 
@@ -413,11 +411,9 @@ RawTile KakaduImage::getRegion( int seq, int ang, unsigned int res, int layers,
 
   RawTile rawtile( 0, res, seq, ang, w, h, channels, obpc );
 
-  if( obpc == 16 ) rawtile.data = new unsigned short[w*h*channels];
-  else if( obpc == 8 ) rawtile.data = new unsigned char[w*h*channels];
+  if( obpc == 16 || obpc == 8 ) rawtile.allocate( w*h*channels*obpc/8 );
   else throw file_error( "Kakadu :: Unsupported number of bits" );
 
-  rawtile.dataLength = w*h*channels*obpc/8;
   rawtile.filename = getImagePath();
   rawtile.timestamp = timestamp;
 
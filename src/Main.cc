@@ -26,6 +26,8 @@
 
 #include <ctime>
 #include <csignal>
+#include <cerrno>
+#include <cstring>
 #include <iostream>
 #include <fstream>
 #include <string>
@@ -42,8 +44,13 @@
 #include "TileManager.h"
 #include "Task.h"
 #include "Environment.h"
+#include "CacheReplay.h"
 #include "Writer.h"
 
+#ifndef WIN32
+#include "Workers.h"
+#endif
+
 #ifdef HAVE_MEMCACHED
 #ifdef WIN32
 #include "../windows/MemcachedWindows.h"
@@ -52,6 +59,10 @@
 #endif
 #endif
 
+#ifdef HAVE_HTTP
+#include "HTTPServer.h"
+#endif
+
 #ifdef ENABLE_DL
 #include "DSOImage.h"
 #endif
@@ -60,6 +71,10 @@
 #include <omp.h>
 #endif
 
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
 // If necessary, define missing setenv and unsetenv functions
 #ifndef HAVE_SETENV
 static void setenv(char *n, char *v, int x) {
@@ -95,6 +110,7 @@ int loglevel;
 ofstream logfile;
 unsigned long IIPcount;
 char *tz = NULL;
+volatile sig_atomic_t memory_report = 0;
 
 
 
@@ -131,6 +147,52 @@ void IIPSignalHandler( int signal )
 
 
 
+/* Request a memory report, which is written immediately if we are waiting for a
+   request or otherwise once the current request has been completed
+ */
+void IIPReportHandler( int signal )
+{
+  memory_report = 1;
+}
+
+
+
+/* Compare the memory our tile cache accounts for with the process resident set size
+ */
+void IIPMemoryReport( Cache& cache, float max_size )
+{
+  if( loglevel < 1 ) return;
+
+  const double MB = 1024.0*1024.0;
+  double cache_size = cache.getMemoryBytes() / MB;
+  double retained = MemoryPool::getRetainedSize() / MB;
+  double rss = 0;
+
+#ifndef WIN32
+  // Resident pages are the second field of statm
+  FILE* statm = fopen( "/proc/self/statm", "r" );
+  if( statm ){
+    unsigned long pages = 0, resident = 0;
+    if( fscanf( statm, "%lu %lu", &pages, &resident ) == 2 ) rss = resident * (double) sysconf( _SC_PAGESIZE ) / MB;
+    fclose( statm );
+  }
+#endif
+
+  logfile << "Memory report after " << IIPcount << " requests:" << endl
+	  << "  Tile cache: " << cache_size << " MB accounted of " << max_size << " MB limit, "
+	  << cache.getNumElements() << " tiles" << endl
+	  << "  Tile cache partitions: " << cache.getStatistics() << endl
+	  << "  Memory pool: " << MemoryPool::getAllocatedSize() / MB << " MB in use (including cached tiles), "
+	  << retained << " MB retained for reuse" << endl;
+  if( rss > 0 ){
+    logfile << "  Resident set size: " << rss << " MB, of which " << rss - cache_size - retained
+	    << " MB is outside the tile cache and memory pool" << endl;
+  }
+  else logfile << "  Resident set size: unavailable" << endl;
+}
+
+
+
 
 
 int main( int argc, char *argv[] )
@@ -144,6 +206,12 @@ int main( int argc, char *argv[] )
   string version = string( VERSION );
 
 
+  // Replay a recorded tile cache trace against each of our eviction policies
+  if( argc > 2 && string( argv[1] ) == "--cache-replay" ){
+    return replayCacheTrace( argv[2], Environment::getMaxImageCacheSize(), Environment::getCacheRawShare(), cout );
+  }
+
+
 
   /*************************************************
     Initialise some variables from our environment
@@ -191,6 +259,12 @@ int main( int argc, char *argv[] )
 
 
 
+#ifdef HAVE_HTTP
+  // Our own HTTP server if we are not running behind a web server
+  HTTPServer* http = NULL;
+#endif
+
+
   // Set up some FCGI items and make sure we are in FCGI mode
 
 #ifndef DEBUG
@@ -199,27 +273,111 @@ int main( int argc, char *argv[] )
   int listen_socket = 0;
   bool standalone = false;
 
-  if( argv[1] && (string(argv[1]) == "--bind") ){
-    string socket = argv[2];
-    if( !socket.length() ){
+  // Options which may follow a --bind or --http address
+  int backlog = DEFAULT_BACKLOG;
+  int num_workers = 1;
+  bool cpu_affinity = false;
+  for( i = 3; i < argc; i++ ){
+    string option = argv[i];
+    if( option == "--backlog" && i+1 < argc ) backlog = atoi( argv[++i] );
+    else if( option == "--workers" && i+1 < argc ) num_workers = atoi( argv[++i] );
+    else if( option == "--cpu-affinity" ) cpu_affinity = true;
+  }
+  if( num_workers < 1 ) num_workers = 1;
+
+#ifndef WIN32
+  Workers workers( num_workers, cpu_affinity );
+#endif
+
+  // With several workers, each opens its own SO_REUSEPORT listener after forking where possible
+  bool reuseport = false;
+  bool http_mode = false;
+  string address;
+
+  if( argc > 2 && string(argv[1]) == "--bind" ){
+    address = argv[2];
+    if( !address.length() ){
       logfile << "No socket specified" << endl << endl;
       exit(1);
     }
-    int backlog = DEFAULT_BACKLOG;
-    if( argv[3] && (string(argv[3]) == "--backlog") ){
-      string bklg = argv[4];
-      if( bklg.length() ) backlog = atoi( bklg.c_str() );
+#ifndef WIN32
+    reuseport = ( num_workers > 1 ) && Workers::reusePort( address );
+#endif
+    if( !reuseport ){
+      listen_socket = FCGX_OpenSocket( address.c_str(), backlog );
+      if( listen_socket < 0 ){
+	logfile << "Unable to open socket '" << address << "'" << endl << endl;
+	exit(1);
+      }
+    }
+    standalone = true;
+    logfile << "Running in standalone mode on socket: " << address << " with backlog: " << backlog << endl << endl;
+  }
+
+#ifdef HAVE_HTTP
+  // Serve HTTP/1.1 clients directly rather than through a web server
+  unsigned int keepalive = Environment::getHTTPKeepAliveTimeout();
+  http_mode = ( argc > 2 && string(argv[1]) == "--http" );
+  if( http_mode ){
+    address = argv[2];
+    // Workers cannot share one epoll based server, so each always has its own listener
+    reuseport = ( num_workers > 1 );
+    standalone = true;
+    logfile << "Running as HTTP server on: " << address << " with backlog: " << backlog
+	    << " and keep-alive timeout: " << keepalive << "s" << endl << endl;
+  }
+#endif
+
+#ifndef WIN32
+  if( standalone ){
+
+    if( loglevel >= 1 && num_workers > 1 ){
+      logfile << "Starting " << num_workers << " workers "
+	      << ( reuseport ? "with their own SO_REUSEPORT listeners" : "sharing a single listener" )
+	      << ( cpu_affinity ? ", each pinned to its own CPU" : "" ) << endl;
+    }
+
+    // Only workers return: the parent supervises them until they have all exited
+    if( workers.start( loglevel, &logfile ) < 0 ){
+      if( loglevel >= 1 ){
+	logfile << "All workers have exited" << endl;
+	logfile.close();
+      }
+      return( 0 );
+    }
+
+    if( reuseport && !http_mode ){
+      try{
+	listen_socket = Workers::listen( address, backlog );
+      }
+      catch( const string& error ){
+	logfile << error << endl << endl;
+	exit(1);
+      }
+    }
+
+    if( loglevel >= 1 && ( num_workers > 1 || cpu_affinity ) ){
+      logfile << "Worker " << workers.getIndex() << " running with pid " << getpid();
+      if( workers.getCPU() >= 0 ) logfile << " on CPU " << workers.getCPU();
+      logfile << endl << endl;
+    }
+  }
+#endif
+
+#ifdef HAVE_HTTP
+  if( http_mode ){
+    try{
+      http = new HTTPServer( address, backlog, keepalive, reuseport );
     }
-    listen_socket = FCGX_OpenSocket( socket.c_str(), backlog );
-    if( listen_socket < 0 ){
-      logfile << "Unable to open socket '" << socket << "'" << endl << endl;
+    catch( const string& error ){
+      logfile << error << endl << endl;
       exit(1);
     }
-    standalone = true;
-    logfile << "Running in standalone mode on socket: " << socket << " with backlog: " << backlog << endl << endl;
   }
+#endif
 
-  if( FCGX_InitRequest( &request, listen_socket, 0 ) ) return(1);
+  // Allow signals to interrupt our wait for a request, so that we can act on them while idle
+  if( FCGX_InitRequest( &request, listen_socket, FCGI_FAIL_ACCEPT_ON_INTR ) ) return(1);
 
   // Check whether we are really in FCGI mode - only if we are not in standalone mode
   if( FCGX_IsCGI() ){
@@ -237,6 +395,39 @@ int main( int argc, char *argv[] )
 
   // Set our maximum image cache size
   float max_image_cache_size = Environment::getMaxImageCacheSize();
+
+  // Fraction of our tile cache budgeted for raw tiles
+  float cache_raw_share = Environment::getCacheRawShare();
+
+  // Size of our cache of encoded image responses and the largest response it will hold (in kB)
+  float response_cache_size = Environment::getResponseCacheSize();
+  unsigned int response_cache_max_item = Environment::getResponseCacheMaxItem();
+
+  // How long in seconds to remember missing images and invalid tiles
+  unsigned int negative_cache_ttl = Environment::getNegativeCacheTTL();
+
+  // Tile cache eviction policy
+  string cache_policy = Environment::getCachePolicy();
+  Cache::Policy policy = Cache::LRU;
+  if( cache_policy == "slru" ) policy = Cache::SLRU;
+  else if( cache_policy == "tinylfu" ) policy = Cache::TINYLFU;
+
+  // Trace file for recording tile cache accesses
+  string cache_trace = Environment::getCacheTrace();
+
+#ifdef HAVE_DISK_CACHE
+  // Persistent disk tile cache
+  string disk_cache_path = Environment::getDiskCachePath();
+  float disk_cache_size = Environment::getDiskCacheSize();
+  // Our workers share the disk space budget between them
+  disk_cache_size /= workers.getNumWorkers();
+#endif
+
+#ifdef HAVE_SHARED_CACHE
+  // Tile cache shared between server processes
+  string shared_cache_name = Environment::getSharedCacheName();
+  float shared_cache_size = Environment::getSharedCacheSize();
+#endif
   imageCacheMapType imageCache;
 
 
@@ -247,6 +438,17 @@ int main( int argc, char *argv[] )
   // Get our default quality variable
   int jpeg_quality = Environment::getJPEGQuality();
 
+#ifdef HAVE_PNG
+  // Get our PNG zlib compression level
+  int png_compression_level = Environment::getPNGCompressionLevel();
+#endif
+
+#ifdef HAVE_WEBP
+  // Get our WebP quality and compression method
+  int webp_quality = Environment::getWebPQuality();
+  int webp_method = Environment::getWebPMethod();
+#endif
+
 
   // Get our max CVT size
   int max_CVT = Environment::getMaxCVT();
@@ -291,11 +493,38 @@ int main( int argc, char *argv[] )
   bool embed_icc = Environment::getEmbedICC();
 
 
+  // Set the amount of freed image buffer memory we hold on to for reuse
+  float memory_pool_size = Environment::getMemoryPoolSize();
+  MemoryPool::setMaxSize( memory_pool_size );
+
+  // Minimum size in megapixels of JPEG images to encode in parallel
+  float jpeg_parallel_size = Environment::getJPEGParallelSize();
+
+  // JPEG encoding for tiles destined for our tile cache
+  int cache_jpeg_encoding = Environment::getCacheJPEGEncoding();
+
+  // Compression level for raw high bit depth and floating point tiles held in our tile cache
+  int cache_deflate_level = Environment::getCacheDeflateLevel();
+  TileManager::setDeflateLevel( cache_deflate_level );
+
+
   // Print out some information
   if( loglevel >= 1 ){
     logfile << "Setting maximum image cache size to " << max_image_cache_size << "MB" << endl;
+    logfile << "Setting image cache share for raw tiles to " << cache_raw_share << endl;
+    logfile << "Setting image cache eviction policy to " << cache_policy << endl;
+    logfile << "Setting response cache size to " << response_cache_size << "MB for responses of up to "
+	    << response_cache_max_item << "kB" << endl;
+    if( negative_cache_ttl > 0 ) logfile << "Remembering missing images and invalid tiles for " << negative_cache_ttl << "s" << endl;
+    else logfile << "Negative cache disabled" << endl;
     logfile << "Setting filesystem prefix to '" << filesystem_prefix << "'" << endl;
     logfile << "Setting default JPEG quality to " << jpeg_quality << endl;
+#ifdef HAVE_PNG
+    logfile << "Setting PNG compression level to " << png_compression_level << endl;
+#endif
+#ifdef HAVE_WEBP
+    logfile << "Setting WebP quality to " << webp_quality << " and compression method to " << webp_method << endl;
+#endif
     logfile << "Setting maximum CVT size to " << max_CVT << endl;
     logfile << "Setting HTTP Cache-Control header to '" << cache_control << "'" << endl;
     logfile << "Setting 3D file sequence name pattern to '" << filename_pattern << "'" << endl;
@@ -308,6 +537,13 @@ int main( int argc, char *argv[] )
     }
     logfile << "Setting Allow Upscaling to " << (allow_upscaling? "true" : "false") << endl;
     logfile << "Setting ICC profile embedding to " << (embed_icc? "true" : "false") << endl;
+    logfile << "Setting maximum memory pool size to " << memory_pool_size << "MB" << endl;
+    if( jpeg_parallel_size > 0 ) logfile << "Setting minimum size for parallel JPEG encoding to " << jpeg_parallel_size << " megapixels" << endl;
+    else logfile << "Parallel JPEG encoding disabled" << endl;
+    logfile << "Setting cached tile JPEG encoding to "
+	    << ( cache_jpeg_encoding == 2 ? "progressive" : (cache_jpeg_encoding == 1 ? "optimized Huffman" : "standard") ) << endl;
+    if( cache_deflate_level > 0 ) logfile << "Setting cached raw tile DEFLATE compression level to " << cache_deflate_level << endl;
+    else logfile << "DEFLATE compression of cached raw tiles disabled" << endl;
 #ifdef HAVE_KAKADU
     logfile << "Setting up JPEG2000 support via Kakadu SDK" << endl;
 #elif defined(HAVE_OPENJPEG)
@@ -380,13 +616,20 @@ int main( int argc, char *argv[] )
   // Get our list of memcached servers if we have any and the timeout
   string memcached_servers = Environment::getMemcachedServers();
   unsigned int memcached_timeout = Environment::getMemcachedTimeout();
+  unsigned int memcached_read_timeout = Environment::getMemcachedReadTimeout();
+
+  // Whether to cache individual encoded tiles rather than whole responses
+  bool memcached_tiles = Environment::getMemcachedTiles();
 
   // Create our memcached object
-  Memcache memcached( memcached_servers, memcached_timeout );
+  Memcache memcached( memcached_servers, memcached_timeout, memcached_read_timeout );
+  if( memcached.connected() && memcached_tiles ) TileManager::setMemcache( &memcached );
   if( loglevel >= 1 ){
     if( memcached.connected() ){
       logfile << "Memcached support enabled. Connected to servers: '" << memcached_servers
-	      << "' with timeout " << memcached_timeout << endl;
+	      << "' with timeout " << memcached_timeout << " and read timeout "
+	      << memcached_read_timeout << "ms" << endl
+	      << "Memcached used to cache " << ( memcached_tiles ? "individual tiles" : "responses" ) << endl;
     }
     else logfile << "Unable to connect to Memcached servers: '" << memcached.error() << "'" << endl;
   }
@@ -454,6 +697,17 @@ int main( int argc, char *argv[] )
 #ifndef WIN32
   signal( SIGUSR1, IIPSignalHandler );
   signal( SIGHUP, IIPSignalHandler );
+
+  // SIGUSR2 requests a memory usage report. While we wait for a request, this signal
+  // interrupts the wait so that the report can be written immediately. Otherwise, system
+  // calls made while handling a request are restarted and the report is written afterwards
+  struct sigaction report_idle, report_busy;
+  memset( &report_idle, 0, sizeof(report_idle) );
+  report_idle.sa_handler = IIPReportHandler;
+  sigemptyset( &report_idle.sa_mask );
+  report_busy = report_idle;
+  report_busy.sa_flags = SA_RESTART;
+  sigaction( SIGUSR2, &report_busy, NULL );
 #endif
 
   signal( SIGTERM, IIPSignalHandler );
@@ -473,9 +727,86 @@ int main( int argc, char *argv[] )
   srand( request_timer.getTime() );
 
   // Create our tile cache
-  Cache tileCache( max_image_cache_size );
+  Cache tileCache( max_image_cache_size, cache_raw_share, policy );
+
+  // And our cache of complete encoded responses such as thumbnails
+  Cache responseCache( response_cache_size, 0.0, policy );
+
+  // And our record of failed image and tile lookups
+  NegativeCache negativeCache( negative_cache_ttl );
+
+#ifdef HAVE_SHARED_CACHE
+  // Attach to our shared memory tile cache, which the first process creates
+  SharedCache* shared_cache = NULL;
+  if( !shared_cache_name.empty() ){
+    try{
+      shared_cache = new SharedCache( shared_cache_name, shared_cache_size );
+      TileManager::setSharedCache( shared_cache );
+      if( loglevel >= 1 ){
+	logfile << "Attached to shared memory tile cache '" << shared_cache->getName() << "' of size "
+		<< shared_cache->getMemorySize() << "MB: " << shared_cache->getNumElements() << " tiles found" << endl;
+      }
+    }
+    catch( const string& error ){
+      if( loglevel >= 1 ) logfile << error << ": shared tile cache disabled" << endl;
+    }
+  }
+#endif
+
+#ifdef HAVE_DISK_CACHE
+  // Open our disk cache, which rebuilds its index from any existing cache files
+  DiskCache* disk_cache = NULL;
+  if( !disk_cache_path.empty() ){
+    try{
+      if( loglevel >= 2 ) request_timer.start();
+      disk_cache = new DiskCache( disk_cache_path, disk_cache_size );
+      TileManager::setDiskCache( disk_cache );
+      if( loglevel >= 1 ){
+	logfile << "Setting up disk tile cache in '" << disk_cache->getPath() << "' of size "
+		<< disk_cache_size << "MB: " << disk_cache->getNumElements() << " tiles found" << endl;
+	if( loglevel >= 2 ) logfile << "Disk tile cache index rebuilt in " << request_timer.getTime() << " microseconds" << endl;
+      }
+    }
+    catch( const string& error ){
+      if( loglevel >= 1 ) logfile << error << ": disk tile cache disabled" << endl;
+    }
+  }
+#endif
+
+  // Record our cache accesses if requested
+  FILE* cache_trace_file = NULL;
+  if( !cache_trace.empty() ){
+    cache_trace_file = fopen( cache_trace.c_str(), "a" );
+    if( cache_trace_file ){
+      tileCache.setTrace( cache_trace_file );
+      if( loglevel >= 1 ) logfile << "Recording tile cache trace to '" << cache_trace << "'" << endl;
+    }
+    else if( loglevel >= 1 ) logfile << "Unable to open tile cache trace '" << cache_trace << "'" << endl;
+  }
   Task* task = NULL;
 
+  // Create our JPEG compressor once and reuse it for every request so that its
+  // libjpeg object, tables and working buffers are not recreated each time
+  JPEGCompressor jpeg( jpeg_quality );
+  jpeg.setParallelSize( jpeg_parallel_size );
+  jpeg.setCacheEncoding( (JPEGEncoding) cache_jpeg_encoding );
+
+#ifdef HAVE_PNG
+  PNGCompressor png( png_compression_level );
+#endif
+
+#ifdef HAVE_WEBP
+  WebPCompressor webp( webp_quality );
+  webp.setMethod( webp_method );
+#endif
+
+
+
+#if !defined(DEBUG) && !defined(WIN32)
+  // Time we spend waiting for each request
+  Timer accept_timer;
+  accept_timer.start();
+#endif
 
 
   /****************
@@ -492,21 +823,72 @@ int main( int argc, char *argv[] )
 
 #else
 
-  while( FCGX_Accept_r( &request ) >= 0 ){
+  while( true ){
 
+    // Wait for a request. If a SIGUSR2 interrupts this wait, write out the memory report
+    // that has been requested and carry on waiting
+#ifndef WIN32
+    sigaction( SIGUSR2, &report_idle, NULL );
+#endif
+#ifdef HAVE_HTTP
+    int accepted = http ? ( http->accept() ? 0 : -errno ) : FCGX_Accept_r( &request );
+#else
+    int accepted = FCGX_Accept_r( &request );
+#endif
+#ifndef WIN32
+    sigaction( SIGUSR2, &report_busy, NULL );
+#endif
+
+    if( accepted < 0 ){
+      if( accepted != -EINTR ) break;
+      if( memory_report ){
+	memory_report = 0;
+	IIPMemoryReport( tileCache, max_image_cache_size );
+      }
+      continue;
+    }
+
+#ifdef HAVE_HTTP
+    // In HTTP mode, our server provides the request environment and collects our response
+    FCGX_ParamArray envp = http ? http->environment() : request.envp;
+    FCGIWriter fcgi_writer( request.out );
+    Writer& writer = http ? http->writer() : fcgi_writer;
+#else
+    FCGX_ParamArray envp = request.envp;
     FCGIWriter writer( request.out );
+#endif
 
 #endif
 
+#if !defined(DEBUG) && !defined(WIN32)
+    workers.accepted( accept_timer.getTime() );
+#endif
 
     // Time each request
     if( loglevel >= 2 ) request_timer.start();
 
+#ifdef HAVE_MEMCACHED
+    // Keep a copy of our output only if we may store it in memcached
+    if( memcached.connected() && !memcached_tiles ) writer.capture( MEMCACHED_MAX_ITEM );
+#endif
+
 
     // Declare our image pointer here outside of the try scope
     //  so that we can close the image on exceptions
     IIPImage *image = NULL;
-    JPEGCompressor jpeg( jpeg_quality );
+
+    // Reset our long-lived JPEG compressor to its defaults for this request
+    jpeg.setQuality( jpeg_quality );
+    jpeg.setICCProfile( "" );
+    jpeg.setXMPMetadata( "" );
+#ifdef HAVE_PNG
+    png.setICCProfile( "" );
+    png.setXMPMetadata( "" );
+#endif
+#ifdef HAVE_WEBP
+    webp.setICCProfile( "" );
+    webp.setXMPMetadata( "" );
+#endif
 
 
     // View object for use with the CVT command etc
@@ -532,10 +914,23 @@ int main( int argc, char *argv[] )
       session.response = &response;
       session.view = &view;
       session.jpeg = &jpeg;
+#ifdef HAVE_PNG
+      session.png = &png;
+#endif
+#ifdef HAVE_WEBP
+      session.webp = &webp;
+#endif
       session.loglevel = loglevel;
       session.logfile = &logfile;
       session.imageCache = &imageCache;
       session.tileCache = &tileCache;
+      session.responseCache = &responseCache;
+      session.maxResponseSize = response_cache_max_item * 1024;
+      session.negativeCache = negativeCache.enabled() ? &negativeCache : NULL;
+#ifdef HAVE_MEMCACHED
+      // Image responses are cached under a canonical key unless we are caching individual tiles
+      session.memcached = ( memcached.connected() && !memcached_tiles ) ? &memcached : NULL;
+#endif
       session.out = &writer;
       session.watermark = &watermark;
       session.headers.clear();
@@ -551,7 +946,7 @@ int main( int argc, char *argv[] )
 	string prefix = uri_map.begin()->first;
 	string command = uri_map.begin()->second;
 
-	header = FCGX_GetParam( "REQUEST_URI", request.envp );
+	header = FCGX_GetParam( "REQUEST_URI", envp );
 	const string request_uri = (header!=NULL) ? header : "";
 
 	// Try to find the prefix at the beginning of request URI
@@ -575,7 +970,7 @@ int main( int argc, char *argv[] )
 #ifdef DEBUG
 	header = argv[1];
 #else
-	header = FCGX_GetParam( "QUERY_STRING", request.envp );
+	header = FCGX_GetParam( "QUERY_STRING", envp );
 #endif
 
 	request_string = (header!=NULL)? header : "";
@@ -599,35 +994,45 @@ int main( int argc, char *argv[] )
 
 #ifndef DEBUG
       // Get several other HTTP headers
-      if( (header = FCGX_GetParam("SERVER_PROTOCOL", request.envp)) ){
+      if( (header = FCGX_GetParam("SERVER_PROTOCOL", envp)) ){
         session.headers["SERVER_PROTOCOL"] = string(header);
       }
-      if( (header = FCGX_GetParam("HTTP_HOST", request.envp)) ){
+      if( (header = FCGX_GetParam("HTTP_HOST", envp)) ){
         session.headers["HTTP_HOST"] = string(header);
       }
-      if( (header = FCGX_GetParam("REQUEST_URI", request.envp)) ){
+      if( (header = FCGX_GetParam("REQUEST_URI", envp)) ){
         session.headers["REQUEST_URI"] = string(header);
       }
-      if( (header = FCGX_GetParam("HTTPS", request.envp)) ) {
+      if( (header = FCGX_GetParam("HTTPS", envp)) ) {
         session.headers["HTTPS"] = string(header);
       }
-      if( (header = FCGX_GetParam("HTTP_X_IIIF_ID", request.envp)) ){
+      if( (header = FCGX_GetParam("HTTP_X_IIIF_ID", envp)) ){
         session.headers["HTTP_X_IIIF_ID"] = string(header);
       }
 
       // Check for IF_MODIFIED_SINCE
-      if( (header = FCGX_GetParam("HTTP_IF_MODIFIED_SINCE", request.envp)) ){
+      if( (header = FCGX_GetParam("HTTP_IF_MODIFIED_SINCE", envp)) ){
 	session.headers["HTTP_IF_MODIFIED_SINCE"] = string(header);
 	if( loglevel >= 2 ){
 	  logfile << "HTTP Header: If-Modified-Since: " << header << endl;
 	}
       }
+
+      // Check for IF_NONE_MATCH
+      const char* if_none_match = FCGX_GetParam( "HTTP_IF_NONE_MATCH", envp );
+      if( if_none_match ){
+	session.headers["HTTP_IF_NONE_MATCH"] = string(if_none_match);
+	if( loglevel >= 2 ){
+	  logfile << "HTTP Header: If-None-Match: " << if_none_match << endl;
+	}
+      }
 #endif
 
 #ifdef HAVE_MEMCACHED
       // Check whether this exists in memcached, but only if we haven't had an if_modified_since
-      // request, which should always be faster to send
-      if( !header || session.headers["HTTP_IF_MODIFIED_SINCE"].empty() ){
+      // or if_none_match request, which should always be faster to send
+      if( !memcached_tiles && ( !header || session.headers["HTTP_IF_MODIFIED_SINCE"].empty() ) &&
+	  session.headers.find( "HTTP_IF_NONE_MATCH" ) == session.headers.end() ){
 	char* memcached_response = NULL;
 	if( (memcached_response = memcached.retrieve( request_string )) ){
 	  writer.putStr( memcached_response, memcached.length() );
@@ -721,12 +1126,15 @@ int main( int argc, char *argv[] )
       ////////////////////////////////////////////////////////
 
 #ifdef HAVE_MEMCACHED
-      if( memcached.connected() ){
+      // Image responses have already been cached under their canonical key
+      size_t captured;
+      const char* output = writer.captured( 0, captured );
+      if( memcached.connected() && !memcached_tiles && !response.imageSent() && output ){
 	Timer memcached_timer;
 	memcached_timer.start();
-	memcached.store( session.headers["QUERY_STRING"], writer.buffer, writer.sz );
+	memcached.store( session.headers["QUERY_STRING"], (void*) output, captured );
 	if( loglevel >= 3 ){
-	  logfile << "Memcached :: stored " << writer.sz << " bytes in "
+	  logfile << "Memcached :: queued " << captured << " bytes for storage in "
 		  << memcached_timer.getTime() << " microseconds" << endl;
 	}
       }
@@ -748,7 +1156,9 @@ int main( int argc, char *argv[] )
       switch( code ){
 
         case 304:
-	  status = "Status: 304 Not Modified\r\nServer: iipsrv/" + version + "\r\n\r\n";
+	  status = "Status: 304 Not Modified\r\nServer: iipsrv/" + version + "\r\n" +
+	    ( response.getETag().length() ? response.getETag() + "\r\n" : "" ) +
+	    ( response.getCacheControl().length() ? response.getCacheControl() + "\r\n" : "" ) + "\r\n";
 	  writer.printf( status.c_str() );
 	  writer.flush();
           if( loglevel >= 2 ){
@@ -836,6 +1246,12 @@ int main( int argc, char *argv[] )
     }
 
 
+#ifdef HAVE_HTTP
+    // Our response is complete, so send it before cleaning up
+    if( http ) http->finish();
+#endif
+
+
     /* Do some cleaning up etc. here after all the potential exceptions
        have been handled
      */
@@ -847,6 +1263,29 @@ int main( int argc, char *argv[] )
     image = NULL;
     IIPcount ++;
 
+    // Release all our request-scoped temporary buffers in one go
+    Arena::reset();
+
+    if( cache_trace_file ) fflush( cache_trace_file );
+
+    // Write out any memory report that has been requested
+    if( memory_report ){
+      memory_report = 0;
+      IIPMemoryReport( tileCache, max_image_cache_size );
+      if( loglevel >= 1 ){
+	logfile << "  Response cache: " << responseCache.getMemoryBytes() / (1024.0*1024.0) << " MB accounted of "
+		<< response_cache_size << " MB limit, " << responseCache.getNumElements() << " responses" << endl;
+      }
+#ifdef HAVE_SHARED_CACHE
+      // Pages of the shared cache we have touched are counted in our resident set
+      if( shared_cache && loglevel >= 1 ) logfile << "  Shared tile cache: " << shared_cache->getStatistics() << endl;
+#endif
+#ifdef HAVE_DISK_CACHE
+      // Pages of our disk cache segments which have been read also count towards our resident set
+      if( disk_cache && loglevel >= 1 ) logfile << "  Disk tile cache: " << disk_cache->getStatistics() << endl;
+#endif
+    }
+
 #ifdef DEBUG
     fclose( f );
 #endif
@@ -859,6 +1298,27 @@ int main( int argc, char *argv[] )
     }
 
 
+    if( loglevel >= 3 ){
+      logfile << "Tile cache: " << tileCache.getStatistics() << endl;
+      logfile << "Response cache: " << responseCache.getStatistics() << endl;
+      if( negativeCache.enabled() ) logfile << "Negative cache: " << negativeCache.getStatistics() << endl;
+#ifdef HAVE_SHARED_CACHE
+      if( shared_cache ) logfile << "Shared tile cache: " << shared_cache->getStatistics() << endl;
+#endif
+#ifdef HAVE_DISK_CACHE
+      if( disk_cache ) logfile << "Disk tile cache: " << disk_cache->getStatistics() << endl;
+#endif
+#ifdef HAVE_MEMCACHED
+      if( memcached.connected() ) logfile << "Memcached: " << memcached.getStatistics() << endl;
+#endif
+#ifdef HAVE_HTTP
+      if( http ) logfile << "HTTP: " << http->getStatistics() << endl;
+#endif
+#if !defined(DEBUG) && !defined(WIN32)
+      if( standalone ) logfile << "Accept: " << workers.getStatistics() << endl;
+#endif
+    }
+
     if( loglevel >= 2 ){
       logfile << "image closed and deleted" << endl
 	      << "Server count is " << IIPcount << endl << endl;
@@ -866,16 +1326,43 @@ int main( int argc, char *argv[] )
 
 
 
+#if !defined(DEBUG) && !defined(WIN32)
+    accept_timer.start();
+#endif
+
     ///////// End of FCGI_ACCEPT while loop or for loop in debug mode //////////
   }
 
 
 
   if( loglevel >= 1 ){
+#if !defined(DEBUG) && !defined(WIN32)
+    if( standalone ) logfile << endl << "Accept: " << workers.getStatistics();
+#endif
     logfile << endl << "Terminating after " << IIPcount << " iterations" << endl;
     logfile.close();
   }
 
+  if( cache_trace_file ) fclose( cache_trace_file );
+
+#ifdef HAVE_HTTP
+  delete http;
+#endif
+
+#ifdef HAVE_DISK_CACHE
+  if( disk_cache ){
+    TileManager::setDiskCache( NULL );
+    delete disk_cache;
+  }
+#endif
+
+#ifdef HAVE_SHARED_CACHE
+  if( shared_cache ){
+    TileManager::setSharedCache( NULL );
+    delete shared_cache;
+  }
+#endif
+
   return( 0 );
 
 }
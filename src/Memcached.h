@@ -25,22 +25,43 @@
 #define _MEMCACHED_H
 
 #include <string>
+#include <deque>
+#include <sstream>
+#include <pthread.h>
 #include <libmemcached/memcached.h>
+#include "Timer.h"
 
 #ifdef LIBMEMCACHED_VERSION_STRING
 typedef memcached_return memcached_return_t;
 #endif
 
+
+/// Limits on the number of items and bytes waiting to be written: further writes are dropped
+#define MEMCACHED_QUEUE_ITEMS 512
+#define MEMCACHED_QUEUE_BYTES (16*1024*1024)
+
+/// Largest value accepted by a default memcached configuration
+#define MEMCACHED_MAX_ITEM (1024*1024)
+
+
 /// Cache to store raw tile data
+/** Writes are queued and sent in batches by a background thread so that a slow
+    memcached server never delays our responses. As libmemcached has no multi-set
+    operation, each batch is sent as buffered sets which are flushed together.
+    Reads are subject to a strict timeout
+ */
 
 class Memcache {
 
 
  private:
 
-  /// Memcached structure
+  /// Memcached structure used for reads
   memcached_st *_memc;
 
+  /// Memcached structure used by our writer thread
+  memcached_st *_writer;
+
   /// Memcached return value
   memcached_return_t _rc;
 
@@ -56,16 +77,88 @@ class Memcache {
   /// Flag whether we are connected
   bool _connected;
 
+  /// An item waiting to be written
+  struct Item {
+    std::string key;
+    std::string data;
+  };
+
+  /// Queue of items waiting to be written and its size in bytes
+  std::deque<Item> _queue;
+  size_t _queueBytes;
+
+  /// Writer thread and the lock and condition protecting our queue
+  pthread_t _thread;
+  pthread_mutex_t _mutex;
+  pthread_cond_t _cond;
+  bool _running, _stop;
+
+  /// Read statistics: only updated by the calling thread
+  unsigned long _hits, _misses, _errors;
+  long _readTime, _maxReadTime;
+
+  /// Write statistics: protected by our lock
+  unsigned long _stored, _failed, _dropped, _batches;
+
+
+  /// Writer thread entry point
+  static void* _run( void* m ){
+    ((Memcache*) m)->_write();
+    return NULL;
+  }
+
+
+  /// Write out queued items in batches until we are stopped
+  /** Each batch is written as a series of buffered sets followed by a single flush,
+      which stands in for a multi-set. If the flush fails, the whole batch is counted as failed
+   */
+  void _write(){
+    pthread_mutex_lock( &_mutex );
+    while( true ){
+      while( _queue.empty() && !_stop ) pthread_cond_wait( &_cond, &_mutex );
+      if( _queue.empty() ) break;
+
+      // Take everything queued so far and send it as a single pipelined batch
+      std::deque<Item> batch;
+      batch.swap( _queue );
+      _queueBytes = 0;
+      pthread_mutex_unlock( &_mutex );
+
+      unsigned long failed = 0;
+      for( std::deque<Item>::const_iterator i = batch.begin(); i != batch.end(); ++i ){
+	memcached_return_t rc = memcached_set( _writer, i->key.c_str(), i->key.length(),
+					       i->data.data(), i->data.length(), _timeout, 0 );
+	if( rc != MEMCACHED_SUCCESS && rc != MEMCACHED_BUFFERED ) failed++;
+      }
+
+      // Any of our buffered items may have been lost if the flush fails
+      if( memcached_flush_buffers( _writer ) != MEMCACHED_SUCCESS ) failed = batch.size();
+
+      pthread_mutex_lock( &_mutex );
+      _stored += batch.size() - failed;
+      _failed += failed;
+      _batches++;
+    }
+    pthread_mutex_unlock( &_mutex );
+  }
+
 
  public:
 
   /// Constructor
   /** @param servernames list of memcached servers
       @param timeout memcached timeout - defaults to 1 hour (3600 seconds)
+      @param readTimeout maximum time in milliseconds to wait for a read
   */
-  Memcache( const std::string& servernames = "localhost", unsigned int timeout = 3600 ) {
+  Memcache( const std::string& servernames = "localhost", unsigned int timeout = 3600, unsigned int readTimeout = 50 ) {
 
     _length = 0;
+    _writer = NULL;
+    _queueBytes = 0;
+    _running = _stop = false;
+    _hits = _misses = _errors = 0;
+    _readTime = _maxReadTime = 0;
+    _stored = _failed = _dropped = _batches = 0;
 
     // Set our timeout
     _timeout =  timeout;
@@ -83,6 +176,15 @@ class Memcache {
     _rc =  memcached_behavior_set( _memc, MEMCACHED_BEHAVIOR_TCP_NODELAY, 1 );
     _rc =  memcached_behavior_set( _memc, MEMCACHED_BEHAVIOR_NOREPLY, 1 );
 
+    // Never wait longer than our read timeout, and stop trying a failing server for a while
+    // so that we fall back to decoding tiles ourselves rather than waiting on each request
+    _rc =  memcached_behavior_set( _memc, MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT, readTimeout );
+    _rc =  memcached_behavior_set( _memc, MEMCACHED_BEHAVIOR_POLL_TIMEOUT, readTimeout );
+    _rc =  memcached_behavior_set( _memc, MEMCACHED_BEHAVIOR_RCV_TIMEOUT, readTimeout * 1000 );
+    _rc =  memcached_behavior_set( _memc, MEMCACHED_BEHAVIOR_SND_TIMEOUT, readTimeout * 1000 );
+    _rc =  memcached_behavior_set( _memc, MEMCACHED_BEHAVIOR_SERVER_FAILURE_LIMIT, 2 );
+    _rc =  memcached_behavior_set( _memc, MEMCACHED_BEHAVIOR_RETRY_TIMEOUT, 10 );
+
     // Connect to the servers
     _rc = memcached_server_push( _memc, _servers );
     if(_rc == MEMCACHED_SUCCESS ) _connected = true;
@@ -90,11 +192,36 @@ class Memcache {
 
     if( memcached_server_count(_memc) > 0 ) _connected = true;
     else _connected = false;
+
+    if( !_connected ) return;
+
+    // Our writer has its own connections on which it buffers requests until each batch is flushed
+    pthread_mutex_init( &_mutex, NULL );
+    pthread_cond_init( &_cond, NULL );
+    _writer = memcached_clone( NULL, _memc );
+    if( _writer ){
+      memcached_behavior_set( _writer, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, 1 );
+      if( pthread_create( &_thread, NULL, _run, this ) == 0 ) _running = true;
+    }
   };
 
 
   /// Destructor
   ~Memcache() {
+    // Write out anything still queued and stop our writer
+    if( _running ){
+      pthread_mutex_lock( &_mutex );
+      _stop = true;
+      pthread_cond_signal( &_cond );
+      pthread_mutex_unlock( &_mutex );
+      pthread_join( _thread, NULL );
+    }
+    if( _connected ){
+      pthread_cond_destroy( &_cond );
+      pthread_mutex_destroy( &_mutex );
+    }
+    if( _writer ) memcached_free(_writer);
+
     // Disconnect from our servers and free our memcached structure
     if( _servers ) memcached_server_free(_servers); 
     if( _memc ) memcached_free(_memc);
@@ -102,7 +229,9 @@ class Memcache {
 
 
   /// Insert data into our cache
-  /** @param key key used for cache
+  /** The data is copied and queued for writing by our background thread. If the
+      queue is full, because memcached cannot keep up, the data is dropped
+      @param key key used for cache
       @param data pointer to the data to be stored
       @param length length of data to be stored
   */
@@ -111,9 +240,26 @@ class Memcache {
     if( !_connected ) return;
  
     std::string k = "iipsrv::" + key;
-    _rc = memcached_set( _memc, k.c_str(), k.length(),
-                        (char*) data, length,
-                        _timeout, 0 );
+
+    if( !_running ){
+      _rc = memcached_set( _memc, k.c_str(), k.length(),
+			   (char*) data, length,
+			   _timeout, 0 );
+      return;
+    }
+
+    pthread_mutex_lock( &_mutex );
+    if( _queue.size() >= MEMCACHED_QUEUE_ITEMS || _queueBytes + length > MEMCACHED_QUEUE_BYTES ){
+      _dropped++;
+    }
+    else{
+      _queue.push_back( Item() );
+      _queue.back().key.swap( k );
+      _queue.back().data.assign( (const char*) data, length );
+      _queueBytes += length;
+      pthread_cond_signal( &_cond );
+    }
+    pthread_mutex_unlock( &_mutex );
   }
 
 
@@ -125,9 +271,21 @@ class Memcache {
 
     if( !_connected ) return NULL;
 
+    Timer timer;
+    timer.start();
+
     uint32_t flags;
     std::string k = "iipsrv::" + key;
-    return memcached_get( _memc, k.c_str(), k.length(), &_length, &flags, &_rc );
+    char* data = memcached_get( _memc, k.c_str(), k.length(), &_length, &flags, &_rc );
+
+    long time = timer.getTime();
+    _readTime += time;
+    if( time > _maxReadTime ) _maxReadTime = time;
+    if( data ) _hits++;
+    else if( _rc == MEMCACHED_NOTFOUND ) _misses++;
+    else _errors++;
+
+    return data;
   }
 
 
@@ -145,6 +303,22 @@ class Memcache {
   bool connected(){ return _connected; };
 
 
+  /// Return a summary of our statistics
+  std::string getStatistics(){
+    unsigned long reads = _hits + _misses + _errors;
+    std::ostringstream s;
+    s << _hits << " hits, " << _misses << " misses, " << _errors << " errors, "
+      << ( reads ? _readTime / reads : 0 ) << " microseconds mean and " << _maxReadTime << " maximum read time";
+    if( _running ){
+      pthread_mutex_lock( &_mutex );
+      s << ", " << _stored << " stored in " << _batches << " batches, " << _failed << " failed, " << _dropped << " dropped, "
+	<< _queue.size() << " queued";
+      pthread_mutex_unlock( &_mutex );
+    }
+    return s.str();
+  }
+
+
 };
 
 
@@ -0,0 +1,239 @@
+// Memory Pool and Request Arena Member Functions
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "MemoryPool.h"
+#include <cstdlib>
+#include <new>
+
+#if defined(HAVE_MALLOC_H) && defined(HAVE_MALLOC_USABLE_SIZE)
+#include <malloc.h>
+#endif
+
+
+using namespace std;
+
+
+/* Size classes: 4 steps per power of two from 2^MIN_CLASS_BITS to 2^MAX_CLASS_BITS
+ */
+#define MIN_CLASS_BITS 12
+#define MAX_CLASS_BITS 26
+#define NUM_CLASSES ((MAX_CLASS_BITS-MIN_CLASS_BITS)*4)
+
+/* Default maximum number of bytes retained on the free lists
+ */
+#define DEFAULT_POOL_SIZE 64*1024*1024
+
+/* Minimum arena chunk size
+ */
+#define ARENA_CHUNK_SIZE 256*1024
+
+/* Header prepended to every block. Keep this 16 bytes to preserve the
+   alignment guaranteed by malloc for SIMD loads and doubles
+ */
+#define HEADER_SIZE 16
+#define UNPOOLED -1
+
+
+
+MemoryPool::MemoryPool(){
+  freelists = new vector<void*>[NUM_CLASSES];
+  retained = 0;
+  allocated = 0;
+  maxRetained = DEFAULT_POOL_SIZE;
+}
+
+
+
+MemoryPool::~MemoryPool(){
+  trim();
+  delete[] freelists;
+}
+
+
+
+MemoryPool& MemoryPool::instance(){
+  static MemoryPool pool;
+  return pool;
+}
+
+
+
+int MemoryPool::sizeClass( size_t n ){
+
+  if( n <= ((size_t)1 << MIN_CLASS_BITS) / 2 || n > classSize(NUM_CLASSES-1) ) return UNPOOLED;
+
+  // Find the power of two bracketing our size
+  int bits = MIN_CLASS_BITS;
+  while( ((size_t)1 << (bits+1)) < n ) bits++;
+
+  // Then find the quarter step within this bracket
+  int c = (bits-MIN_CLASS_BITS)*4;
+  while( classSize(c) < n ) c++;
+  return c;
+}
+
+
+
+size_t MemoryPool::classSize( int c ){
+  size_t base = (size_t)1 << (MIN_CLASS_BITS + c/4);
+  return base + (base/4)*(c%4);
+}
+
+
+
+void* MemoryPool::allocate( size_t n ){
+
+  MemoryPool& pool = instance();
+  int c = sizeClass( n );
+  char* block = NULL;
+
+  if( c != UNPOOLED && !pool.freelists[c].empty() ){
+    block = (char*) pool.freelists[c].back();
+    pool.freelists[c].pop_back();
+    pool.retained -= classSize(c);
+  }
+  else{
+    size_t len = (c == UNPOOLED) ? n : classSize(c);
+    block = (char*) malloc( len + HEADER_SIZE );
+    if( !block ){
+      // Give back what we are holding and try once more before giving up
+      trim();
+      block = (char*) malloc( len + HEADER_SIZE );
+      if( !block ) throw bad_alloc();
+    }
+    // Store both the class and the requested size for unpooled blocks
+    ((int*)block)[0] = c;
+    *((size_t*)(block+8)) = len;
+  }
+
+  pool.allocated += *((size_t*)(block+8));
+  return block + HEADER_SIZE;
+}
+
+
+
+void MemoryPool::release( void* ptr ){
+
+  if( !ptr ) return;
+
+  MemoryPool& pool = instance();
+  char* block = (char*) ptr - HEADER_SIZE;
+  int c = ((int*)block)[0];
+  size_t len = *((size_t*)(block+8));
+  pool.allocated -= len;
+
+  if( c == UNPOOLED || pool.retained + len > pool.maxRetained ){
+    free( block );
+    return;
+  }
+
+  pool.freelists[c].push_back( block );
+  pool.retained += len;
+}
+
+
+
+size_t MemoryPool::usableSize( const void* ptr ){
+  if( !ptr ) return 0;
+  return *((const size_t*)((const char*)ptr - HEADER_SIZE + 8));
+}
+
+
+
+size_t MemoryPool::footprint( const void* ptr ){
+  if( !ptr ) return 0;
+  const char* block = (const char*) ptr - HEADER_SIZE;
+#if defined(HAVE_MALLOC_H) && defined(HAVE_MALLOC_USABLE_SIZE)
+  // Ask the allocator directly, adding its chunk header
+  return malloc_usable_size( (void*) block ) + sizeof(size_t);
+#else
+  return heapSize( *((const size_t*)(block+8)) + HEADER_SIZE );
+#endif
+}
+
+
+
+size_t MemoryPool::heapSize( size_t n ){
+  // Large allocations are mapped directly in whole pages
+  if( n >= 128*1024 ) return (n + 2*sizeof(size_t) + 4095) & ~((size_t)4095);
+  // Otherwise a size word is added and chunks are 16 byte aligned with a minimum size
+  size_t size = (n + sizeof(size_t) + 15) & ~((size_t)15);
+  return (size < 32) ? 32 : size;
+}
+
+
+
+void MemoryPool::setMaxSize( float max ){
+  MemoryPool& pool = instance();
+  pool.maxRetained = (max > 0) ? (size_t)(max*1024*1024) : 0;
+  if( pool.retained > pool.maxRetained ) trim();
+}
+
+
+
+void MemoryPool::trim(){
+  MemoryPool& pool = instance();
+  for( int c=0; c<NUM_CLASSES; c++ ){
+    for( unsigned int i=0; i<pool.freelists[c].size(); i++ ) free( pool.freelists[c][i] );
+    pool.freelists[c].clear();
+  }
+  pool.retained = 0;
+}
+
+
+
+Arena& Arena::instance(){
+  static Arena arena;
+  return arena;
+}
+
+
+
+void* Arena::allocate( size_t n ){
+
+  Arena& arena = instance();
+
+  // Keep everything 16 byte aligned
+  n = (n + 15) & ~((size_t)15);
+
+  // Start a new chunk if our current one is exhausted
+  if( arena.chunks.empty() || arena.offset + n > arena.capacity ){
+    size_t len = (n > ARENA_CHUNK_SIZE) ? n : ARENA_CHUNK_SIZE;
+    arena.chunks.push_back( MemoryPool::allocate( len ) );
+    arena.capacity = MemoryPool::usableSize( arena.chunks.back() );
+    arena.offset = 0;
+  }
+
+  char* ptr = (char*) arena.chunks.back() + arena.offset;
+  arena.offset += n;
+  return ptr;
+}
+
+
+
+void Arena::reset(){
+  Arena& arena = instance();
+  for( unsigned int i=0; i<arena.chunks.size(); i++ ) MemoryPool::release( arena.chunks[i] );
+  arena.chunks.clear();
+  arena.offset = 0;
+  arena.capacity = 0;
+}
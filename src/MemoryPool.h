@@ -0,0 +1,152 @@
+// Memory Pool and Request Arena Classes
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _MEMORYPOOL_H
+#define _MEMORYPOOL_H
+
+#include <cstddef>
+#include <vector>
+
+
+
+/// Size-classed pool for tile-sized image buffers
+/** Image buffers are recycled between requests rather than being handed back to
+    the system allocator. Requests are rounded up to one of a set of size classes
+    (4 steps per power of two between 4kB and 64MB) and freed blocks are kept on a
+    per-class free list up to a maximum total retained size. Smaller or larger
+    requests are passed straight through to malloc. Each block carries a small
+    header recording its size class, so blocks can be released without knowing
+    their size. The pool is not thread-safe: only allocate or release outside of
+    OpenMP parallel regions.
+*/
+class MemoryPool {
+
+ private:
+
+  /// Free lists for each size class
+  std::vector<void*> *freelists;
+
+  /// Number of bytes currently held on our free lists
+  size_t retained;
+
+  /// Maximum number of bytes to hold on our free lists
+  size_t maxRetained;
+
+  /// Number of bytes currently handed out
+  size_t allocated;
+
+
+  /// Constructor
+  MemoryPool();
+
+  /// Destructor
+  ~MemoryPool();
+
+  /// Return our single pool instance
+  static MemoryPool& instance();
+
+  /// Return the size class for a given number of bytes or -1 if the size is not pooled
+  static int sizeClass( size_t n );
+
+  /// Return the size in bytes of a given size class
+  static size_t classSize( int c );
+
+
+ public:
+
+  /// Allocate a buffer of at least n bytes
+  /** @param n number of bytes
+      @return pointer to buffer, which must be released with MemoryPool::release()
+   */
+  static void* allocate( size_t n );
+
+  /// Return a buffer previously obtained from allocate() to the pool
+  /** @param ptr pointer to buffer (may be NULL) */
+  static void release( void* ptr );
+
+  /// Return the usable size of a buffer obtained from allocate()
+  static size_t usableSize( const void* ptr );
+
+  /// Return the heap memory actually consumed by a buffer obtained from allocate()
+  /** Includes our header and the allocator's own overhead and rounding */
+  static size_t footprint( const void* ptr );
+
+  /// Estimate the heap memory consumed by an n byte allocation
+  /** Based on the glibc malloc chunk layout, which most allocators approximate */
+  static size_t heapSize( size_t n );
+
+  /// Set the maximum number of bytes to retain for reuse
+  /** @param max maximum size in MB */
+  static void setMaxSize( float max );
+
+  /// Free all retained blocks
+  static void trim();
+
+  /// Return the number of bytes currently handed out
+  static size_t getAllocatedSize(){ return instance().allocated; };
+
+  /// Return the number of bytes currently retained for reuse
+  static size_t getRetainedSize(){ return instance().retained; };
+
+};
+
+
+
+/// Request-scoped arena for temporary buffers
+/** Bump allocator for scratch buffers whose lifetime does not exceed that of
+    the current request, such as edge tile cropping buffers, output strip buffers
+    and filter temporaries. There is no individual free: everything is released
+    in bulk by calling reset() at the end of each request. Chunks are obtained
+    from and returned to the MemoryPool so that they are recycled between requests.
+ */
+class Arena {
+
+ private:
+
+  /// Chunks currently in use
+  std::vector<void*> chunks;
+
+  /// Current position in our active chunk
+  size_t offset;
+
+  /// Capacity of our active chunk
+  size_t capacity;
+
+  /// Return our single arena instance
+  static Arena& instance();
+
+  /// Constructor
+  Arena() : offset(0), capacity(0) {};
+
+
+ public:
+
+  /// Allocate n bytes (16 byte aligned) valid until the next reset()
+  static void* allocate( size_t n );
+
+  /// Release all allocations made since the last reset
+  static void reset();
+
+};
+
+
+#endif
@@ -0,0 +1,244 @@
+/*  IIP Server: Negative cache of failed image and tile lookups
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include <cstdio>
+#include "NegativeCache.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+
+
+using namespace std;
+
+
+// Maximum number of directories watched at once. Entries in other directories rely on their TTL
+#define MAX_WATCHES 256
+
+// Events which may mean a missing file now exists
+#define WATCH_EVENTS ( IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR )
+
+
+
+NegativeCache::NegativeCache( unsigned int t, unsigned int max ) :
+  ttl( t ), maxEntries( max ), fd( -1 ),
+  hits( 0 ), misses( 0 ), insertions( 0 ), expiries( 0 ), invalidations( 0 )
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  if( ttl > 0 ){
+    fd = inotify_init();
+    if( fd != -1 ){
+      // Never block when checking for events
+      fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+      fcntl( fd, F_SETFD, FD_CLOEXEC );
+    }
+  }
+#endif
+}
+
+
+
+NegativeCache::~NegativeCache()
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  if( fd != -1 ) close( fd );
+#endif
+}
+
+
+
+void NegativeCache::poll()
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  if( fd == -1 || watches.empty() ) return;
+
+  char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+
+  while( (len = read( fd, buffer, sizeof(buffer) )) > 0 ){
+    for( char* p = buffer; p < buffer + len; ){
+      const struct inotify_event* event = (const struct inotify_event*) p;
+      // If the event queue overflowed, we no longer know what has changed
+      if( event->mask & IN_Q_OVERFLOW ) clear();
+      // A watch removed by the kernel or by ourselves is simply forgotten
+      else if( event->mask & IN_IGNORED ){
+	map<int,Watch>::iterator w = watches.find( event->wd );
+	if( w != watches.end() ){
+	  directories.erase( w->second.directory );
+	  watches.erase( w );
+	}
+      }
+      else invalidate( event->wd );
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+#endif
+}
+
+
+
+void NegativeCache::invalidate( int wd )
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  map<int,Watch>::iterator w = watches.find( wd );
+  if( w == watches.end() ) return;
+
+  for( vector<string>::const_iterator k = w->second.keys.begin(); k != w->second.keys.end(); ++k ){
+    EntryMap::iterator e = entries.find( *k );
+    if( e != entries.end() && e->second.watch == wd ){
+      entries.erase( e );
+      invalidations++;
+    }
+  }
+
+  // Stop watching until another lookup fails in this directory
+  inotify_rm_watch( fd, wd );
+  directories.erase( w->second.directory );
+  watches.erase( w );
+#endif
+}
+
+
+
+int NegativeCache::watch( const string& path )
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  if( fd == -1 || path.empty() ) return -1;
+
+  size_t slash = path.find_last_of( '/' );
+  string directory = ( slash == string::npos ) ? "." : ( slash == 0 ? "/" : path.substr( 0, slash ) );
+
+  map<string,int>::const_iterator d = directories.find( directory );
+  if( d != directories.end() && watches.find( d->second ) != watches.end() ) return d->second;
+
+  if( watches.size() >= MAX_WATCHES ) return -1;
+
+  // This fails if the directory itself does not exist, leaving the entry to expire
+  int wd = inotify_add_watch( fd, directory.c_str(), WATCH_EVENTS );
+  if( wd == -1 ) return -1;
+
+  // The kernel returns the same descriptor for a directory reached through another path
+  map<int,Watch>::iterator w = watches.find( wd );
+  if( w == watches.end() ){
+    Watch entry;
+    entry.directory = directory;
+    watches[wd] = entry;
+  }
+  directories[directory] = wd;
+  return wd;
+#else
+  return -1;
+#endif
+}
+
+
+
+void NegativeCache::clear()
+{
+  entries.clear();
+#ifdef HAVE_SYS_INOTIFY_H
+  for( map<int,Watch>::const_iterator w = watches.begin(); w != watches.end(); ++w ){
+    inotify_rm_watch( fd, w->first );
+  }
+#endif
+  watches.clear();
+  directories.clear();
+}
+
+
+
+void NegativeCache::insert( const string& key, const string& path, const string& message )
+{
+  if( ttl == 0 ) return;
+
+  time_t now = time( NULL );
+
+  // Make room by first discarding expired entries and then, if that is not enough, everything
+  if( entries.size() >= maxEntries && entries.find( key ) == entries.end() ){
+    for( EntryMap::iterator e = entries.begin(); e != entries.end(); ){
+      if( e->second.expiry <= now ){
+	entries.erase( e++ );
+	expiries++;
+      }
+      else ++e;
+    }
+    if( entries.size() >= maxEntries ) clear();
+  }
+
+  Entry& entry = entries[key];
+  entry.expiry = now + ttl;
+  entry.message = message;
+  entry.watch = watch( path );
+  if( entry.watch != -1 ){
+    vector<string>& keys = watches[entry.watch].keys;
+    // Forget keys which have since expired or been replaced, so that a quiet directory's list stays bounded
+    if( keys.size() >= maxEntries ){
+      vector<string> current;
+      for( vector<string>::const_iterator k = keys.begin(); k != keys.end(); ++k ){
+	EntryMap::const_iterator e = entries.find( *k );
+	if( e != entries.end() && e->second.watch == entry.watch ) current.push_back( *k );
+      }
+      keys.swap( current );
+    }
+    keys.push_back( key );
+  }
+  insertions++;
+}
+
+
+
+bool NegativeCache::find( const string& key, string& message )
+{
+  if( ttl == 0 || entries.empty() ) return false;
+
+  // Apply any changes to the file system first
+  poll();
+
+  EntryMap::iterator e = entries.find( key );
+  if( e == entries.end() ){
+    misses++;
+    return false;
+  }
+
+  if( e->second.expiry <= time( NULL ) ){
+    entries.erase( e );
+    expiries++;
+    misses++;
+    return false;
+  }
+
+  message = e->second.message;
+  hits++;
+  return true;
+}
+
+
+
+string NegativeCache::getStatistics() const
+{
+  char tmp[256];
+  snprintf( tmp, sizeof(tmp), "%lu entries, %lu directories watched, %lu hits, %lu misses, "
+	    "%lu insertions, %lu expired, %lu invalidated",
+	    (unsigned long) entries.size(), (unsigned long) watches.size(),
+	    hits, misses, insertions, expiries, invalidations );
+  return string( tmp );
+}
@@ -0,0 +1,131 @@
+/*  IIP Server: Negative cache of failed image and tile lookups
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _NEGATIVECACHE_H
+#define _NEGATIVECACHE_H
+
+
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+#include "Cache.h"
+
+
+
+/// Short-lived cache of lookups which failed, so that repeated requests for missing
+/// images or invalid tiles can be refused without touching the file system
+/** Each entry holds the error message to be returned and expires after a fixed time.
+ *  Where inotify is available, the directory in which a missing image was looked for
+ *  is also watched, and all entries for that directory are dropped as soon as a file
+ *  is created, moved into, written or has its attributes changed there.
+ */
+
+class NegativeCache {
+
+ private:
+
+  /// A failed lookup
+  struct Entry {
+    time_t expiry;                   /**< time after which the entry is no longer valid */
+    std::string message;             /**< error message */
+    int watch;                       /**< inotify watch descriptor of its directory or -1 */
+  };
+
+  /// A watched directory and the keys of the entries which depend on it
+  struct Watch {
+    std::string directory;
+    std::vector<std::string> keys;
+  };
+
+  /// Entries, indexed by key
+  typedef HASHMAP < std::string, Entry > EntryMap;
+  EntryMap entries;
+
+  /// Directories watched, indexed by watch descriptor and by path
+  std::map<int,Watch> watches;
+  std::map<std::string,int> directories;
+
+  /// Entry lifetime in seconds and maximum number of entries
+  unsigned int ttl;
+  unsigned int maxEntries;
+
+  /// inotify file descriptor or -1
+  int fd;
+
+  /// Statistics
+  unsigned long hits, misses, insertions, expiries, invalidations;
+
+
+  /// Read any pending inotify events and drop the entries they affect
+  void poll();
+
+  /// Drop all entries depending on a watch and remove the watch
+  void invalidate( int wd );
+
+  /// Return a watch descriptor for the directory containing a path, adding one if necessary
+  int watch( const std::string& path );
+
+  /// Remove all entries and watches
+  void clear();
+
+  /// Copy constructor and assignment - not permitted
+  NegativeCache( const NegativeCache& );
+  NegativeCache& operator= ( const NegativeCache& );
+
+
+ public:
+
+  /// Constructor
+  /** @param t entry lifetime in seconds: 0 disables the cache
+      @param max maximum number of entries
+   */
+  NegativeCache( unsigned int t, unsigned int max = 10000 );
+
+  /// Destructor
+  ~NegativeCache();
+
+  /// Whether the cache is enabled
+  bool enabled() const { return ttl > 0; }
+
+  /// Record a failed lookup
+  /** @param key lookup key
+      @param path file system path whose directory should be watched or empty for none
+      @param message error message to return for this key
+   */
+  void insert( const std::string& key, const std::string& path, const std::string& message );
+
+  /// Look up a failed lookup
+  /** @param key lookup key
+      @param message set to the error message recorded for this key
+      @return whether an unexpired entry was found
+   */
+  bool find( const std::string& key, std::string& message );
+
+  /// Return the number of entries
+  unsigned int getNumElements() const { return entries.size(); }
+
+  /// Return a summary of the cache contents and statistics
+  std::string getStatistics() const;
+
+};
+
+
+#endif
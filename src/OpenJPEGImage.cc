@@ -316,8 +316,7 @@ RawTile OpenJPEGImage::getTile(int seq, int ang, unsigned int res, int layers,
 
   // Create Rawtile object and initialize it
   RawTile rawtile(tile, res, seq, ang, tw, th, channels, 8);
-  rawtile.data = new unsigned char[tw * th * channels];
-  rawtile.dataLength = tw * th * channels;
+  rawtile.allocate(tw * th * channels);
   rawtile.filename = getImagePath();
   rawtile.timestamp = timestamp;
 
@@ -386,15 +385,12 @@ RawTile OpenJPEGImage::getRegion(int ha, int va, unsigned int res, int layers,
 
   RawTile rawtile(0, res, ha, va, w, h, channels, obpc);
 
-  if (obpc == 16) {
-    rawtile.data = new unsigned short[w * h * channels];
-  } else if (obpc == 8) {
-    rawtile.data = new unsigned char[w * h * channels];
+  if (obpc == 16 || obpc == 8) {
+    rawtile.allocate(w * h * channels * obpc / 8);
   } else {
     throw file_error("ERROR :: OpenJPEG :: Unsupported number of bits");
   }
 
-  rawtile.dataLength = w * h * channels * obpc / 8;
   rawtile.filename = getImagePath();
   rawtile.timestamp = timestamp;
 
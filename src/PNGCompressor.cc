@@ -0,0 +1,406 @@
+/*  PNG class wrapper to libpng library
+
+    Copyright (C) 2012-2017 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include "PNGCompressor.h"
+
+
+// Height in rows of the strips for which we choose a row filter when compressing whole tiles
+#define PNG_STRIP_HEIGHT 64
+
+// Maximum number of rows sampled within each strip when choosing a row filter
+#define PNG_FILTER_SAMPLES 4
+
+// Maximum size of working buffer we retain between images
+#define MAX_RETAINED_BUFFER 4*1024*1024
+
+
+using namespace std;
+
+
+
+/*
+ * libpng error routines: exceptions cannot be thrown through libpng's C code, so store
+ * the message and longjmp back to our caller, which then throws the exception for us
+ */
+
+static void iip_png_error( png_structp png_ptr, png_const_charp message )
+{
+  png_error_message* error = (png_error_message*) png_get_error_ptr( png_ptr );
+  strncpy( error->message, message, sizeof(error->message) - 1 );
+  error->message[sizeof(error->message)-1] = '\0';
+  png_longjmp( png_ptr, 1 );
+}
+
+
+static void iip_png_warning( png_structp png_ptr, png_const_charp message )
+{
+  // Ignore warnings
+}
+
+
+
+/*
+ * Append data to our growable output buffer
+ */
+
+static void iip_png_write( png_structp png_ptr, png_bytep data, png_size_t length )
+{
+  png_destination* dest = (png_destination*) png_get_io_ptr( png_ptr );
+
+  if( dest->size + length > dest->capacity ){
+    size_t capacity = ( dest->capacity > 0 ) ? dest->capacity * 2 : 65536;
+    while( capacity < dest->size + length ) capacity *= 2;
+    unsigned char* buffer;
+    try{
+      buffer = (unsigned char*) MemoryPool::allocate( capacity );
+    }
+    catch( const bad_alloc& ){
+      png_error( png_ptr, "Unable to allocate output buffer" );
+    }
+    if( dest->size > 0 ) memcpy( buffer, dest->buffer, dest->size );
+    if( dest->buffer ) MemoryPool::release( dest->buffer );
+    dest->buffer = buffer;
+    dest->capacity = capacity;
+  }
+
+  memcpy( &dest->buffer[dest->size], data, length );
+  dest->size += length;
+}
+
+
+static void iip_png_flush( png_structp png_ptr )
+{
+  // Our output is only collected once each strip has been written
+}
+
+
+
+
+PNGCompressor::PNGCompressor( int compression )
+{
+  setQuality( compression );
+  width = height = channels = bpc = 0;
+  rows_written = 0;
+  png = NULL;
+  info = NULL;
+  dest.buffer = NULL;
+  dest.capacity = 0;
+  dest.size = 0;
+  error.message[0] = '\0';
+}
+
+
+
+PNGCompressor::~PNGCompressor()
+{
+  destroy();
+  if( dest.buffer ) MemoryPool::release( dest.buffer );
+}
+
+
+
+void PNGCompressor::destroy()
+{
+  if( png ) png_destroy_write_struct( &png, info ? &info : NULL );
+  png = NULL;
+  info = NULL;
+}
+
+
+
+void PNGCompressor::fail()
+{
+  destroy();
+  dest.size = 0;
+  throw string( "PNGCompressor :: " ) + error.message;
+}
+
+
+
+void PNGCompressor::start( const RawTile& rawtile )
+{
+  width = rawtile.width;
+  height = rawtile.height;
+  channels = rawtile.channels;
+  bpc = rawtile.bpc;
+
+  // PNG can handle greyscale and RGB images with or without an alpha channel
+  if( channels < 1 || channels > 4 ){
+    throw string( "PNGCompressor :: PNG can only handle images with between 1 and 4 channels" );
+  }
+
+  // and either 8 or 16 bits per channel integer data
+  if( !( bpc == 8 || bpc == 16 ) || rawtile.sampleType != FIXEDPOINT ){
+    throw string( "PNGCompressor :: PNG can only handle 8 or 16 bit images" );
+  }
+
+  // Clean up after any previous image that may have been aborted by an error
+  destroy();
+  dest.size = 0;
+  rows_written = 0;
+
+  png = png_create_write_struct( PNG_LIBPNG_VER_STRING, &error, iip_png_error, iip_png_warning );
+  if( !png ) throw string( "PNGCompressor :: Unable to create PNG write structure" );
+
+  info = png_create_info_struct( png );
+  if( !info ){
+    destroy();
+    throw string( "PNGCompressor :: Unable to create PNG info structure" );
+  }
+}
+
+
+
+void PNGCompressor::writeHeader()
+{
+  png_set_write_fn( png, &dest, iip_png_write, iip_png_flush );
+
+  // Treat problems with ancillary chunks such as invalid ICC profiles as warnings
+  png_set_benign_errors( png, 1 );
+
+  int colour_type;
+  switch( channels ){
+    case 1: colour_type = PNG_COLOR_TYPE_GRAY; break;
+    case 2: colour_type = PNG_COLOR_TYPE_GRAY_ALPHA; break;
+    case 3: colour_type = PNG_COLOR_TYPE_RGB; break;
+    default: colour_type = PNG_COLOR_TYPE_RGB_ALPHA; break;
+  }
+
+  png_set_IHDR( png, info, width, height, bpc, colour_type,
+		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT );
+
+  // Low zlib levels are several times faster than the default and write fewer, larger IDAT chunks
+  png_set_compression_level( png, Q );
+  png_set_compression_buffer_size( png, 65536 );
+
+  // libpng only allocates buffers for the filters enabled when the first row is written,
+  // so enable them all initially. We then narrow these down to a single filter per strip
+  png_set_filter( png, PNG_FILTER_TYPE_BASE, ( Q == 0 ) ? PNG_FILTER_NONE : PNG_ALL_FILTERS );
+
+  writeICCProfile();
+  writeXMPMetadata();
+
+  png_write_info( png, info );
+
+  // PNG stores 16 bit data in big-endian order
+  const unsigned short one = 1;
+  if( bpc == 16 && *( (const unsigned char*) &one ) == 1 ) png_set_swap( png );
+}
+
+
+
+void PNGCompressor::writeICCProfile()
+{
+  if( icc.empty() ) return;
+  png_set_iCCP( png, info, (png_charp) "icc", PNG_COMPRESSION_TYPE_BASE,
+		(png_bytep) icc.data(), icc.size() );
+}
+
+
+
+void PNGCompressor::writeXMPMetadata()
+{
+  if( xmp.empty() ) return;
+
+  png_text text;
+  memset( &text, 0, sizeof(png_text) );
+  text.compression = PNG_ITXT_COMPRESSION_NONE;
+  text.key = (png_charp) "XML:com.adobe.xmp";
+  text.text = (png_charp) xmp.c_str();
+  text.itxt_length = xmp.size();
+  png_set_text( png, info, &text, 1 );
+}
+
+
+
+int PNGCompressor::chooseFilter( const unsigned char* data, unsigned int rows )
+{
+  // Filtering is pointless without compression
+  if( Q == 0 ) return PNG_FILTER_NONE;
+
+  // We need at least 2 rows in order to estimate the UP and PAETH filters
+  if( rows < 2 ) return PNG_FILTER_SUB;
+
+  const size_t bpp = channels * bpc / 8;
+  const size_t row_bytes = (size_t) width * bpp;
+
+  // Estimate the size of the filtered output using the sum of the absolute values of
+  // the filter residuals, as used by libpng's own heuristic, on a sample of rows
+  unsigned long cost[4] = { 0, 0, 0, 0 };
+  unsigned int samples = ( rows-1 < PNG_FILTER_SAMPLES ) ? rows-1 : PNG_FILTER_SAMPLES;
+
+  for( unsigned int s = 0; s < samples; s++ ){
+
+    const unsigned char* row = &data[ (1 + (size_t) s * (rows-1) / samples) * row_bytes ];
+    const unsigned char* prev = row - row_bytes;
+
+    for( size_t i = 0; i < row_bytes; i++ ){
+      int x = row[i];
+      int a = ( i >= bpp ) ? row[i-bpp] : 0;
+      int b = prev[i];
+      int c = ( i >= bpp ) ? prev[i-bpp] : 0;
+
+      // Paeth predictor
+      int p = a + b - c;
+      int pa = abs( p - a ), pb = abs( p - b ), pc = abs( p - c );
+      int predictor = ( pa <= pb && pa <= pc ) ? a : ( pb <= pc ? b : c );
+
+      cost[0] += abs( (signed char) x );
+      cost[1] += abs( (signed char) (x - a) );
+      cost[2] += abs( (signed char) (x - b) );
+      cost[3] += abs( (signed char) (x - predictor) );
+    }
+  }
+
+  static const int filters[4] = { PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_PAETH };
+  int best = 0;
+  for( int n = 1; n < 4; n++ ){
+    if( cost[n] < cost[best] ) best = n;
+  }
+
+  return filters[best];
+}
+
+
+
+void PNGCompressor::writeRows( const unsigned char* data, unsigned int rows )
+{
+  const size_t row_bytes = (size_t) width * channels * bpc / 8;
+  unsigned int r = 0;
+
+  // Write the very first row with all our filters enabled so that libpng sets up its buffers
+  if( rows_written == 0 && rows > 0 ){
+    png_write_row( png, (png_bytep) data );
+    r = 1;
+  }
+
+  png_set_filter( png, PNG_FILTER_TYPE_BASE, chooseFilter( data, rows ) );
+
+  for( ; r < rows; r++ ){
+    png_write_row( png, (png_bytep) &data[r*row_bytes] );
+  }
+
+  rows_written += rows;
+}
+
+
+
+void PNGCompressor::InitCompression( const RawTile& rawtile, unsigned int strip_height )
+{
+  start( rawtile );
+  if( setjmp( png_jmpbuf( png ) ) ) fail();
+
+  writeHeader();
+
+  // Collect our header and reset our output for the strips to come
+  header.assign( (const char*) dest.buffer, dest.size );
+  dest.size = 0;
+}
+
+
+
+unsigned int PNGCompressor::CompressStrip( unsigned char* input, unsigned char* output, unsigned int tile_height )
+{
+  if( !png ) throw string( "PNGCompressor :: Compression has not been initialised" );
+  if( setjmp( png_jmpbuf( png ) ) ) fail();
+
+  writeRows( input, tile_height );
+
+  // Flush zlib so that all of this strip's data is output now rather than being held
+  // back to a later strip, for which our caller's output buffer may not be large enough
+  png_write_flush( png );
+
+  // Hand over whatever compressed data libpng has produced so far
+  unsigned int size = dest.size;
+  if( size > 0 ) memcpy( output, dest.buffer, size );
+  dest.size = 0;
+
+  return size;
+}
+
+
+
+unsigned int PNGCompressor::Finish( unsigned char* output )
+{
+  if( !png ) throw string( "PNGCompressor :: Compression has not been initialised" );
+  if( setjmp( png_jmpbuf( png ) ) ) fail();
+
+  png_write_end( png, NULL );
+
+  unsigned int size = dest.size;
+  if( size > 0 ) memcpy( output, dest.buffer, size );
+  dest.size = 0;
+
+  destroy();
+
+  // Don't hold on to exceptionally large working buffers
+  if( dest.capacity > MAX_RETAINED_BUFFER ){
+    MemoryPool::release( dest.buffer );
+    dest.buffer = NULL;
+    dest.capacity = 0;
+  }
+
+  return size;
+}
+
+
+
+int PNGCompressor::Compress( RawTile& rawtile, bool cache )
+{
+  start( rawtile );
+  if( setjmp( png_jmpbuf( png ) ) ) fail();
+
+  writeHeader();
+
+  // Write out our image in strips, each with its own row filter
+  const unsigned char* data = (const unsigned char*) rawtile.data;
+  const size_t row_bytes = (size_t) width * channels * bpc / 8;
+
+  for( unsigned int y = 0; y < height; y += PNG_STRIP_HEIGHT ){
+    unsigned int rows = ( height - y < PNG_STRIP_HEIGHT ) ? height - y : PNG_STRIP_HEIGHT;
+    writeRows( &data[y*row_bytes], rows );
+  }
+
+  png_write_end( png, NULL );
+  destroy();
+
+  // Copy the PNG data into a buffer of exactly the right size, which replaces
+  // the tile's raw data, which may be a borrowed view of data we do not own
+  unsigned int size = dest.size;
+  void* buffer = MemoryPool::allocate( size );
+  memcpy( buffer, dest.buffer, size );
+  dest.size = 0;
+
+  if( dest.capacity > MAX_RETAINED_BUFFER ){
+    MemoryPool::release( dest.buffer );
+    dest.buffer = NULL;
+    dest.capacity = 0;
+  }
+
+  // Set the tile compression parameters
+  rawtile.adopt( buffer, size );
+  rawtile.compressionType = PNG;
+  rawtile.quality = Q;
+
+  return size;
+}
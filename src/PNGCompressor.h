@@ -0,0 +1,179 @@
+/*  PNG class wrapper to libpng library
+
+    Copyright (C) 2012-2017 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+
+#ifndef _PNGCOMPRESSOR_H
+#define _PNGCOMPRESSOR_H
+
+
+#include "Compressor.h"
+#include <png.h>
+
+
+
+/// Growable in-memory destination for libpng output
+
+typedef struct {
+  unsigned char *buffer;             /**< pooled output buffer */
+  size_t capacity;                   /**< allocated size of buffer */
+  size_t size;                       /**< size of output data not yet collected */
+} png_destination;
+
+
+
+/// Error message recorded by libpng's error handler before it jumps back to us
+
+typedef struct {
+  char message[256];                 /**< error message text */
+} png_error_message;
+
+
+
+/// Wrapper class to libpng
+/** Provides lossless output for 1 to 4 channel (greyscale, greyscale with alpha,
+    RGB and RGBA) images with 8 or 16 bits per channel. The quality setting is the
+    zlib compression level (0-9), where low levels favour speed. Rather than
+    libpng's per-row adaptive filtering, a single row filter is chosen for each strip
+    of image data by estimating the residual of each filter on a sample of rows.
+*/
+class PNGCompressor: public Compressor{
+
+ private:
+
+  /// The width, height, number of channels and bits per channel for the image
+  unsigned int width, height, channels, bpc;
+
+  /// libpng objects
+  png_structp png;
+  png_infop info;
+
+  /// Number of rows written so far for the current image
+  unsigned int rows_written;
+
+  /// Output data collected from libpng
+  png_destination dest;
+
+  /// Last error reported by libpng
+  png_error_message error;
+
+  /// Image header
+  std::string header;
+
+  /// Create our libpng objects for an image
+  /** The caller must then set the libpng error jump point with setjmp before
+      calling writeHeader() or any other function which can call libpng
+   */
+  void start( const RawTile& rawtile );
+
+  /// Write the PNG header for our image
+  void writeHeader();
+
+  /// Destroy our libpng objects
+  void destroy();
+
+  /// Clean up after libpng has jumped back to us on error and throw an exception
+  void fail();
+
+  /// Choose a row filter for, and write out a strip of image data
+  /** @param data pointer to image data
+      @param rows number of rows to write
+   */
+  void writeRows( const unsigned char* data, unsigned int rows );
+
+  /// Estimate the best single row filter for a strip of image data
+  /** @param data pointer to image data
+      @param rows number of rows within strip
+      @return libpng filter flag
+   */
+  int chooseFilter( const unsigned char* data, unsigned int rows );
+
+  /// Write ICC profile
+  void writeICCProfile();
+
+  /// Write XMP metadata
+  void writeXMPMetadata();
+
+  /// Copy constructor and assignment - not permitted
+  PNGCompressor( const PNGCompressor& );
+  PNGCompressor& operator= ( const PNGCompressor& );
+
+
+ public:
+
+  /// Constructor
+  /** @param compression zlib compression level (0-9) */
+  PNGCompressor( int compression );
+
+  /// Destructor
+  ~PNGCompressor();
+
+  /// Set the compression level
+  /** @param compression zlib compression level (0-9) */
+  void setQuality( int compression ){
+    if( compression < 0 ) Q = 0;
+    else if( compression > 9 ) Q = 9;
+    else Q = compression;
+  };
+
+  /// Initialise strip based compression
+  /** If we are doing a strip based encoding, we need to first initialise
+      with InitCompression, then compress a single strip at a time using
+      CompressStrip and finally clean up using Finish
+      @param rawtile tile containing the image to be compressed
+      @param strip_height pixel height of the strip we want to compress
+   */
+  void InitCompression( const RawTile& rawtile, unsigned int strip_height );
+
+  /// Compress a strip of image data
+  /** @param s source image data
+      @param o output buffer
+      @param tile_height pixel height of the tile we are compressing
+      @return number of bytes used for strip
+   */
+  unsigned int CompressStrip( unsigned char* s, unsigned char* o, unsigned int tile_height );
+
+  /// Finish the strip based compression and free memory
+  /** @param output output buffer
+      @return size of output generated
+   */
+  unsigned int Finish( unsigned char* output );
+
+  /// Compress an entire buffer of image data at once in one command
+  /** @param t tile of image data
+      @param cache whether the tile is to be cached - unused for PNG
+   */
+  int Compress( RawTile& t, bool cache = false );
+
+  /// Return the PNG header size
+  inline unsigned int getHeaderSize() { return header.size(); }
+
+  /// Return a pointer to the header itself
+  inline unsigned char* getHeader() { return (unsigned char*) header.data(); }
+
+  /// Return the PNG mime type
+  inline const char* getMimeType() { return "image/png"; }
+
+  /// Return the image filename suffix
+  inline const char* getSuffix() { return "png"; }
+
+};
+
+
+#endif
@@ -27,6 +27,8 @@
 #include <string>
 #include <cstdlib>
 #include <ctime>
+#include <stdint.h>
+#include "MemoryPool.h"
 
 
 
@@ -34,16 +36,60 @@
 enum ColourSpaces { NONE, GREYSCALE, sRGB, CIELAB };
 
 /// Compression Types
-enum CompressionType { UNCOMPRESSED, JPEG, DEFLATE, PNG };
+enum CompressionType { UNCOMPRESSED, JPEG, DEFLATE, PNG, WEBP };
 
 /// Sample Types
 enum SampleType { FIXEDPOINT, FLOATINGPOINT };
 
 
 /// Class to represent a single image tile
-
+/** The tile either owns its data buffer, which is then allocated from and returned to
+    the MemoryPool, or holds a borrowed view of memory owned by someone else, such as a
+    decoder's internal tile buffer or a tile held within the tile cache. Borrowed data
+    must not be modified in place and is only valid for as long as its owner keeps it
+    alive: use detach() to obtain a private copy. Copies are always deep and owning,
+    whereas moves (C++11 onwards) simply transfer the buffer.
+*/
 class RawTile{
 
+ private:
+
+  /// Whether our data buffer belongs to us or is a borrowed view
+  bool owner;
+
+
+  /// Copy all our metadata from another tile, but not the data itself
+  void copyInfo( const RawTile& tile ) {
+    tileNum = tile.tileNum;
+    resolution = tile.resolution;
+    hSequence = tile.hSequence;
+    vSequence = tile.vSequence;
+    compressionType = tile.compressionType;
+    quality = tile.quality;
+    filename = tile.filename;
+    timestamp = tile.timestamp;
+    width = tile.width;
+    height = tile.height;
+    channels = tile.channels;
+    bpc = tile.bpc;
+    sampleType = tile.sampleType;
+    padded = tile.padded;
+    digest = tile.digest;
+  }
+
+
+  /// Make a deep copy of another tile's data buffer
+  void copyData( const RawTile& tile ) {
+    data = NULL;
+    owner = true;
+    dataLength = tile.dataLength;
+    if( tile.data && dataLength > 0 ){
+      data = MemoryPool::allocate( dataLength );
+      memcpy( data, tile.data, dataLength );
+    }
+  }
+
+
  public:
 
   /// The tile number for this tile
@@ -71,13 +117,9 @@ class RawTile{
   time_t timestamp;
 
   /// Pointer to the image data
+  /** Set this through allocate(), adopt() or borrow() rather than directly */
   void *data;
 
-  /// This tracks whether we have allocated memory locally for data
-  /// or whether it is simply a pointer
-  /** This is used in the destructor to make sure we deallocate correctly */
-  int memoryManaged;
-
   /// The size of the data pointed to by data
   int dataLength;
 
@@ -99,6 +141,10 @@ class RawTile{
   /// Padded
   bool padded;
 
+  /// Digest of our encoded data, computed once when an encoded tile enters our cache, or 0 if unknown
+  /** Not updated when the data is modified, so only meaningful for tiles used as they are cached */
+  uint64_t digest;
+
 
   /// Main constructor
   /** @param tn tile number
@@ -114,112 +160,136 @@ class RawTile{
 	   int w = 0, int h = 0, int c = 0, int b = 0 ) {
     width = w; height = h; bpc = b; dataLength = 0; data = NULL;
     tileNum = tn; resolution = res; hSequence = hs ; vSequence = vs;
-    memoryManaged = 1; channels = c; compressionType = UNCOMPRESSED; quality = 0;
-    timestamp = 0; sampleType = FIXEDPOINT; padded = false;
+    owner = true; channels = c; compressionType = UNCOMPRESSED; quality = 0;
+    timestamp = 0; sampleType = FIXEDPOINT; padded = false; digest = 0;
   };
 
 
-  /// Destructor to free the data array if is has previously be allocated locally
+  /// Destructor to free the data array if we own it
   ~RawTile() {
-    if( data && memoryManaged ){
-      switch( bpc ){
-      case 32:
-        if( sampleType == FLOATINGPOINT ) delete[] (float*) data;
-        else delete[] (unsigned int*) data;
-        break;
-      case 16:
-	delete[] (unsigned short*) data;
-        break;
-      default:
-	delete[] (unsigned char*) data;
-        break;
-      }
-    }
+    deallocate();
   }
 
 
-  /// Copy constructor - handles copying of data buffer
+  /// Copy constructor - always creates our own copy of the data buffer
   RawTile( const RawTile& tile ) {
+    copyInfo( tile );
+    copyData( tile );
+  }
 
-    tileNum = tile.tileNum;
-    resolution = tile.resolution;
-    hSequence = tile.hSequence;
-    vSequence = tile.vSequence;
-    compressionType = tile.compressionType;
-    quality = tile.quality;
-    filename = tile.filename;
-    timestamp = tile.timestamp;
-    memoryManaged = tile.memoryManaged;
+
+  /// Copy assignment operator - frees any existing buffer before copying
+  RawTile& operator= ( const RawTile& tile ) {
+    if( this == &tile ) return *this;
+    deallocate();
+    copyInfo( tile );
+    copyData( tile );
+    return *this;
+  }
+
+
+#if (__cplusplus >= 201103L) || (defined(_MSC_VER) && _MSC_VER >= 1900)
+
+  /// Move constructor - takes over the other tile's buffer and ownership
+  RawTile( RawTile&& tile ) {
+    copyInfo( tile );
+    data = tile.data;
     dataLength = tile.dataLength;
-    width = tile.width;
-    height = tile.height;
-    channels = tile.channels;
-    bpc = tile.bpc;
-    sampleType = tile.sampleType;
-    padded = tile.padded;
+    owner = tile.owner;
+    tile.data = NULL;
+    tile.dataLength = 0;
+    tile.owner = true;
+  }
 
-    switch( bpc ){
-      case 32:
-	if( sampleType == FLOATINGPOINT ) data = new float[dataLength/4];
-	else data = new unsigned int[dataLength/4];
-	break;
-      case 16:
-	data = new unsigned short[dataLength/2];
-	break;
-      default:
-	data = new unsigned char[dataLength];
-	break;
-    }
 
-    if( data && (dataLength > 0) && tile.data ){
-      memcpy( data, tile.data, dataLength );
-      memoryManaged = 1;
-    }
+  /// Move assignment operator
+  RawTile& operator= ( RawTile&& tile ) {
+    if( this == &tile ) return *this;
+    deallocate();
+    copyInfo( tile );
+    data = tile.data;
+    dataLength = tile.dataLength;
+    owner = tile.owner;
+    tile.data = NULL;
+    tile.dataLength = 0;
+    tile.owner = true;
+    return *this;
   }
 
+#endif
 
-  /// Copy assignment constructor
-  RawTile& operator= ( const RawTile& tile ) {
 
-    tileNum = tile.tileNum;
-    resolution = tile.resolution;
-    hSequence = tile.hSequence;
-    vSequence = tile.vSequence;
-    compressionType = tile.compressionType;
-    quality = tile.quality;
-    filename = tile.filename;
-    timestamp = tile.timestamp;
-    memoryManaged = tile.memoryManaged;
-    dataLength = tile.dataLength;
-    width = tile.width;
-    height = tile.height;
-    channels = tile.channels;
-    bpc = tile.bpc;
-    sampleType = tile.sampleType;
-    padded = tile.padded;
+  /// Allocate a new data buffer of the given size owned by this tile
+  /** Any existing buffer is released first
+      @param length size in bytes
+   */
+  void allocate( unsigned int length ) {
+    deallocate();
+    data = MemoryPool::allocate( length );
+    dataLength = length;
+    owner = true;
+  }
 
-    switch( bpc ){
-      case 32:
-	if( sampleType == FLOATINGPOINT ) data = new float[dataLength/4];
-	else data = new int[dataLength/4];
-	break;
-      case 16:
-	data = new unsigned short[dataLength/2];
-	break;
-      default:
-	data = new unsigned char[dataLength];
-	break;
-    }
 
-    if( data && (dataLength > 0) && tile.data ){
-      memcpy( data, tile.data, dataLength );
-      memoryManaged = 1;
-    }
+  /// Take ownership of a buffer obtained from MemoryPool::allocate()
+  /** Any existing buffer is released first
+      @param buffer pooled buffer
+      @param length size of data in bytes
+   */
+  void adopt( void* buffer, unsigned int length ) {
+    if( buffer != data ) deallocate();
+    data = buffer;
+    dataLength = length;
+    owner = true;
+  }
 
-    return *this;
+
+  /// Point to memory owned elsewhere without taking ownership
+  /** Any existing buffer is released first
+      @param buffer data owned by someone else
+      @param length size of data in bytes
+   */
+  void borrow( void* buffer, unsigned int length ) {
+    if( buffer != data ) deallocate();
+    data = buffer;
+    dataLength = length;
+    owner = false;
   }
 
 
+  /// Release our data buffer if we own it
+  void deallocate() {
+    if( data && owner ) MemoryPool::release( data );
+    data = NULL;
+    dataLength = 0;
+    owner = true;
+  }
+
+
+  /// Make sure we own our data, replacing a borrowed view with a private copy
+  void detach() {
+    if( owner || !data ) return;
+    void* buffer = MemoryPool::allocate( dataLength );
+    memcpy( buffer, data, dataLength );
+    data = buffer;
+    owner = true;
+  }
+
+
+  /// Create a borrowed view of this tile without copying its data
+  /** The view is only valid for as long as this tile exists and is not modified */
+  RawTile view() const {
+    RawTile tile;
+    tile.copyInfo( *this );
+    tile.borrow( data, dataLength );
+    return tile;
+  }
+
+
+  /// Whether this tile owns its data buffer
+  bool ownsData() const { return owner; }
+
+
   /// Return the size of the data
   int size() { return dataLength; }
 
@@ -0,0 +1,534 @@
+/*  IIP Server: Shared memory tile cache
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "SharedCache.h"
+#include "Digest.h"
+
+
+using namespace std;
+
+
+// Shared memory marker: "IIPS" and layout version
+#define SHARED_MAGIC 0x53504949
+#define SHARED_VERSION 1
+
+// Slab page size and the smallest chunk size. Chunk sizes double up to the page size
+#define SLAB_PAGE_SIZE (1024*1024)
+#define MIN_CHUNK_SIZE 1024
+#define NUM_CLASSES 11
+
+// Number of hash buckets per page and the smallest usable number of pages
+#define BUCKETS_PER_PAGE 64
+#define MIN_PAGES 16
+
+
+
+/// Slab size class
+struct SlabClass {
+  uint32_t chunkSize;                /**< size of each chunk */
+  uint32_t numPages;                 /**< number of pages assigned to this class */
+  int32_t firstPage;                 /**< first page in this class's list of pages */
+  int32_t handPage;                  /**< page under the CLOCK hand */
+  uint32_t handChunk;                /**< chunk within that page under the CLOCK hand */
+  uint32_t padding;
+};
+
+
+/// Page table entry
+struct SlabPage {
+  int32_t slabClass;                 /**< size class or -1 if free */
+  int32_t next;                      /**< next page in class or free list */
+};
+
+
+/// Header at the start of our shared memory, followed by the hash buckets, page table and pages
+struct SharedHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;
+  pthread_mutex_t mutex;
+  uint32_t numBuckets, numPages;
+  uint64_t bucketOffset, pageTableOffset, dataOffset;
+  int32_t freePage;
+  uint32_t usedPages;
+  SlabClass classes[NUM_CLASSES];
+  uint64_t tiles, bytes, hits, misses, insertions, evictions, resets;
+};
+
+
+/// Header at the start of each chunk, followed by the key and the tile data
+struct SharedChunk {
+  uint64_t next;                     /**< offset of next chunk in hash chain or 0 */
+  uint64_t hash;
+  uint32_t used, referenced;
+  uint32_t keyLength, dataLength;
+  int64_t timestamp;
+  int32_t tileNum, resolution, hSequence, vSequence;
+  int32_t width, height, channels, bpc;
+  int32_t sampleType, compressionType, quality, padded;
+};
+
+
+
+/// Round up to a multiple of 4096
+static uint64_t align( uint64_t n ){
+  return ( n + 4095 ) & ~((uint64_t)4095);
+}
+
+
+
+SharedCache::SharedCache( const string& n, float s )
+{
+  name = ( !n.empty() && n[0] == '/' ) ? n : "/" + n;
+  base = NULL;
+  header = NULL;
+
+  // Create the object if we are the first process, otherwise attach to it
+  bool created = true;
+  int fd = shm_open( name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600 );
+  if( fd >= 0 ){
+    size = (uint64_t)( s * 1024.0 * 1024.0 );
+    if( ftruncate( fd, size ) != 0 ){
+      close( fd );
+      shm_unlink( name.c_str() );
+      throw string( "SharedCache :: Unable to size shared memory " + name + ": " + strerror(errno) );
+    }
+  }
+  else if( errno == EEXIST ){
+    created = false;
+    fd = shm_open( name.c_str(), O_RDWR, 0600 );
+    if( fd < 0 ) throw string( "SharedCache :: Unable to open shared memory " + name + ": " + strerror(errno) );
+    // The creating process may not yet have sized it
+    struct stat st;
+    for( int i = 0; i < 100; i++ ){
+      if( fstat( fd, &st ) == 0 && st.st_size > 0 ) break;
+      usleep( 50000 );
+    }
+    size = st.st_size;
+  }
+  else throw string( "SharedCache :: Unable to create shared memory " + name + ": " + strerror(errno) );
+
+  void* data = ( size > 0 ) ? mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 ) : MAP_FAILED;
+  close( fd );
+  if( data == MAP_FAILED ){
+    if( created ) shm_unlink( name.c_str() );
+    throw string( "SharedCache :: Unable to map shared memory " + name );
+  }
+
+  base = (unsigned char*) data;
+  header = (SharedHeader*) base;
+
+  if( created ){
+    try{
+      this->initialize();
+    }
+    catch( const string& error ){
+      munmap( base, size );
+      shm_unlink( name.c_str() );
+      throw;
+    }
+    return;
+  }
+
+  // Wait for the creating process to finish initializing
+  for( int i = 0; i < 100 && header->magic != SHARED_MAGIC; i++ ) usleep( 50000 );
+  __sync_synchronize();
+
+  if( header->magic != SHARED_MAGIC || header->version != SHARED_VERSION || header->size != size ){
+    munmap( base, size );
+    throw string( "SharedCache :: Shared memory " + name + " is not a compatible tile cache. Remove it from /dev/shm" );
+  }
+}
+
+
+
+SharedCache::~SharedCache()
+{
+  if( base ) munmap( base, size );
+}
+
+
+
+void SharedCache::initialize()
+{
+  // Divide our memory between the pages and their page table and hash bucket overheads
+  uint64_t available = size - align( sizeof(SharedHeader) );
+  uint64_t numPages = available / ( SLAB_PAGE_SIZE + sizeof(SlabPage) + BUCKETS_PER_PAGE*sizeof(uint64_t) );
+  while( numPages > 0 && align( sizeof(SharedHeader) ) + align( numPages*BUCKETS_PER_PAGE*sizeof(uint64_t) ) +
+	 align( numPages*sizeof(SlabPage) ) + numPages*(uint64_t)SLAB_PAGE_SIZE > size ) numPages--;
+
+  if( numPages < MIN_PAGES ){
+    throw string( "SharedCache :: Shared memory cache size is too small" );
+  }
+
+  memset( header, 0, sizeof(SharedHeader) );
+  header->size = size;
+  header->numPages = numPages;
+  header->numBuckets = numPages * BUCKETS_PER_PAGE;
+  header->bucketOffset = align( sizeof(SharedHeader) );
+  header->pageTableOffset = header->bucketOffset + align( header->numBuckets*sizeof(uint64_t) );
+  header->dataOffset = header->pageTableOffset + align( numPages*sizeof(SlabPage) );
+
+  // The mutex must be usable from every process and recoverable if its owner dies
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init( &attr );
+  pthread_mutexattr_setpshared( &attr, PTHREAD_PROCESS_SHARED );
+  pthread_mutexattr_setrobust( &attr, PTHREAD_MUTEX_ROBUST );
+  int status = pthread_mutex_init( &header->mutex, &attr );
+  pthread_mutexattr_destroy( &attr );
+  if( status != 0 ) throw string( "SharedCache :: Unable to initialize process shared mutex" );
+
+  this->clear();
+
+  // Publish the cache to other processes only once it is complete
+  header->version = SHARED_VERSION;
+  __sync_synchronize();
+  header->magic = SHARED_MAGIC;
+}
+
+
+
+void SharedCache::clear()
+{
+  memset( base + header->bucketOffset, 0, header->numBuckets*sizeof(uint64_t) );
+
+  SlabPage* pages = (SlabPage*) ( base + header->pageTableOffset );
+  for( uint32_t i = 0; i < header->numPages; i++ ){
+    pages[i].slabClass = -1;
+    pages[i].next = ( i+1 < header->numPages ) ? i+1 : -1;
+  }
+  header->freePage = 0;
+  header->usedPages = 0;
+
+  for( unsigned int c = 0; c < NUM_CLASSES; c++ ){
+    SlabClass& s = header->classes[c];
+    s.chunkSize = MIN_CHUNK_SIZE << c;
+    s.numPages = 0;
+    s.firstPage = s.handPage = -1;
+    s.handChunk = 0;
+  }
+
+  header->tiles = header->bytes = 0;
+}
+
+
+
+bool SharedCache::lock()
+{
+  int status = pthread_mutex_lock( &header->mutex );
+
+  // The previous holder died part way through modifying the cache
+  if( status == EOWNERDEAD ){
+    this->clear();
+    header->resets++;
+    pthread_mutex_consistent( &header->mutex );
+    status = 0;
+  }
+  return status == 0;
+}
+
+
+
+void SharedCache::unlock()
+{
+  pthread_mutex_unlock( &header->mutex );
+}
+
+
+
+SharedChunk* SharedCache::chunk( uint64_t offset ) const
+{
+  return (SharedChunk*) ( base + offset );
+}
+
+
+
+uint64_t SharedCache::find( const string& key, uint64_t hash ) const
+{
+  const uint64_t* buckets = (const uint64_t*) ( base + header->bucketOffset );
+  for( uint64_t offset = buckets[hash % header->numBuckets]; offset; offset = chunk(offset)->next ){
+    const SharedChunk* k = chunk( offset );
+    if( k->hash == hash && k->keyLength == key.size() &&
+	memcmp( (const unsigned char*) k + sizeof(SharedChunk), key.data(), key.size() ) == 0 ) return offset;
+  }
+  return 0;
+}
+
+
+
+void SharedCache::release( uint64_t offset )
+{
+  SharedChunk* k = chunk( offset );
+  uint64_t* next = (uint64_t*) ( base + header->bucketOffset ) + ( k->hash % header->numBuckets );
+  while( *next && *next != offset ) next = &chunk(*next)->next;
+  if( *next ) *next = k->next;
+
+  k->used = 0;
+  k->next = 0;
+  header->tiles--;
+  header->bytes -= k->dataLength;
+}
+
+
+
+bool SharedCache::addPage( unsigned int c )
+{
+  SlabPage* pages = (SlabPage*) ( base + header->pageTableOffset );
+  int32_t p = header->freePage;
+
+  if( p >= 0 ){
+    header->freePage = pages[p].next;
+    header->usedPages++;
+  }
+  else{
+    // Take a page from the class holding the most pages
+    unsigned int v = c;
+    for( unsigned int i = 0; i < NUM_CLASSES; i++ ){
+      if( i != c && header->classes[i].numPages > 1 &&
+	  ( v == c || header->classes[i].numPages > header->classes[v].numPages ) ) v = i;
+    }
+    if( v == c ) return false;
+
+    // Use the page under its CLOCK hand, which holds its least recently referenced tiles
+    SlabClass& victim = header->classes[v];
+    p = victim.handPage;
+    for( uint32_t i = 0; i < SLAB_PAGE_SIZE / victim.chunkSize; i++ ){
+      uint64_t offset = header->dataOffset + (uint64_t) p * SLAB_PAGE_SIZE + (uint64_t) i * victim.chunkSize;
+      if( chunk(offset)->used ){
+	this->release( offset );
+	header->evictions++;
+      }
+    }
+
+    int32_t* next = &victim.firstPage;
+    while( *next != p ) next = &pages[*next].next;
+    *next = pages[p].next;
+    victim.numPages--;
+    victim.handPage = ( pages[p].next >= 0 ) ? pages[p].next : victim.firstPage;
+    victim.handChunk = 0;
+  }
+
+  SlabClass& s = header->classes[c];
+  for( uint32_t i = 0; i < SLAB_PAGE_SIZE / s.chunkSize; i++ ){
+    SharedChunk* k = chunk( header->dataOffset + (uint64_t) p * SLAB_PAGE_SIZE + (uint64_t) i * s.chunkSize );
+    k->used = 0;
+    k->next = 0;
+  }
+
+  pages[p].slabClass = c;
+  pages[p].next = s.firstPage;
+  s.firstPage = p;
+  s.numPages++;
+
+  // Fill our new page first
+  s.handPage = p;
+  s.handChunk = 0;
+  return true;
+}
+
+
+
+uint64_t SharedCache::allocate( unsigned int c )
+{
+  SlabClass& s = header->classes[c];
+  if( s.numPages == 0 && !this->addPage( c ) ) return 0;
+
+  const SlabPage* pages = (const SlabPage*) ( base + header->pageTableOffset );
+  uint32_t chunks = SLAB_PAGE_SIZE / s.chunkSize;
+
+  // CLOCK: clear the reference bit of each tile passed over and evict the first tile
+  // not referenced since the hand last passed. Two sweeps always find a chunk
+  for( uint64_t n = 0; n <= 2 * (uint64_t) s.numPages * chunks; n++ ){
+
+    uint64_t offset = header->dataOffset + (uint64_t) s.handPage * SLAB_PAGE_SIZE + (uint64_t) s.handChunk * s.chunkSize;
+    SharedChunk* k = chunk( offset );
+
+    if( k->used && k->referenced ) k->referenced = 0;
+    else if( k->used && header->freePage >= 0 ){
+      // Grow rather than evict while free pages remain
+      if( this->addPage( c ) ) return this->allocate( c );
+    }
+    else{
+      if( k->used ){
+	this->release( offset );
+	header->evictions++;
+      }
+      if( ++s.handChunk == chunks ){
+	s.handChunk = 0;
+	s.handPage = ( pages[s.handPage].next >= 0 ) ? pages[s.handPage].next : s.firstPage;
+      }
+      return offset;
+    }
+
+    if( ++s.handChunk == chunks ){
+      s.handChunk = 0;
+      s.handPage = ( pages[s.handPage].next >= 0 ) ? pages[s.handPage].next : s.firstPage;
+    }
+  }
+
+  return 0;
+}
+
+
+
+void SharedCache::insert( const RawTile& r )
+{
+  if( !r.data || r.dataLength <= 0 ) return;
+
+  string key = Cache::getIndex( r.filename, r.resolution, r.tileNum, r.hSequence, r.vSequence,
+				r.compressionType, r.quality );
+  uint64_t hash = Digest::fnv1a( key.data(), key.size() );
+
+  // Find the smallest size class which can hold our tile
+  uint64_t length = sizeof(SharedChunk) + key.size() + r.dataLength;
+  unsigned int c = 0;
+  while( c < NUM_CLASSES && ( (uint64_t) MIN_CHUNK_SIZE << c ) < length ) c++;
+  if( c == NUM_CLASSES ) return;
+
+  if( !this->lock() ) return;
+
+  // Another process may have already added this tile
+  uint64_t offset = this->find( key, hash );
+  if( offset && chunk(offset)->timestamp >= r.timestamp ){
+    this->unlock();
+    return;
+  }
+  if( offset ) this->release( offset );
+
+  if( (offset = this->allocate( c )) ){
+    SharedChunk* k = chunk( offset );
+    k->hash = hash;
+    k->keyLength = key.size();
+    k->dataLength = r.dataLength;
+    k->timestamp = r.timestamp;
+    k->tileNum = r.tileNum;
+    k->resolution = r.resolution;
+    k->hSequence = r.hSequence;
+    k->vSequence = r.vSequence;
+    k->width = r.width;
+    k->height = r.height;
+    k->channels = r.channels;
+    k->bpc = r.bpc;
+    k->sampleType = r.sampleType;
+    k->compressionType = r.compressionType;
+    k->quality = r.quality;
+    k->padded = r.padded;
+
+    unsigned char* ptr = (unsigned char*) k + sizeof(SharedChunk);
+    memcpy( ptr, key.data(), key.size() );
+    memcpy( ptr + key.size(), r.data, r.dataLength );
+
+    // Link into our index
+    uint64_t* bucket = (uint64_t*) ( base + header->bucketOffset ) + ( hash % header->numBuckets );
+    k->next = *bucket;
+    *bucket = offset;
+    k->referenced = 0;
+    k->used = 1;
+
+    header->tiles++;
+    header->bytes += r.dataLength;
+    header->insertions++;
+  }
+
+  this->unlock();
+}
+
+
+
+bool SharedCache::getTile( const string& f, int r, int t, int h, int v, CompressionType c, int q,
+			   time_t timestamp, RawTile& tile )
+{
+  string key = Cache::getIndex( f, r, t, h, v, c, q );
+  uint64_t hash = Digest::fnv1a( key.data(), key.size() );
+
+  if( !this->lock() ) return false;
+
+  uint64_t offset = this->find( key, hash );
+
+  // Discard tiles from older versions of the image
+  if( offset && chunk(offset)->timestamp < timestamp ){
+    this->release( offset );
+    offset = 0;
+  }
+
+  if( !offset ){
+    header->misses++;
+    this->unlock();
+    return false;
+  }
+
+  SharedChunk* k = chunk( offset );
+
+  try{
+    tile = RawTile( k->tileNum, k->resolution, k->hSequence, k->vSequence,
+		    k->width, k->height, k->channels, k->bpc );
+    tile.sampleType = (SampleType) k->sampleType;
+    tile.compressionType = (CompressionType) k->compressionType;
+    tile.quality = k->quality;
+    tile.padded = k->padded;
+    tile.timestamp = k->timestamp;
+    tile.filename = f;
+    tile.allocate( k->dataLength );
+    memcpy( tile.data, (unsigned char*) k + sizeof(SharedChunk) + k->keyLength, k->dataLength );
+  }
+  catch( ... ){
+    // Never leave the cache locked
+    this->unlock();
+    throw;
+  }
+
+  k->referenced = 1;
+  header->hits++;
+  this->unlock();
+  return true;
+}
+
+
+
+unsigned int SharedCache::getNumElements()
+{
+  if( !this->lock() ) return 0;
+  unsigned int n = header->tiles;
+  this->unlock();
+  return n;
+}
+
+
+
+string SharedCache::getStatistics()
+{
+  if( !this->lock() ) return string();
+  SharedHeader h = *header;
+  this->unlock();
+
+  ostringstream s;
+  s << h.tiles << " tiles, " << h.bytes / (1024.0*1024.0) << " MB in " << h.usedPages << "/" << h.numPages
+    << " pages, " << h.hits << " hits, " << h.misses << " misses, " << h.insertions << " insertions, "
+    << h.evictions << " evictions, " << h.resets << " resets";
+  return s.str();
+}
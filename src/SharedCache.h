@@ -0,0 +1,137 @@
+/*  IIP Server: Shared memory tile cache
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _SHAREDCACHE_H
+#define _SHAREDCACHE_H
+
+
+#include <string>
+#include <stdint.h>
+#include "Cache.h"
+
+
+struct SharedHeader;
+struct SharedChunk;
+
+
+/// Tile cache held in POSIX shared memory and shared by all server processes
+/** The cache is a single named shared memory object containing a hash index and
+ *  a slab allocator: memory is divided into 1MB pages, each of which is carved into
+ *  chunks of one size class (powers of two from 1KB). Tiles are evicted within their
+ *  size class with the CLOCK algorithm and pages are moved from the class holding
+ *  the most pages to any class which has none.
+ *
+ *  Access is serialized by a process-shared robust mutex. Tiles are copied in and
+ *  out while the lock is held, so no process ever holds a reference into the cache.
+ *  If a process dies while holding the lock, the next process to take it resets the
+ *  cache, as its contents can no longer be trusted.
+ */
+
+class SharedCache {
+
+ private:
+
+  /// Shared memory object name and size in bytes
+  std::string name;
+  uint64_t size;
+
+  /// Base address of our mapping
+  unsigned char* base;
+  SharedHeader* header;
+
+  /// Lock the cache, resetting it if the previous holder died
+  /** @return whether the lock was obtained */
+  bool lock();
+  void unlock();
+
+  /// Initialize an empty cache in our mapping
+  void initialize();
+
+  /// Discard all tiles
+  void clear();
+
+  /// Return a pointer to the chunk at an offset from our base address
+  SharedChunk* chunk( uint64_t offset ) const;
+
+  /// Find a tile, returning the offset of its chunk or 0
+  uint64_t find( const std::string& key, uint64_t hash ) const;
+
+  /// Remove a chunk from the index and mark it as free
+  void release( uint64_t offset );
+
+  /// Assign a free page to a size class, taking one from another class if necessary
+  bool addPage( unsigned int c );
+
+  /// Allocate a chunk of a size class, evicting a tile if necessary
+  uint64_t allocate( unsigned int c );
+
+  /// Copy constructor and assignment - not permitted
+  SharedCache( const SharedCache& );
+  SharedCache& operator= ( const SharedCache& );
+
+
+ public:
+
+  /// Constructor
+  /** Attaches to the named shared memory object, creating it if necessary
+   *  @param n shared memory object name
+   *  @param s size in MB used if the object is created
+   */
+  SharedCache( const std::string& n, float s );
+
+  /// Destructor: detaches but does not remove the shared memory object
+  ~SharedCache();
+
+  /// Insert a tile
+  /** @param r tile to store */
+  void insert( const RawTile& r );
+
+  /// Get a tile from the cache
+  /**
+   *  @param f filename
+   *  @param r resolution number
+   *  @param t tile number
+   *  @param h horizontal sequence number
+   *  @param v vertical sequence number
+   *  @param c compression type
+   *  @param q compression quality
+   *  @param timestamp timestamp of source image: older tiles are discarded
+   *  @param tile tile to receive our data
+   *  @return whether the tile was found
+   */
+  bool getTile( const std::string& f, int r, int t, int h, int v, CompressionType c, int q,
+		time_t timestamp, RawTile& tile );
+
+  /// Return the name of our shared memory object
+  const std::string& getName() const { return name; }
+
+  /// Return the size of the cache in MB
+  float getMemorySize() const { return size / (1024.0*1024.0); }
+
+  /// Return the number of tiles in the cache
+  unsigned int getNumElements();
+
+  /// Return a summary of the cache contents and statistics
+  std::string getStatistics();
+
+};
+
+
+#endif
@@ -317,11 +317,10 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
 
 
   RawTile rawtile( tile, res, seq, ang, tw, th, channels, bpc );
-  rawtile.data = tile_buf;
-  rawtile.dataLength = length;
+  // Our tile buffer is reused for every tile, so only lend it to the RawTile
+  rawtile.borrow( tile_buf, length );
   rawtile.filename = getImagePath();
   rawtile.timestamp = timestamp;
-  rawtile.memoryManaged = 0;
   rawtile.padded = true;
   rawtile.sampleType = sampleType;
 
@@ -334,7 +333,7 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
 
     // Calculate number of bytes used - round integer up efficiently
     unsigned int nbytes = (np + 7) / 8;
-    unsigned char *buffer = new unsigned char[np];
+    unsigned char *buffer = (unsigned char*) MemoryPool::allocate( np );
 
     // Take into account photometric interpretation:
     //   0: white is zero, 1: black is zero
@@ -354,10 +353,8 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
       }
     }
 
-    rawtile.dataLength = n;
-    rawtile.data = buffer;
+    rawtile.adopt( buffer, n );
     rawtile.bpc = 8;
-    rawtile.memoryManaged = 1;
   }
 
 
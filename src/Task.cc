@@ -21,8 +21,19 @@
 
 #include "Task.h"
 #include "Tokenizer.h"
+#include "Digest.h"
 #include <cstdlib>
+#include <cstring>
 #include <algorithm>
+#include <sstream>
+
+#ifdef HAVE_MEMCACHED
+#ifdef WIN32
+#include "../windows/MemcachedWindows.h"
+#else
+#include "Memcached.h"
+#endif
+#endif
 
 
 using namespace std;
@@ -78,6 +89,214 @@ void Task::checkImage(){
 
 
 
+string Task::responseKey( const string& region, Compressor* compressor ){
+  ostringstream key;
+  key << (*session->image)->getImagePath() << ":" << (*session->image)->timestamp << ":"
+      << region << ":" << session->view->canonical() << ":" << compressor->getQuality();
+  return key.str();
+}
+
+
+
+string Task::etag( const string& key ){
+  char tag[32];
+  snprintf( tag, sizeof(tag), "W/\"%016llx\"", (unsigned long long) Digest::fnv1a( key.data(), key.size() ) );
+  return string( tag );
+}
+
+
+
+string Task::etag( uint64_t digest ){
+  char tag[32];
+  snprintf( tag, sizeof(tag), "\"%016llx\"", (unsigned long long) digest );
+  return string( tag );
+}
+
+
+
+bool Task::notModified( const string& tag ){
+
+  map<const string,string>::const_iterator header = session->headers.find( "HTTP_IF_NONE_MATCH" );
+  if( tag.empty() || header == session->headers.end() ) return false;
+
+  // Weak comparison: entity tags match if their opaque parts do, whether or not either is weak
+  const string opaque = ( tag.compare( 0, 2, "W/" ) == 0 ) ? tag.substr( 2 ) : tag;
+
+  Tokenizer izer( header->second, "," );
+  while( izer.hasMoreTokens() ){
+    string token = izer.nextToken();
+    size_t first = token.find_first_not_of( " \t" );
+    if( first == string::npos ) continue;
+    token = token.substr( first, token.find_last_not_of( " \t" ) - first + 1 );
+    if( token.compare( 0, 2, "W/" ) == 0 ) token.erase( 0, 2 );
+
+    if( token == "*" || token == opaque ){
+      session->response->setETag( tag );
+      if( session->loglevel >= 2 ) *(session->logfile) << "Task :: Entity tag " << tag << " matches If-None-Match" << endl;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+
+bool Task::sendCachedResponse( const string& key, bool local ){
+
+  // First check our own cache of responses, which hold the length of their entity tag, the tag and the response
+  RawTile* cached = ( local && session->responseCache ) ? session->responseCache->getTile( key, 0, 0, 0, 0, JPEG, 0 ) : NULL;
+  uint32_t tagLength = 0;
+  if( cached && cached->dataLength > (int) sizeof(tagLength) ){
+    const char* data = (const char*) cached->data;
+    memcpy( &tagLength, data, sizeof(tagLength) );
+    int offset = sizeof(tagLength) + tagLength;
+    if( offset < cached->dataLength ){
+
+      // Revalidation is answered without copying the response at all
+      if( this->notModified( string( data + sizeof(tagLength), tagLength ) ) ) throw( 304 );
+
+      int len = cached->dataLength - offset;
+      if( session->out->putStr( data + offset, len ) != len ){
+	if( session->loglevel >= 1 ) *(session->logfile) << "Response cache :: Error writing cached response" << endl;
+      }
+      session->out->flush();
+      session->response->setImageSent();
+      if( session->loglevel >= 2 ){
+	*(session->logfile) << "Response cache :: Sent cached response of " << len << " bytes for " << key << endl;
+      }
+      return true;
+    }
+  }
+
+#ifdef HAVE_MEMCACHED
+  if( !session->memcached ) return false;
+
+  // Memcached keys are limited in length, so use a hash and check the full key stored with the response
+  char name[48];
+  snprintf( name, sizeof(name), "response::%016llx", (unsigned long long) Digest::fnv1a( key.data(), key.size() ) );
+
+  char* value = session->memcached->retrieve( name );
+  if( !value ) return false;
+
+  // The value holds the key length, key, entity tag length, entity tag and then the response
+  size_t length = session->memcached->length();
+  uint32_t keyLength = 0;
+  if( length >= sizeof(keyLength) ) memcpy( &keyLength, value, sizeof(keyLength) );
+  if( length >= 2*sizeof(uint32_t) + keyLength ) memcpy( &tagLength, value + sizeof(keyLength) + keyLength, sizeof(tagLength) );
+
+  if( length < 2*sizeof(uint32_t) + keyLength + tagLength ||
+      key.compare( 0, string::npos, value + sizeof(keyLength), keyLength ) != 0 ){
+    free( value );
+    return false;
+  }
+
+  const string tag( value + 2*sizeof(uint32_t) + keyLength, tagLength );
+  size_t offset = 2*sizeof(uint32_t) + keyLength + tagLength;
+  int len = length - offset;
+
+  // Keep a local copy so that repeat requests need not go back to memcached
+  if( local ) this->storeResponse( key, tag, value + offset, len );
+
+  if( this->notModified( tag ) ){
+    free( value );
+    throw( 304 );
+  }
+
+  if( session->out->putStr( value + offset, len ) != len ){
+    if( session->loglevel >= 1 ) *(session->logfile) << "Memcached :: Error writing cached response" << endl;
+  }
+  session->out->flush();
+  free( value );
+
+  session->response->setImageSent();
+  if( session->loglevel >= 2 ){
+    *(session->logfile) << "Memcached :: Sent cached response of " << len << " bytes for " << key << endl;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+
+void Task::storeResponse( const string& key, const string& tag, const char* data, size_t len ){
+
+  if( !session->responseCache || len == 0 || len > session->maxResponseSize ) return;
+
+  // Prefix the response with its entity tag. The response cache copies the data on insertion
+  uint32_t tagLength = tag.size();
+  size_t length = sizeof(tagLength) + tagLength + len;
+  char* buffer = (char*) Arena::allocate( length );
+  memcpy( buffer, &tagLength, sizeof(tagLength) );
+  memcpy( buffer + sizeof(tagLength), tag.data(), tagLength );
+  memcpy( buffer + sizeof(tagLength) + tagLength, data, len );
+
+  RawTile response;
+  response.filename = key;
+  response.compressionType = JPEG;
+  response.quality = 0;
+  response.timestamp = (*session->image)->timestamp;
+  response.borrow( buffer, length );
+  session->responseCache->insert( response );
+}
+
+
+
+size_t Task::captureResponse( bool local ){
+
+  size_t limit = 0;
+#ifndef DEBUG
+  if( local && session->responseCache ) limit = session->maxResponseSize;
+#ifdef HAVE_MEMCACHED
+  if( session->memcached && limit < MEMCACHED_MAX_ITEM ) limit = MEMCACHED_MAX_ITEM;
+#endif
+#endif
+  return session->out->capture( limit );
+}
+
+
+
+void Task::cacheResponse( const string& key, size_t start, const string& tag, bool local ){
+
+#ifndef DEBUG
+  size_t len;
+  const char* response = session->out->captured( start, len );
+  if( !response ) return;
+
+  if( local ) this->storeResponse( key, tag, response, len );
+
+#ifdef HAVE_MEMCACHED
+  if( !session->memcached || len > MEMCACHED_MAX_ITEM ) return;
+
+  char name[48];
+  snprintf( name, sizeof(name), "response::%016llx", (unsigned long long) Digest::fnv1a( key.data(), key.size() ) );
+
+  uint32_t keyLength = key.size();
+  uint32_t tagLength = tag.size();
+  size_t length = 2*sizeof(uint32_t) + keyLength + tagLength + len;
+  char* value = (char*) Arena::allocate( length );
+  char* p = value;
+  memcpy( p, &keyLength, sizeof(keyLength) );
+  p += sizeof(keyLength);
+  memcpy( p, key.data(), keyLength );
+  p += keyLength;
+  memcpy( p, &tagLength, sizeof(tagLength) );
+  p += sizeof(tagLength);
+  memcpy( p, tag.data(), tagLength );
+  p += tagLength;
+  memcpy( p, response, len );
+
+  session->memcached->store( name, value, length );
+  if( session->loglevel >= 3 ){
+    *(session->logfile) << "Memcached :: Queued response of " << len << " bytes for " << key << endl;
+  }
+#endif
+#endif
+}
+
+
+
 void QLT::run( Session* session, const string& argument ){
 
   if( argument.length() ){
@@ -178,15 +397,27 @@ void CVT::run( Session* session, const string& src ){
   string argument = src;
   transform( argument.begin(), argument.end(), argument.begin(), ::tolower );
 
-  // For the moment, only deal with JPEG. If we have specified something else, give a warning
+  // Deal with JPEG and, if available, PNG and WebP. If we have specified something else, give a warning
   // and send JPEG anyway
-  if( argument != "jpeg" ){
-    if( session->loglevel >= 1 ) *(session->logfile) << "CVT :: Unsupported request: '" << argument << "'. Sending JPEG." << endl;
-  }
-  else{
+  if( argument == "jpeg" ){
     session->view->output_format = JPEG;
     if( session->loglevel >= 3 ) *(session->logfile) << "CVT :: JPEG output" << endl;
   }
+#ifdef HAVE_PNG
+  else if( argument == "png" ){
+    session->view->output_format = PNG;
+    if( session->loglevel >= 3 ) *(session->logfile) << "CVT :: PNG output" << endl;
+  }
+#endif
+#ifdef HAVE_WEBP
+  else if( argument == "webp" ){
+    session->view->output_format = WEBP;
+    if( session->loglevel >= 3 ) *(session->logfile) << "CVT :: WebP output" << endl;
+  }
+#endif
+  else{
+    if( session->loglevel >= 1 ) *(session->logfile) << "CVT :: Unsupported request: '" << argument << "'. Sending JPEG." << endl;
+  }
 
   this->send( session );
 }
@@ -34,16 +34,25 @@
 #include "Timer.h"
 #include "Writer.h"
 #include "Cache.h"
+#include "NegativeCache.h"
 #include "Watermark.h"
 #ifdef HAVE_PNG
 #include "PNGCompressor.h"
 #endif
+#ifdef HAVE_WEBP
+#include "WebPCompressor.h"
+#endif
 
 
 // Define our http header cache max age (24 hours)
 #define MAX_AGE 86400
 
 
+#ifdef HAVE_MEMCACHED
+class Memcache;
+#endif
+
+
 
 #ifdef HAVE_EXT_POOL_ALLOCATOR
 #include <ext/pool_allocator.h>
@@ -67,6 +76,9 @@ struct Session {
   JPEGCompressor* jpeg;
 #ifdef HAVE_PNG
   PNGCompressor* png;
+#endif
+#ifdef HAVE_WEBP
+  WebPCompressor* webp;
 #endif
   View* view;
   IIPResponse* response;
@@ -78,12 +90,21 @@ struct Session {
   imageCacheMapType *imageCache;
   Cache* tileCache;
 
-#ifdef DEBUG
-  FileWriter* out;
-#else
-  FCGIWriter* out;
+  /// Cache of complete encoded responses and the largest response in bytes we admit to it
+  Cache* responseCache;
+  size_t maxResponseSize;
+
+  /// Recently failed image and tile lookups
+  NegativeCache* negativeCache;
+
+#ifdef HAVE_MEMCACHED
+  /// Memcached servers used to cache whole image responses (or NULL)
+  Memcache* memcached;
 #endif
 
+  /// Our output: an FCGIWriter or, for debugging, a FileWriter
+  Writer* out;
+
 };
 
 
@@ -104,6 +125,66 @@ class Task {
   std::string argument;
 
 
+  /// Return the response cache key for an image request
+  /** Built from the image, its timestamp, the region requested and our canonical view, so that
+      it is shared by all equivalent requests and changes whenever the image is modified
+      @param region description of resolution and region or tile
+      @param compressor output compressor
+      @return response cache key
+   */
+  std::string responseKey( const std::string& region, Compressor* compressor );
+
+  /// Return a weak HTTP entity tag for a response cache key
+  /** Used for responses which are streamed before their content is known
+      @param key response cache key
+   */
+  static std::string etag( const std::string& key );
+
+  /// Return a strong HTTP entity tag from a digest of encoded content
+  /** @param digest xxh64 digest of the content
+   */
+  static std::string etag( uint64_t digest );
+
+  /// Check whether the client already holds the entity with this tag
+  /** If-None-Match is evaluated with weak comparison, as required by RFC 7232.
+      If it matches, the tag is set on our response so that it is returned with the 304
+      @param tag entity tag of our response
+      @return whether a 304 Not Modified reply should be sent
+   */
+  bool notModified( const std::string& tag );
+
+  /// Send a response from our response cache if available
+  /** Throws 304 if the client already holds the cached response
+      @param key response cache key
+      @param local whether to use our in-process response cache as well as memcached
+      @return whether the response was sent
+   */
+  bool sendCachedResponse( const std::string& key, bool local = true );
+
+  /// Start keeping a copy of our output if it may be stored in a response cache
+  /** Nothing is copied if no response cache is in use or once the output outgrows them
+      @param local whether our in-process response cache may be used
+      @return position in our output from which our response begins
+   */
+  size_t captureResponse( bool local = true );
+
+  /// Store the output we have written to our response cache
+  /** @param key response cache key
+      @param start position in our output from which our response begins
+      @param tag entity tag of the response
+      @param local whether to store the response in our in-process response cache as well as memcached
+   */
+  void cacheResponse( const std::string& key, size_t start, const std::string& tag, bool local = true );
+
+  /// Store a response in our in-process response cache if it is small enough
+  /** @param key response cache key
+      @param tag entity tag of the response
+      @param data encoded response
+      @param len length of response in bytes
+   */
+  void storeResponse( const std::string& key, const std::string& tag, const char* data, size_t len );
+
+
  public:
 
   /// Virtual destructor
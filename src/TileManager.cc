@@ -24,12 +24,92 @@
 
 
 #include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <zlib.h>
 #include "TileManager.h"
+#include "Digest.h"
+
+#ifdef HAVE_MEMCACHED
+#ifdef WIN32
+#include "../windows/MemcachedWindows.h"
+#else
+#include "Memcached.h"
+#endif
+#endif
 
 
 using namespace std;
 
 
+// Compression level for raw tiles held in our cache
+int TileManager::deflate_level = 1;
+
+#ifdef HAVE_DISK_CACHE
+// Our second level disk cache
+DiskCache* TileManager::diskCache = NULL;
+#endif
+
+#ifdef HAVE_SHARED_CACHE
+// Our cache shared with other processes
+SharedCache* TileManager::sharedCache = NULL;
+#endif
+
+#ifdef HAVE_MEMCACHED
+// Memcached servers used as a tile cache shared between hosts
+Memcache* TileManager::memcache = NULL;
+
+// Memcached tile value marker: "IIPM"
+#define MEMCACHED_TILE_MAGIC 0x4d504949
+
+/// Header at the start of each memcached tile value, followed by the full cache key and the tile data
+struct MemcachedTileHeader {
+  uint32_t magic;
+  uint32_t keyLength;
+  uint32_t dataLength;
+  int32_t tileNum, resolution, hSequence, vSequence;
+  int32_t width, height, channels, bpc;
+  int32_t sampleType, compressionType, quality, padded;
+  int64_t timestamp;
+};
+#endif
+
+
+
+/// Whether a tile can be compressed with a given compression type
+static bool compressible( const RawTile& t, CompressionType c ){
+  switch( c ){
+    // JPEG needs 8 bit images with either 1 or 3 bands
+    case JPEG: return t.bpc == 8 && (t.channels == 1 || t.channels == 3);
+    // PNG can also handle 16 bit images and alpha channels
+    case PNG: return (t.bpc == 8 || t.bpc == 16) && t.sampleType == FIXEDPOINT && t.channels <= 4;
+    // WebP can handle alpha channels, but only 8 bit images
+    case WEBP: return t.bpc == 8 && t.channels <= 4;
+    default: return false;
+  }
+}
+
+
+/// Record a digest of an encoded tile as it enters our cache, so that it can be used as an entity tag
+static void sign( RawTile& t ){
+  if( t.digest == 0 && (t.compressionType == JPEG || t.compressionType == PNG || t.compressionType == WEBP) ){
+    t.digest = Digest::xxh64( t.data, t.dataLength );
+  }
+}
+
+
+/// Name of a compression type for logging
+static const char* compressionName( CompressionType c ){
+  switch( c ){
+    case JPEG: return "JPEG";
+    case DEFLATE: return "DEFLATE";
+    case PNG: return "PNG";
+    case WEBP: return "WebP";
+    default: return "UNCOMPRESSED";
+  }
+}
+
+
 
 RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c ){
 
@@ -38,10 +118,9 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
 			       << " tiles, " << tileCache->getMemorySize() << " MB" << endl;
 
 
-  RawTile ttt;
-
-  // Get our raw tile from the IIPImage image object
-  ttt = image->getTile( xangle, yangle, resolution, layers, tile );
+  // Get our raw tile from the IIPImage image object. This may be a borrowed
+  // view of the decoder's own tile buffer, which we are free to modify
+  RawTile ttt = image->getTile( xangle, yangle, resolution, layers, tile );
 
 
   // Apply the watermark if we have one.
@@ -66,12 +145,8 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
 
 
   // Add our uncompressed tile directly into our cache
-  if( c == UNCOMPRESSED ){
-    // Add to our tile cache
-    if( loglevel >= 2 ) insert_timer.start();
-    tileCache->insert( ttt );
-    if( loglevel >= 2 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
-				 << " microseconds" << endl;
+  if( c == UNCOMPRESSED || c == DEFLATE ){
+    this->insert( ttt );
     return ttt;
   }
 
@@ -79,24 +154,19 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
   switch( c ){
 
   case JPEG:
+  case PNG:
+  case WEBP:
 
-    // Do our JPEG compression iff we have an 8 bit per channel image
-    if( ttt.bpc == 8 && (ttt.channels==1 || ttt.channels==3) ){
+    // Only compress if our format can handle the bit depth and number of channels of our tile
+    if( compressible( ttt, c ) ){
       if( loglevel >=2 ) compression_timer.start();
-      jpeg->Compress( ttt );
-      if( loglevel >= 2 ) *logfile << "TileManager :: JPEG Compression Time: "
+      compressor->Compress( ttt, true );
+      if( loglevel >= 2 ) *logfile << "TileManager :: " << compressionName( c ) << " Compression Time: "
 				   << compression_timer.getTime() << " microseconds" << endl;
     }
     break;
 
 
-  case DEFLATE:
-
-    // No deflate for the time being ;-)
-    if( loglevel >= 2 ) *logfile << "TileManager :: DEFLATE Compression requested: Not currently available" << endl;
-    break;
-
-
   default:
 
     break;
@@ -105,14 +175,294 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
 
 
   // Add to our tile cache
+  this->insert( ttt );
+
+  return ttt;
+
+}
+
+
+
+void TileManager::insert( RawTile& ttt ){
+
   if( loglevel >= 2 ) insert_timer.start();
-  tileCache->insert( ttt );
+
+  sign( ttt );
+
+  // Raw tiles of high bit depth or floating point images cannot be JPEG cached,
+  // so hold them DEFLATE compressed instead, which lets far more fit into our cache
+  RawTile deflated;
+  if( deflate_level > 0 && ttt.compressionType == UNCOMPRESSED && ttt.bpc > 8 && this->deflate( ttt, deflated ) ){
+    if( loglevel >= 2 ) *logfile << "TileManager :: DEFLATE Compression Time: " << insert_timer.getTime()
+				 << " microseconds" << endl
+				 << "TileManager :: Compression Ratio: " << deflated.dataLength << "/" << ttt.dataLength
+				 << " = " << ( (float)deflated.dataLength/(float)ttt.dataLength ) << endl;
+    tileCache->insert( deflated );
+#ifdef HAVE_SHARED_CACHE
+    if( sharedCache ) sharedCache->insert( deflated );
+#endif
+#ifdef HAVE_MEMCACHED
+    if( memcache ) this->storeMemcached( deflated );
+#endif
+#ifdef HAVE_DISK_CACHE
+    if( diskCache ) diskCache->insert( deflated );
+#endif
+  }
+  else{
+    tileCache->insert( ttt );
+#ifdef HAVE_SHARED_CACHE
+    if( sharedCache ) sharedCache->insert( ttt );
+#endif
+#ifdef HAVE_MEMCACHED
+    if( memcache && ttt.compressionType != UNCOMPRESSED ) this->storeMemcached( ttt );
+#endif
+#ifdef HAVE_DISK_CACHE
+    if( diskCache && DiskCache::storable( ttt.compressionType ) ) diskCache->insert( ttt );
+#endif
+  }
+
   if( loglevel >= 2 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
 			       << " microseconds" << endl;
+}
 
 
-  return ttt;
 
+#ifdef HAVE_MEMCACHED
+string TileManager::memcachedKey( const string& f, int r, int t, int h, int v, CompressionType c, int q, time_t timestamp ){
+
+  // Memcached keys are limited to 250 characters without spaces or control characters,
+  // so use a hash of our full key. The full key is stored with the tile and checked on retrieval
+  string key = Cache::getIndex( f, r, t, h, v, c, q );
+  uint64_t hash = Digest::fnv1a( key.data(), key.size() );
+
+  char name[64];
+  snprintf( name, sizeof(name), "tile::%016llx::%lld", (unsigned long long) hash, (long long) timestamp );
+  return string( name );
+}
+
+
+
+void TileManager::storeMemcached( const RawTile& r ){
+
+  if( !r.data || r.dataLength <= 0 ) return;
+
+  string key = Cache::getIndex( r.filename, r.resolution, r.tileNum, r.hSequence, r.vSequence,
+				r.compressionType, r.quality );
+  size_t length = sizeof(MemcachedTileHeader) + key.size() + r.dataLength;
+  if( length > MEMCACHED_MAX_ITEM ) return;
+
+  unsigned char* value = (unsigned char*) Arena::allocate( length );
+  MemcachedTileHeader* header = (MemcachedTileHeader*) value;
+  memset( header, 0, sizeof(MemcachedTileHeader) );
+  header->magic = MEMCACHED_TILE_MAGIC;
+  header->keyLength = key.size();
+  header->dataLength = r.dataLength;
+  header->tileNum = r.tileNum;
+  header->resolution = r.resolution;
+  header->hSequence = r.hSequence;
+  header->vSequence = r.vSequence;
+  header->width = r.width;
+  header->height = r.height;
+  header->channels = r.channels;
+  header->bpc = r.bpc;
+  header->sampleType = r.sampleType;
+  header->compressionType = r.compressionType;
+  header->quality = r.quality;
+  header->padded = r.padded;
+  header->timestamp = r.timestamp;
+  memcpy( value + sizeof(MemcachedTileHeader), key.data(), key.size() );
+  memcpy( value + sizeof(MemcachedTileHeader) + key.size(), r.data, r.dataLength );
+
+  memcache->store( memcachedKey( r.filename, r.resolution, r.tileNum, r.hSequence, r.vSequence,
+				 r.compressionType, r.quality, r.timestamp ), value, length );
+}
+
+
+
+bool TileManager::getMemcachedTile( int resolution, int tile, int xangle, int yangle, CompressionType c, RawTile& ttt ){
+
+  // Look for our requested encoding and for DEFLATE tiles of high bit depth images
+  CompressionType types[2];
+  int n = 0;
+  if( c != UNCOMPRESSED && c != DEFLATE ) types[n++] = c;
+  if( deflate_level > 0 && image->getNumBitsPerPixel() > 8 ) types[n++] = DEFLATE;
+
+  for( int i = 0; i < n; i++ ){
+
+    int quality = ( types[i] == DEFLATE ) ? 0 : compressor->getQuality();
+    char* value = memcache->retrieve( memcachedKey( image->getImagePath(), resolution, tile, xangle, yangle,
+						    types[i], quality, image->timestamp ) );
+    if( !value ) continue;
+
+    // Check that this really is our tile and not a hash collision or truncated value
+    string key = Cache::getIndex( image->getImagePath(), resolution, tile, xangle, yangle, types[i], quality );
+    const MemcachedTileHeader* header = (const MemcachedTileHeader*) value;
+    size_t length = memcache->length();
+
+    if( length < sizeof(MemcachedTileHeader) || header->magic != MEMCACHED_TILE_MAGIC ||
+	length != sizeof(MemcachedTileHeader) + header->keyLength + header->dataLength ||
+	key.compare( 0, string::npos, value + sizeof(MemcachedTileHeader), header->keyLength ) != 0 ){
+      free( value );
+      continue;
+    }
+
+    ttt = RawTile( header->tileNum, header->resolution, header->hSequence, header->vSequence,
+		   header->width, header->height, header->channels, header->bpc );
+    ttt.sampleType = (SampleType) header->sampleType;
+    ttt.compressionType = (CompressionType) header->compressionType;
+    ttt.quality = header->quality;
+    ttt.padded = header->padded;
+    ttt.timestamp = header->timestamp;
+    ttt.filename = image->getImagePath();
+    ttt.allocate( header->dataLength );
+    memcpy( ttt.data, value + sizeof(MemcachedTileHeader) + header->keyLength, header->dataLength );
+    free( value );
+
+    if( loglevel >= 2 ) *logfile << "TileManager :: Memcached Hit for resolution: " << resolution
+				 << ", tile: " << tile << ", compression: " << compressionName( types[i] ) << endl;
+    sign( ttt );
+    tileCache->insert( ttt );
+#ifdef HAVE_SHARED_CACHE
+    if( sharedCache ) sharedCache->insert( ttt );
+#endif
+    return true;
+  }
+
+  return false;
+}
+#endif
+
+
+
+#ifdef HAVE_SHARED_CACHE
+bool TileManager::getSharedTile( int resolution, int tile, int xangle, int yangle, CompressionType c, RawTile& ttt ){
+
+  // Look for our requested encoding, then for tiles we can convert from
+  CompressionType types[3];
+  int n = 0;
+  types[n++] = c;
+  if( c != DEFLATE && deflate_level > 0 && image->getNumBitsPerPixel() > 8 ) types[n++] = DEFLATE;
+  if( c != UNCOMPRESSED ) types[n++] = UNCOMPRESSED;
+
+  for( int i = 0; i < n; i++ ){
+    int quality = ( types[i] == DEFLATE || types[i] == UNCOMPRESSED ) ? 0 : compressor->getQuality();
+    if( sharedCache->getTile( image->getImagePath(), resolution, tile, xangle, yangle, types[i], quality,
+			      image->timestamp, ttt ) ){
+      if( loglevel >= 2 ) *logfile << "TileManager :: Shared Cache Hit for resolution: " << resolution
+				   << ", tile: " << tile << ", compression: " << compressionName( types[i] ) << endl;
+      sign( ttt );
+      tileCache->insert( ttt );
+      return true;
+    }
+  }
+
+  return false;
+}
+#endif
+
+
+
+#ifdef HAVE_DISK_CACHE
+bool TileManager::getDiskTile( int resolution, int tile, int xangle, int yangle, CompressionType c, RawTile& ttt ){
+
+  // Look for our requested encoding and for DEFLATE tiles of high bit depth images
+  CompressionType types[2];
+  int n = 0;
+  if( DiskCache::storable( c ) && c != DEFLATE ) types[n++] = c;
+  if( deflate_level > 0 && image->getNumBitsPerPixel() > 8 ) types[n++] = DEFLATE;
+
+  for( int i = 0; i < n; i++ ){
+    int quality = ( types[i] == DEFLATE ) ? 0 : compressor->getQuality();
+    if( diskCache->getTile( image->getImagePath(), resolution, tile, xangle, yangle, types[i], quality,
+			    image->timestamp, ttt ) ){
+      if( loglevel >= 2 ) *logfile << "TileManager :: Disk Cache Hit for resolution: " << resolution
+				   << ", tile: " << tile << ", compression: " << compressionName( types[i] ) << endl;
+      sign( ttt );
+      tileCache->insert( ttt );
+#ifdef HAVE_SHARED_CACHE
+      if( sharedCache ) sharedCache->insert( ttt );
+#endif
+      return true;
+    }
+  }
+
+  return false;
+}
+#endif
+
+
+
+bool TileManager::deflate( const RawTile& ttt, RawTile& output ){
+
+  const size_t bytes = ttt.bpc / 8;
+  const size_t len = (size_t) ttt.width * ttt.height * ttt.channels * bytes;
+  if( len == 0 || len > (size_t) ttt.dataLength ) return false;
+
+  // Shuffle our samples into byte planes: the low order bytes of each sample are noisy,
+  // but the high order bytes and float exponents are highly redundant
+  unsigned char* shuffled = (unsigned char*) MemoryPool::allocate( len );
+  const unsigned char* src = (const unsigned char*) ttt.data;
+  const size_t n = len / bytes;
+  for( size_t b = 0; b < bytes; b++ ){
+    unsigned char* plane = &shuffled[b*n];
+    for( size_t i = 0; i < n; i++ ) plane[i] = src[i*bytes + b];
+  }
+
+  uLongf size = compressBound( len );
+  unsigned char* buffer = (unsigned char*) MemoryPool::allocate( size );
+  int status = compress2( buffer, &size, shuffled, len, deflate_level );
+  MemoryPool::release( shuffled );
+
+  // Only keep the compressed tile if it actually saves a worthwhile amount of memory
+  if( status != Z_OK || size > len - len/8 ){
+    MemoryPool::release( buffer );
+    return false;
+  }
+
+  // Copy into a buffer of exactly the right size
+  void* data = MemoryPool::allocate( size );
+  memcpy( data, buffer, size );
+  MemoryPool::release( buffer );
+
+  output = ttt.view();
+  output.adopt( data, size );
+  output.compressionType = DEFLATE;
+  output.quality = 0;
+
+  return true;
+}
+
+
+
+RawTile TileManager::inflate( const RawTile& rawtile ){
+
+  const size_t bytes = rawtile.bpc / 8;
+  const size_t len = (size_t) rawtile.width * rawtile.height * rawtile.channels * bytes;
+
+  unsigned char* shuffled = (unsigned char*) MemoryPool::allocate( len );
+  uLongf size = len;
+  int status = uncompress( shuffled, &size, (const unsigned char*) rawtile.data, rawtile.dataLength );
+
+  if( status != Z_OK || size != len ){
+    MemoryPool::release( shuffled );
+    throw string( "TileManager :: Unable to decompress DEFLATE tile" );
+  }
+
+  // Restore the original byte order of our samples
+  unsigned char* data = (unsigned char*) MemoryPool::allocate( len );
+  const size_t n = len / bytes;
+  for( size_t b = 0; b < bytes; b++ ){
+    const unsigned char* plane = &shuffled[b*n];
+    for( size_t i = 0; i < n; i++ ) data[i*bytes + b] = plane[i];
+  }
+  MemoryPool::release( shuffled );
+
+  RawTile ttt = rawtile.view();
+  ttt.adopt( data, len );
+  ttt.compressionType = UNCOMPRESSED;
+  ttt.quality = 0;
+
+  return ttt;
 }
 
 
@@ -131,7 +481,7 @@ void TileManager::crop( RawTile *ttt ){
   // Create a new buffer, fill it with the old data, then copy
   // back the cropped part into the RawTile buffer
   int len = tw * th * ttt->channels * ttt->bpc/8;
-  unsigned char* buffer = (unsigned char*) malloc( len );
+  unsigned char* buffer = (unsigned char*) Arena::allocate( len );
   unsigned char* src_ptr = (unsigned char*) memcpy( buffer, ttt->data, len );
   unsigned char* dst_ptr = (unsigned char*) ttt->data;
 
@@ -143,8 +493,6 @@ void TileManager::crop( RawTile *ttt ){
     src_ptr += tw * ttt->channels * ttt->bpc/8;
   }
 
-  free( buffer );
-
   // Reset the data length
   len = ttt->width * ttt->height * ttt->channels * ttt->bpc/8;
   ttt->dataLength = len;
@@ -155,11 +503,19 @@ void TileManager::crop( RawTile *ttt ){
 
 
 
+uint64_t TileManager::getDigest( int resolution, int tile, int xangle, int yangle, CompressionType c ){
+  const RawTile* rawtile = tileCache->peekTile( image->getImagePath(), resolution, tile, xangle, yangle,
+						 c, compressor->getQuality() );
+  if( !rawtile || rawtile->timestamp < image->timestamp ) return 0;
+  return rawtile->digest;
+}
+
+
+
 RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c ){
 
   RawTile* rawtile = NULL;
   string tileCompression;
-  string compName;
 
 
   // Time the tile retrieval
@@ -174,7 +530,18 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
 
     case JPEG:
       if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					  xangle, yangle, JPEG, jpeg->getQuality() )) ) break;
+					  xangle, yangle, JPEG, compressor->getQuality() )) ) break;
+      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
+					 xangle, yangle, DEFLATE, 0 )) ) break;
+      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
+					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
+      break;
+
+
+    case PNG:
+    case WEBP:
+      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
+					 xangle, yangle, c, compressor->getQuality() )) ) break;
       if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
 					 xangle, yangle, DEFLATE, 0 )) ) break;
       if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
@@ -195,6 +562,8 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
 
       if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
 					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
+      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
+					 xangle, yangle, DEFLATE, 0 )) ) break;
       break;
 
 
@@ -204,6 +573,24 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
     }
 
 
+  // Tiles found in our other caches are held here, as our memory cache may not keep a copy
+  RawTile fetched;
+
+#ifdef HAVE_SHARED_CACHE
+  // Check the cache shared with our other processes
+  if( !rawtile && sharedCache && this->getSharedTile( resolution, tile, xangle, yangle, c, fetched ) ) rawtile = &fetched;
+#endif
+
+#ifdef HAVE_DISK_CACHE
+  // Check our disk cache before decoding the source image
+  if( !rawtile && diskCache && this->getDiskTile( resolution, tile, xangle, yangle, c, fetched ) ) rawtile = &fetched;
+#endif
+
+#ifdef HAVE_MEMCACHED
+  // Check whether another server has already encoded this tile
+  if( !rawtile && memcache && this->getMemcachedTile( resolution, tile, xangle, yangle, c, fetched ) ) rawtile = &fetched;
+#endif
+
   // If we haven't been able to get a tile, get a raw one
   if( !rawtile || (rawtile && (rawtile->timestamp < image->timestamp)) ){
 
@@ -221,32 +608,35 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
   }
 
 
-  // Define our compression names
-  switch( rawtile->compressionType ){
-    case JPEG: compName = "JPEG"; break;
-    case DEFLATE: compName = "DEFLATE"; break;
-    case UNCOMPRESSED: compName = "UNCOMPRESSED"; break;
-    default: break;
-  }
-
   if( loglevel >= 2 ) *logfile << "TileManager :: Cache Hit for resolution: " << resolution
 			       << ", tile: " << tile
-			       << ", compression: " << compName << endl
+			       << ", compression: " << compressionName( rawtile->compressionType ) << endl
 			       << "TileManager :: Cache Size: "
 			       << tileCache->getNumElements() << " tiles, "
 			       << tileCache->getMemorySize() << " MB" << endl;
 
 
   // Check whether the compression used for out tile matches our requested compression type.
-  // If not, we must convert
+  // If not, we must convert. Tiles held DEFLATE compressed must always first be decompressed
+
+  bool convert = (c == JPEG || c == PNG || c == WEBP) && compressible( *rawtile, c ) &&
+    (rawtile->compressionType == UNCOMPRESSED || rawtile->compressionType == DEFLATE);
 
-  if( c == JPEG && rawtile->compressionType == UNCOMPRESSED ){
+  if( convert || rawtile->compressionType == DEFLATE ){
 
-    // Rawtile is a pointer to the cache data, so we need to create a copy of it in case we compress it
-    RawTile ttt( *rawtile );
+    RawTile ttt;
 
-    // Do our JPEG compression iff we have an 8 bit per channel image and either 1 or 3 bands
-    if( rawtile->bpc==8 && (rawtile->channels==1 || rawtile->channels==3) ){
+    if( rawtile->compressionType == DEFLATE ){
+      if( loglevel >= 2 ) compression_timer.start();
+      ttt = this->inflate( *rawtile );
+      if( loglevel >= 2 ) *logfile << "TileManager :: DEFLATE Decompression Time: "
+				   << compression_timer.getTime() << " microseconds" << endl;
+    }
+    // Rawtile is a pointer to the cache data, so we need to create our own copy before cropping and compressing
+    else ttt = *rawtile;
+
+    // Only compress if our format can handle the bit depth and number of channels of our tile
+    if( convert ){
 
       // Crop if this is an edge tile
       if( ( (ttt.width != image->getTileWidth()) || (ttt.height != image->getTileHeight()) ) && ttt.padded ){
@@ -255,30 +645,33 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
       }
 
       if( loglevel >=2 ) compression_timer.start();
-      unsigned int oldlen = rawtile->dataLength;
-      unsigned int newlen = jpeg->Compress( ttt );
-      if( loglevel >= 2 ) *logfile << "TileManager :: JPEG requested, but UNCOMPRESSED compression found in cache." << endl
-				   << "TileManager :: JPEG Compression Time: "
-				   << compression_timer.getTime() << " microseconds" << endl
-				   << "TileManager :: Compression Ratio: " << newlen << "/" << oldlen << " = "
-				   << ( (float)newlen/(float)oldlen ) << endl;
+      unsigned int oldlen = ttt.dataLength;
+      unsigned int newlen = compressor->Compress( ttt, true );
+      if( loglevel >= 2 ){
+	const char* name = compressionName( c );
+	*logfile << "TileManager :: " << name << " requested, but " << compressionName( rawtile->compressionType )
+		 << " compression found in cache." << endl
+		 << "TileManager :: " << name << " Compression Time: "
+		 << compression_timer.getTime() << " microseconds" << endl
+		 << "TileManager :: Compression Ratio: " << newlen << "/" << oldlen << " = "
+		 << ( (float)newlen/(float)oldlen ) << endl;
+      }
 
       // Add our compressed tile to the cache
-      if( loglevel >= 2 ) insert_timer.start();
-      tileCache->insert( ttt );
-      if( loglevel >= 2 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
-				   << " microseconds" << endl;
-
-      if( loglevel >= 2 ) *logfile << "TileManager :: Total Tile Access Time: "
-				   << tile_timer.getTime() << " microseconds" << endl;
-      return RawTile( ttt );
+      this->insert( ttt );
     }
+
+    if( loglevel >= 2 ) *logfile << "TileManager :: Total Tile Access Time: "
+				 << tile_timer.getTime() << " microseconds" << endl;
+    return ttt;
   }
 
   if( loglevel >= 2 ) *logfile << "TileManager :: Total Tile Access Time: "
 			       << tile_timer.getTime() << " microseconds" << endl;
 
-  return RawTile( *rawtile );
+  // Hand over a tile we fetched ourselves, otherwise return a view onto our cached tile rather than a copy
+  if( rawtile == &fetched ) return fetched;
+  return rawtile->view();
 
 
 }
@@ -356,21 +749,20 @@ RawTile TileManager::getRegion( unsigned int res, int seq, int ang, int layers,
 
   // Create an empty tile with the correct dimensions
   RawTile region( 0, res, seq, ang, width, height, channels, bpc );
-  region.dataLength = width * height * channels * bpc/8;
   region.sampleType = sampleType;
 
   // Allocate memory for the region
-  if( bpc == 8 ) region.data = new unsigned char[width*height*channels];
-  else if( bpc == 16 ) region.data = new unsigned short[width*height*channels];
-  else if( bpc == 32 && sampleType == FIXEDPOINT ) region.data = new int[width*height*channels];
-  else if( bpc == 32 && sampleType == FLOATINGPOINT ) region.data = new float[width*height*channels];
+  region.allocate( width * height * channels * bpc/8 );
 
   unsigned int current_height = 0;
 
+  // Size in bytes of a single pixel
+  const size_t pixel_size = channels * bpc/8;
+
   // Decode the image strip by strip
   for( unsigned int i=starty; i<endy; i++ ){
 
-    unsigned int buffer_index = 0;
+    size_t buffer_index = 0;
 
     // Keep track of the current pixel boundary horizontally. ie. only up
     //  to the beginning of the current tile boundary.
@@ -448,33 +840,16 @@ RawTile TileManager::getRegion( unsigned int res, int seq, int ang, int layers,
 
 
       // Copy our tile data into the appropriate part of the strip memory
-      // one whole tile width at a time
-      for( unsigned int k=0; k<dst_tile_height; k++ ){
+      // one whole tile width at a time. Rows are contiguous whatever the sample
+      // type, so simply work in bytes
+      const unsigned char* ptr = (const unsigned char*) rawtile.data;
+      unsigned char* buf = (unsigned char*) region.data;
+      size_t row_length = (size_t) dst_tile_width * pixel_size;
 
-	buffer_index = (current_width*channels) + (k*width*channels) + (current_height*width*channels);
-	unsigned int inx = ((k+yf)*rawtile.width*channels) + (xf*channels);
-
-	// Simply copy the line of data across
-	if( bpc == 8 ){
-	  unsigned char* ptr = (unsigned char*) rawtile.data;
-	  unsigned char* buf = (unsigned char*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels );
-	}
-	else if( bpc ==  16 ){
-	  unsigned short* ptr = (unsigned short*) rawtile.data;
-	  unsigned short* buf = (unsigned short*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*2 );
-	}
-	else if( bpc == 32 && sampleType == FIXEDPOINT ){
-	  unsigned int* ptr = (unsigned int*) rawtile.data;
-	  unsigned int* buf = (unsigned int*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*4 );
-	}
-	else if( bpc == 32 && sampleType == FLOATINGPOINT ){
-	  float* ptr = (float*) rawtile.data;
-	  float* buf = (float*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*4 );
-	}
+      for( unsigned int k=0; k<dst_tile_height; k++ ){
+	buffer_index = (current_width + (k+current_height)*width) * pixel_size;
+	size_t inx = ((size_t)(k+yf)*rawtile.width + xf) * pixel_size;
+	memcpy( &buf[buffer_index], &ptr[inx], row_length );
       }
 
       current_width += dst_tile_width;
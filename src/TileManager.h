@@ -33,6 +33,18 @@
 #include "Timer.h"
 #include "Watermark.h"
 
+#ifdef HAVE_DISK_CACHE
+#include "DiskCache.h"
+#endif
+
+#ifdef HAVE_SHARED_CACHE
+#include "SharedCache.h"
+#endif
+
+#ifdef HAVE_MEMCACHED
+class Memcache;
+#endif
+
 
 
 /// Class to manage access to the tile cache and tile cropping
@@ -43,13 +55,31 @@ class TileManager{
  private:
 
   Cache* tileCache;
-  Compressor* jpeg;
+  Compressor* compressor;
   IIPImage* image;
   Watermark* watermark;
   std::ofstream* logfile;
   int loglevel;
   Timer compression_timer, tile_timer, insert_timer;
 
+  /// zlib compression level used for raw tiles held in the cache (0 to disable)
+  static int deflate_level;
+
+#ifdef HAVE_DISK_CACHE
+  /// Persistent second level tile cache (or NULL)
+  static DiskCache* diskCache;
+#endif
+
+#ifdef HAVE_SHARED_CACHE
+  /// Tile cache shared with our other server processes (or NULL)
+  static SharedCache* sharedCache;
+#endif
+
+#ifdef HAVE_MEMCACHED
+  /// Memcached servers used to share encoded tiles between hosts (or NULL)
+  static Memcache* memcache;
+#endif
+
   /// Get a new tile from the image file
   /**
    *  If the JPEG tile already exists in the cache, use that, otherwise check for
@@ -72,6 +102,92 @@ class TileManager{
   void crop( RawTile* t );
 
 
+  /// Insert a tile into our cache
+  /** Uncompressed tiles of high bit depth or floating point images are
+   *  stored DEFLATE compressed if enabled. Encoded tiles are given their digest
+   *  @param t tile to insert
+   */
+  void insert( RawTile& t );
+
+
+#ifdef HAVE_DISK_CACHE
+  /// Look for a tile in our disk cache
+  /** The requested encoding is tried first, followed by DEFLATE for high bit depth images.
+   *  A tile found is returned in ttt, which the caller owns, and a copy is offered to our
+   *  memory cache and to our shared memory cache, which may or may not keep it
+   *  @param resolution resolution number
+   *  @param tile tile number
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param c CompressionType
+   *  @param ttt set to the tile found
+   *  @return whether the tile was found
+   */
+  bool getDiskTile( int resolution, int tile, int xangle, int yangle, CompressionType c, RawTile& ttt );
+#endif
+
+
+#ifdef HAVE_SHARED_CACHE
+  /// Look for a tile in the cache shared with our other processes
+  /** The requested encoding is tried first, followed by DEFLATE for high bit depth images
+   *  and then by UNCOMPRESSED. A tile found is returned in ttt, which the caller owns, and a
+   *  copy is offered to our memory cache, which may or may not keep it
+   *  @param resolution resolution number
+   *  @param tile tile number
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param c CompressionType
+   *  @param ttt set to the tile found
+   *  @return whether the tile was found
+   */
+  bool getSharedTile( int resolution, int tile, int xangle, int yangle, CompressionType c, RawTile& ttt );
+#endif
+
+
+#ifdef HAVE_MEMCACHED
+  /// Return the memcached key for a tile
+  /** Includes the image timestamp so that tiles of modified images are never returned */
+  static std::string memcachedKey( const std::string& f, int r, int t, int h, int v,
+				   CompressionType c, int q, time_t timestamp );
+
+  /// Store an encoded tile in memcached
+  /** @param t tile to store */
+  void storeMemcached( const RawTile& t );
+
+  /// Look for a tile in memcached
+  /** The requested encoding is tried first, followed by DEFLATE for high bit depth images.
+   *  Values which do not match our full tile key are ignored. A tile found is returned in
+   *  ttt, which the caller owns, and a copy is offered to our memory cache and to our shared
+   *  memory cache, which may or may not keep it
+   *  @param resolution resolution number
+   *  @param tile tile number
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param c CompressionType
+   *  @param ttt set to the tile found
+   *  @return whether the tile was found
+   */
+  bool getMemcachedTile( int resolution, int tile, int xangle, int yangle, CompressionType c, RawTile& ttt );
+#endif
+
+
+  /// DEFLATE compress a raw tile
+  /** Bytes are shuffled into planes before compression as the high and low
+   *  order bytes of multi-byte samples compress very differently
+   *  @param t uncompressed tile
+   *  @param r tile to receive the compressed data
+   *  @return whether compression was worthwhile
+   */
+  bool deflate( const RawTile& t, RawTile& r );
+
+
+  /// Decompress a DEFLATE compressed tile
+  /** @param t DEFLATE compressed tile
+   *  @return uncompressed tile
+   */
+  RawTile inflate( const RawTile& t );
+
+
  public:
 
 
@@ -80,7 +196,7 @@ class TileManager{
    * @param tc pointer to tile cache object
    * @param im pointer to IIPImage object
    * @param w  pointer to watermark object
-   * @param j  pointer to JPEGCompressor object
+   * @param j  pointer to Compressor object used for JPEG or PNG tiles
    * @param s  pointer to output file stream
    * @param l  logging level
    */
@@ -88,13 +204,58 @@ class TileManager{
     tileCache = tc; 
     image = im;
     watermark = w;
-    jpeg = j;
+    compressor = j;
     logfile = s ;
     loglevel = l;
   };
 
 
 
+  /// Set the compression level used for raw tiles held in the cache
+  /** @param level zlib compression level (1-9) or 0 to store raw tiles uncompressed */
+  static void setDeflateLevel( int level ){
+    if( level < 0 ) deflate_level = 0;
+    else if( level > 9 ) deflate_level = 9;
+    else deflate_level = level;
+  };
+
+
+
+#ifdef HAVE_DISK_CACHE
+  /// Set our second level disk tile cache
+  /** @param d disk cache or NULL to disable */
+  static void setDiskCache( DiskCache* d ){ diskCache = d; };
+#endif
+
+
+
+#ifdef HAVE_SHARED_CACHE
+  /// Set our shared memory tile cache
+  /** @param s shared cache or NULL to disable */
+  static void setSharedCache( SharedCache* s ){ sharedCache = s; };
+#endif
+
+
+
+#ifdef HAVE_MEMCACHED
+  /// Set the memcached servers used as a tile cache
+  /** @param m memcached connection or NULL to disable */
+  static void setMemcache( Memcache* m ){ memcache = m; };
+#endif
+
+
+
+  /// Return the digest of an encoded tile held in our memory cache without fetching it
+  /** @param resolution resolution number
+   *  @param tile tile number
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param c encoding
+   *  @return digest or 0 if no up to date tile with this encoding is held
+   */
+  uint64_t getDigest( int resolution, int tile, int xangle, int yangle, CompressionType c );
+
+
   /// Get a tile from the cache
   /**
    *  If the JPEG tile already exists in the cache, use that, otherwise check for
@@ -106,7 +267,8 @@ class TileManager{
    *  @param yangle vertical sequence number
    *  @param layers number of quality layers within image to decode
    *  @param c CompressionType
-   *  @return RawTile
+   *  @return RawTile: tiles found in the cache are returned as borrowed views of the
+   *  cached data, valid until the next cache insertion, which must not be modified in place
    */
   RawTile getTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c );
 
@@ -21,8 +21,19 @@
 
 
 #include <cmath>
+#include <cstddef>
 #include "Transforms.h"
 
+// SSE2 is always available on x86-64, but MSVC does not define __SSE2__
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(USE_SSE2) && defined(__SSSE3__)
+#define USE_SSSE3
+#include <tmmintrin.h>
+#endif
+
 
 // Define something similar to C99 std::isfinite if this does not exist
 // Need to also check for a direct define as it can be implemented as a macro
@@ -50,6 +61,10 @@ static bool isfinite( float arg )
  */
 #define PARALLEL_THRESHOLD 65536
 
+/* Block size in pixels for cache-blocked transposes
+ */
+#define TRANSPOSE_BLOCK 32
+
 
 static const float _sRGB[3][3] = { {  3.240479, -1.537150, -0.498535 },
 				   { -0.969256, 1.875992, 0.041556 },
@@ -72,10 +87,12 @@ void filter_normalize( RawTile& in, vector<float>& max, vector<float>& min ) {
   unsigned char* ucptr;
 
   if( in.bpc == 32 && in.sampleType == FLOATINGPOINT ) {
+    // Float data is normalized in place, so make sure it is ours to modify
+    in.detach();
     normdata = (float*)in.data;
   }
   else {
-    normdata = new float[np];
+    normdata = (float*) MemoryPool::allocate( np*sizeof(float) );
   }
 
   for( unsigned int c = 0 ; c<nc ; c++){
@@ -135,21 +152,9 @@ void filter_normalize( RawTile& in, vector<float>& max, vector<float>& min ) {
     }
   }
 
-  // Delete our original buffers, unless we already had floats
-  if( in.bpc == 32 && in.sampleType == FIXEDPOINT ){
-    delete[] (unsigned int*) in.data;
-  }
-  else if( in.bpc == 16 ){
-    delete[] (unsigned short*) in.data;
-  }
-  else if( in.bpc == 8 ){
-    delete[] (unsigned char*) in.data;
-  }
-
-  // Assign our new buffer and modify some info
-  in.data = normdata;
+  // Replace our original buffer with our new one, unless we already had floats
   in.bpc = 32;
-  in.dataLength = np * in.bpc / 8;
+  in.adopt( normdata, np * in.bpc / 8 );
 
 }
 
@@ -185,7 +190,7 @@ void filter_shade( RawTile& in, int h_angle, int v_angle ){
   infptr= (float*)in.data;
 
   // Create new (float) data buffer
-  buffer = new float[ndata];
+  buffer = (float*) MemoryPool::allocate( ndata*sizeof(float) );
 
 
 #if defined(__ICC) || defined(__INTEL_COMPILER)
@@ -216,12 +221,9 @@ void filter_shade( RawTile& in, int h_angle, int v_angle ){
   }
 
 
-  // Delete old data buffer
-  delete[] (float*) in.data;
-
-  in.data = buffer;
+  // Replace old data buffer
+  in.adopt( buffer, in.width * in.height * in.bpc / 8 );
   in.channels = 1;
-  in.dataLength = in.width * in.height * in.bpc / 8;
 }
 
 
@@ -320,6 +322,9 @@ static void LAB2sRGB( unsigned char *in, unsigned char *out ){
 // Convert whole tile from CIELAB to sRGB
 void filter_LAB2sRGB( RawTile& in ){
 
+  // We convert in place, so make sure we are not modifying a borrowed buffer
+  in.detach();
+
   unsigned long np = in.width * in.height * in.channels;
 
   // Parallelize code using OpenMP
@@ -352,7 +357,7 @@ void filter_cmap( RawTile& in, enum cmap_type cmap ){
   const float max8 = 1.0/8.0;
 
   float *fptr = (float*)in.data;
-  float *outptr = new float[ndata*out_chan];
+  float *outptr = (float*) MemoryPool::allocate( ndata*out_chan*sizeof(float) );
   float *outv = outptr;
 
   switch(cmap){
@@ -458,10 +463,8 @@ void filter_cmap( RawTile& in, enum cmap_type cmap ){
   };
 
   // Delete old data buffer
-  delete[] (float*) in.data;
-  in.data = outptr;
+  in.adopt( outptr, ndata * out_chan * in.bpc / 8 );
   in.channels = out_chan;
-  in.dataLength = ndata * out_chan * in.bpc / 8;
 }
 
 
@@ -499,11 +502,11 @@ void filter_interpolate_nearestneighbour( RawTile& in, unsigned int resampled_wi
   // Pointer to output buffer
   unsigned char *output;
 
-  // Create new buffer if size is larger than input size
+  // Create new buffer if size is larger than input size or if we cannot modify our input
   bool new_buffer = false;
-  if( resampled_width*resampled_height > in.width*in.height ){
+  if( resampled_width*resampled_height > in.width*in.height || !in.ownsData() ){
     new_buffer = true;
-    output = new unsigned char[resampled_width*resampled_height*in.channels];
+    output = (unsigned char*) MemoryPool::allocate( resampled_width*resampled_height*in.channels );
   }
   else output = (unsigned char*) in.data;
 
@@ -527,14 +530,11 @@ void filter_interpolate_nearestneighbour( RawTile& in, unsigned int resampled_wi
     }
   }
 
-  // Delete original buffer
-  if( new_buffer ) delete[] (unsigned char*) input;
-
-  // Correctly set our Rawtile info
+  // Correctly set our Rawtile info, replacing the original buffer if necessary
   in.width = resampled_width;
   in.height = resampled_height;
-  in.dataLength = resampled_width * resampled_height * channels * in.bpc/8;
-  in.data = output;
+  if( new_buffer ) in.adopt( output, resampled_width * resampled_height * channels * in.bpc/8 );
+  else in.dataLength = resampled_width * resampled_height * channels * in.bpc/8;
 }
 
 
@@ -552,7 +552,7 @@ void filter_interpolate_bilinear( RawTile& in, unsigned int resampled_width, uns
   unsigned long np = in.channels * in.width * in.height;
 
   // Create new buffer and pointer for our output
-  unsigned char *output = new unsigned char[resampled_width*resampled_height*in.channels];
+  unsigned char *output = (unsigned char*) MemoryPool::allocate( resampled_width*resampled_height*in.channels );
 
   // Calculate our scale
   float xscale = (float)(width) / (float)resampled_width;
@@ -610,14 +610,10 @@ void filter_interpolate_bilinear( RawTile& in, unsigned int resampled_width, uns
     }
   }
 
-  // Delete original buffer
-  delete[] (unsigned char*) input;
-
-  // Correctly set our Rawtile info
+  // Correctly set our Rawtile info and replace the original buffer
   in.width = resampled_width;
   in.height = resampled_height;
-  in.dataLength = resampled_width * resampled_height * channels * in.bpc/8;
-  in.data = output;
+  in.adopt( output, resampled_width * resampled_height * channels * in.bpc/8 );
 }
 
 
@@ -626,7 +622,7 @@ void filter_interpolate_bilinear( RawTile& in, unsigned int resampled_width, uns
 void filter_contrast( RawTile& in, float c ){
 
   unsigned long np = in.width * in.height * in.channels;
-  unsigned char* buffer = new unsigned char[np];
+  unsigned char* buffer = (unsigned char*) MemoryPool::allocate( np );
   float* infptr = (float*)in.data;
 
 #if defined(__ICC) || defined(__INTEL_COMPILER)
@@ -640,10 +636,8 @@ void filter_contrast( RawTile& in, float c ){
   }
 
   // Replace original buffer with new
-  delete[] (float*) in.data;
-  in.data = buffer;
   in.bpc = 8;
-  in.dataLength = np * in.bpc/8;
+  in.adopt( buffer, np * in.bpc/8 );
 }
 
 
@@ -670,72 +664,298 @@ void filter_gamma( RawTile& in, float g ){
 
 
 
-// Rotation function
-void filter_rotate( RawTile& in, float angle=0.0 ){
+/* Pixel kernels below are templated over the sample type T and the number of channels C
+   so that pixel strides are compile-time constants and inner loops can be fully unrolled
+   and vectorized. They are dispatched once per call on the tile's bit depth and channel
+   count. C=0 is a fallback for less common channel counts, which are given at run time.
+ */
 
-  // Currently implemented only for rectangular rotations
-  if( (int)angle % 90 == 0 && (int)angle % 360 != 0 ){
 
-    // Intialize our counter
-    unsigned int n = 0;
+// SIMD pixel shuffles templated on pixel size S in bytes. Pixels are moved around
+// whole, so only their size matters, not the sample type or number of channels.
+// Unsupported pixel sizes have a tile size n of zero and fall back to scalar code.
 
-    // Allocate memory for our temporary buffer - rotate function only ever operates on 8bit data
-    void *buffer = new unsigned char[in.width*in.height*in.channels];
+// Reverse the order of the pixels within a 16 byte vector
+template <int S> struct PixelReverse {
+  static const unsigned int n = 0;
+  static void apply( const unsigned char*, unsigned char* ){};
+};
+
+#ifdef USE_SSE2
+
+#ifdef USE_SSSE3
+template <> struct PixelReverse<1> {
+  static const unsigned int n = 16;
+  static void apply( const unsigned char* in, unsigned char* out ){
+    const __m128i mask = _mm_setr_epi8( 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0 );
+    __m128i x = _mm_loadu_si128( (const __m128i*) in );
+    _mm_storeu_si128( (__m128i*) out, _mm_shuffle_epi8( x, mask ) );
+  };
+};
+#endif
+
+template <> struct PixelReverse<2> {
+  static const unsigned int n = 8;
+  static void apply( const unsigned char* in, unsigned char* out ){
+    __m128i x = _mm_loadu_si128( (const __m128i*) in );
+    x = _mm_shufflelo_epi16( x, _MM_SHUFFLE(0,1,2,3) );
+    x = _mm_shufflehi_epi16( x, _MM_SHUFFLE(0,1,2,3) );
+    _mm_storeu_si128( (__m128i*) out, _mm_shuffle_epi32( x, _MM_SHUFFLE(1,0,3,2) ) );
+  };
+};
+
+template <> struct PixelReverse<4> {
+  static const unsigned int n = 4;
+  static void apply( const unsigned char* in, unsigned char* out ){
+    __m128i x = _mm_loadu_si128( (const __m128i*) in );
+    _mm_storeu_si128( (__m128i*) out, _mm_shuffle_epi32( x, _MM_SHUFFLE(0,1,2,3) ) );
+  };
+};
+
+template <> struct PixelReverse<8> {
+  static const unsigned int n = 2;
+  static void apply( const unsigned char* in, unsigned char* out ){
+    __m128i x = _mm_loadu_si128( (const __m128i*) in );
+    _mm_storeu_si128( (__m128i*) out, _mm_shuffle_epi32( x, _MM_SHUFFLE(1,0,3,2) ) );
+  };
+};
+
+#endif
+
+
+
+// Transpose a square tile of n x n pixels: pixel m of source row c is written to
+// pixel c of destination row m. Rows are given as arrays of pointers, allowing the
+// caller to combine the transpose with a reversal of either axis
+template <int S> struct PixelTranspose {
+  static const unsigned int n = 0;
+  static void apply( const unsigned char* const*, unsigned char* const* ){};
+};
+
+#ifdef USE_SSE2
+
+// 8x8 tile of 8 bit pixels
+template <> struct PixelTranspose<1> {
+  static const unsigned int n = 8;
+  static void apply( const unsigned char* const* s, unsigned char* const* d ){
+    __m128i a0 = _mm_unpacklo_epi8( _mm_loadl_epi64( (const __m128i*) s[0] ), _mm_loadl_epi64( (const __m128i*) s[1] ) );
+    __m128i a1 = _mm_unpacklo_epi8( _mm_loadl_epi64( (const __m128i*) s[2] ), _mm_loadl_epi64( (const __m128i*) s[3] ) );
+    __m128i a2 = _mm_unpacklo_epi8( _mm_loadl_epi64( (const __m128i*) s[4] ), _mm_loadl_epi64( (const __m128i*) s[5] ) );
+    __m128i a3 = _mm_unpacklo_epi8( _mm_loadl_epi64( (const __m128i*) s[6] ), _mm_loadl_epi64( (const __m128i*) s[7] ) );
+    __m128i b0 = _mm_unpacklo_epi16( a0, a1 );
+    __m128i b1 = _mm_unpackhi_epi16( a0, a1 );
+    __m128i b2 = _mm_unpacklo_epi16( a2, a3 );
+    __m128i b3 = _mm_unpackhi_epi16( a2, a3 );
+    __m128i c[4] = { _mm_unpacklo_epi32( b0, b2 ), _mm_unpackhi_epi32( b0, b2 ),
+		     _mm_unpacklo_epi32( b1, b3 ), _mm_unpackhi_epi32( b1, b3 ) };
+    for( int k=0; k<4; k++ ){
+      _mm_storel_epi64( (__m128i*) d[2*k], c[k] );
+      _mm_storel_epi64( (__m128i*) d[2*k+1], _mm_unpackhi_epi64( c[k], c[k] ) );
+    }
+  };
+};
+
+// 8x8 tile of 16 bit pixels
+template <> struct PixelTranspose<2> {
+  static const unsigned int n = 8;
+  static void apply( const unsigned char* const* s, unsigned char* const* d ){
+    __m128i r[8];
+    for( int k=0; k<8; k++ ) r[k] = _mm_loadu_si128( (const __m128i*) s[k] );
+    __m128i a[8];
+    for( int k=0; k<4; k++ ){
+      a[2*k] = _mm_unpacklo_epi16( r[2*k], r[2*k+1] );
+      a[2*k+1] = _mm_unpackhi_epi16( r[2*k], r[2*k+1] );
+    }
+    __m128i b[8] = { _mm_unpacklo_epi32( a[0], a[2] ), _mm_unpackhi_epi32( a[0], a[2] ),
+		     _mm_unpacklo_epi32( a[1], a[3] ), _mm_unpackhi_epi32( a[1], a[3] ),
+		     _mm_unpacklo_epi32( a[4], a[6] ), _mm_unpackhi_epi32( a[4], a[6] ),
+		     _mm_unpacklo_epi32( a[5], a[7] ), _mm_unpackhi_epi32( a[5], a[7] ) };
+    for( int k=0; k<4; k++ ){
+      _mm_storeu_si128( (__m128i*) d[2*k], _mm_unpacklo_epi64( b[k], b[k+4] ) );
+      _mm_storeu_si128( (__m128i*) d[2*k+1], _mm_unpackhi_epi64( b[k], b[k+4] ) );
+    }
+  };
+};
+
+// 4x4 tile of 32 bit pixels (8 bit RGBA or 32 bit single channel)
+template <> struct PixelTranspose<4> {
+  static const unsigned int n = 4;
+  static void apply( const unsigned char* const* s, unsigned char* const* d ){
+    __m128i r0 = _mm_loadu_si128( (const __m128i*) s[0] );
+    __m128i r1 = _mm_loadu_si128( (const __m128i*) s[1] );
+    __m128i r2 = _mm_loadu_si128( (const __m128i*) s[2] );
+    __m128i r3 = _mm_loadu_si128( (const __m128i*) s[3] );
+    __m128i t0 = _mm_unpacklo_epi32( r0, r1 );
+    __m128i t1 = _mm_unpacklo_epi32( r2, r3 );
+    __m128i t2 = _mm_unpackhi_epi32( r0, r1 );
+    __m128i t3 = _mm_unpackhi_epi32( r2, r3 );
+    _mm_storeu_si128( (__m128i*) d[0], _mm_unpacklo_epi64( t0, t1 ) );
+    _mm_storeu_si128( (__m128i*) d[1], _mm_unpackhi_epi64( t0, t1 ) );
+    _mm_storeu_si128( (__m128i*) d[2], _mm_unpacklo_epi64( t2, t3 ) );
+    _mm_storeu_si128( (__m128i*) d[3], _mm_unpackhi_epi64( t2, t3 ) );
+  };
+};
 
-    // Rotate 90
-    if( (int) angle % 360 == 90 ){
-#if defined(__ICC) || defined(__INTEL_COMPILER)
-#pragma ivdep
-#elif defined(_OPENMP)
-#pragma omp parallel for if( in.width*in.height > PARALLEL_THRESHOLD )
 #endif
-      for( unsigned int i=0; i < in.width; i++ ){
-	unsigned int n = i*in.height*in.channels;
-	for( int j=in.height-1; j>=0; j-- ){
-	  unsigned int index = (in.width*j + i)*in.channels;
-	  for( int k=0; k < in.channels; k++ ){
-	    ((unsigned char*)buffer)[n++] = ((unsigned char*)in.data)[index+k];
+
+
+
+// Copy a row of pixels in reverse order
+template <typename T, int C>
+static inline void reverse_row( const T* in, T* out, unsigned int width, unsigned int nc ){
+
+  unsigned int i = 0;
+
+  // Vectorized reversal of whole blocks of pixels taken alternately from each end
+  if( C ){
+    typedef PixelReverse<sizeof(T)*C> R;
+    const unsigned int n = R::n;
+    for( ; n && i+n <= width; i+=n ){
+      R::apply( (const unsigned char*) &in[(size_t)(width-i-n)*nc], (unsigned char*) &out[(size_t)i*nc] );
+    }
+  }
+
+  for( ; i<width; i++ ){
+    const T* p = &in[(size_t)(width-1-i)*nc];
+    for( unsigned int k=0; k<nc; k++ ) out[(size_t)i*nc+k] = p[k];
+  }
+}
+
+
+
+// Transpose a block of output rows i0 to i1 and columns j0 to j1, where output pixel (i,j)
+// of a row of length height comes from input pixel base + i*di + j*dj
+template <typename T, int C>
+static void transpose_block( const T* in, T* out, unsigned int height, unsigned int nc,
+			     ptrdiff_t base, ptrdiff_t di, ptrdiff_t dj,
+			     unsigned int i0, unsigned int i1, unsigned int j0, unsigned int j1 ){
+
+  // Limits of the area covered by whole SIMD tiles
+  unsigned int ie = i0, je = j0;
+
+  if( C ){
+    typedef PixelTranspose<sizeof(T)*C> P;
+    const unsigned int n = P::n;
+    if( n ){
+      ie = i0 + ((i1-i0)/n)*n;
+      je = j0 + ((j1-j0)/n)*n;
+      const unsigned char* s[8];
+      unsigned char* d[8];
+      for( unsigned int i=i0; i<ie; i+=n ){
+	// If input columns run backwards, load from the far end and store output rows in reverse
+	const unsigned int first = (di > 0) ? i : i+n-1;
+	for( unsigned int j=j0; j<je; j+=n ){
+	  for( unsigned int m=0; m<n; m++ ){
+	    s[m] = (const unsigned char*) &in[(base + first*di + (ptrdiff_t)(j+m)*dj)*nc];
+	    d[m] = (unsigned char*) &out[((size_t)((di > 0) ? i+m : i+n-1-m)*height + j)*nc];
 	  }
+	  P::apply( s, d );
 	}
       }
     }
+  }
+
+  // Scalar copy for everything not covered by whole tiles
+  for( unsigned int i=i0; i<i1; i++ ){
+    T* o = &out[(size_t)i*height*nc];
+    const T* p = &in[(base + (ptrdiff_t)i*di)*nc];
+    for( unsigned int j = (i<ie) ? je : j0; j<j1; j++ ){
+      const T* q = &p[(ptrdiff_t)j*dj*(ptrdiff_t)nc];
+      for( unsigned int k=0; k<nc; k++ ) o[(size_t)j*nc+k] = q[k];
+    }
+  }
+}
+
+
+
+// Rotate by 90, 180 or 270 degrees clockwise
+template <typename T, int C>
+static void rotate_kernel( const T* in, T* out, unsigned int width, unsigned int height, int channels, int angle ){
+
+  const unsigned int nc = C ? C : channels;
+
+  // Rotate 90 or 270: a transpose combined with a reversal of one axis. Walking down input
+  // columns strides a whole row through memory for every pixel, so work through the image in
+  // small square blocks that fit within the cache for both input and output
+  if( angle == 90 || angle == 270 ){
+
+    // For 90, output row i is input column i read from bottom to top.
+    // For 270, output row i is input column width-1-i read from top to bottom
+    const ptrdiff_t di = (angle == 90) ? 1 : -1;
+    const ptrdiff_t dj = (angle == 90) ? -(ptrdiff_t)width : (ptrdiff_t)width;
+    const ptrdiff_t base = (angle == 90) ? (ptrdiff_t)(height-1)*width : (ptrdiff_t)width-1;
+
+    const int blocks = (width + TRANSPOSE_BLOCK - 1) / TRANSPOSE_BLOCK;
 
-    // Rotate 270
-    else if( (int) angle % 360 == 270 ){
 #if defined(__ICC) || defined(__INTEL_COMPILER)
 #pragma ivdep
 #elif defined(_OPENMP)
-#pragma omp parallel for if( in.width*in.height > PARALLEL_THRESHOLD )
+#pragma omp parallel for if( width*height > PARALLEL_THRESHOLD )
 #endif
-      for( int i=in.width-1; i>=0; i-- ){
-	unsigned int n = (in.width-1-i)*in.height*in.channels;
-	for( unsigned int j=0; j<in.height; j++ ){
-	  unsigned int index = (in.width*j + i)*in.channels;
-	  for( int k=0; k < in.channels; k++ ){
-	    ((unsigned char*)buffer)[n++] = ((unsigned char*)in.data)[index+k];
-	  }
-	}
+    for( int b=0; b<blocks; b++ ){
+      unsigned int i0 = b * TRANSPOSE_BLOCK;
+      unsigned int i1 = (i0 + TRANSPOSE_BLOCK < width) ? i0 + TRANSPOSE_BLOCK : width;
+      for( unsigned int j0=0; j0<height; j0+=TRANSPOSE_BLOCK ){
+	unsigned int j1 = (j0 + TRANSPOSE_BLOCK < height) ? j0 + TRANSPOSE_BLOCK : height;
+	transpose_block<T,C>( in, out, height, nc, base, di, dj, i0, i1, j0, j1 );
       }
     }
+  }
 
-    // Rotate 180
-    else if( (int) angle % 360 == 180 ){
-      for( int i=(in.width*in.height)-1; i >= 0; i-- ){
-	unsigned index = i * in.channels;
-	for( int k=0; k < in.channels; k++ ){
-	  ((unsigned char*)buffer)[n++] = ((unsigned char*)in.data)[index+k];
-	}
-      }
+  // Rotate 180: simply reverse the order of the pixels, which is each row reversed and
+  // written out in reverse row order
+  else if( angle == 180 ){
+#if defined(__ICC) || defined(__INTEL_COMPILER)
+#pragma ivdep
+#elif defined(_OPENMP)
+#pragma omp parallel for if( width*height > PARALLEL_THRESHOLD )
+#endif
+    for( unsigned int j=0; j<height; j++ ){
+      reverse_row<T,C>( &in[(size_t)(height-1-j)*width*nc], &out[(size_t)j*width*nc], width, nc );
     }
+  }
+}
+
+
+
+// Dispatch our rotation on the number of channels
+template <typename T>
+static void rotate_channels( const RawTile& in, void* buffer, int angle ){
+  const T* data = (const T*) in.data;
+  switch( in.channels ){
+    case 1: rotate_kernel<T,1>( data, (T*) buffer, in.width, in.height, 1, angle ); break;
+    case 3: rotate_kernel<T,3>( data, (T*) buffer, in.width, in.height, 3, angle ); break;
+    case 4: rotate_kernel<T,4>( data, (T*) buffer, in.width, in.height, 4, angle ); break;
+    default: rotate_kernel<T,0>( data, (T*) buffer, in.width, in.height, in.channels, angle ); break;
+  }
+}
+
+
+
+// Rotation function
+void filter_rotate( RawTile& in, float angle=0.0 ){
+
+  // Currently implemented only for rectangular rotations
+  if( (int)angle % 90 == 0 && (int)angle % 360 != 0 ){
+
+    int a = (int) angle % 360;
+    if( a < 0 ) a += 360;
 
-    // Delete old data buffer
-    delete[] (unsigned char*) in.data;
+    // Allocate memory for our rotated data
+    void *buffer = MemoryPool::allocate( in.dataLength );
 
-    // Assign new data to Rawtile
-    in.data = buffer;
+    // Only the sample size matters when shuffling pixels around
+    switch( in.bpc ){
+      case 32: rotate_channels<unsigned int>( in, buffer, a ); break;
+      case 16: rotate_channels<unsigned short>( in, buffer, a ); break;
+      default: rotate_channels<unsigned char>( in, buffer, a ); break;
+    }
+
+    // Replace old data buffer with our rotated data
+    in.adopt( buffer, in.dataLength );
 
     // For 90 and 270 rotation swap width and height
-    if( (int)angle % 180 == 90 ){
+    if( a % 180 == 90 ){
       unsigned int tmp = in.height;
       in.height = in.width;
       in.width = tmp;
@@ -745,38 +965,67 @@ void filter_rotate( RawTile& in, float angle=0.0 ){
 
 
 
-// Convert colour to grayscale using the conversion formula:
+// Luminance functions for each sample type using the conversion formula:
 //   Luminance = 0.2126*R + 0.7152*G + 0.0722*B
-// Note that we don't linearize before converting
-void filter_greyscale( RawTile& rawtile ){
+// Integer types use fixed-point arithmetic rather than floating point
+static inline unsigned char luminance( unsigned char R, unsigned char G, unsigned char B ){
+  return (unsigned char)( ( 1254097*R + 2462056*G + 478151*B ) >> 22 );
+}
+
+static inline unsigned short luminance( unsigned short R, unsigned short G, unsigned short B ){
+  return (unsigned short)( ( 13933u*R + 46871u*G + 4732u*B ) >> 16 );
+}
+
+static inline float luminance( float R, float G, float B ){
+  return 0.2126f*R + 0.7152f*G + 0.0722f*B;
+}
 
-  if( rawtile.bpc != 8 || rawtile.channels != 3 ) return;
 
-  unsigned int np = rawtile.width * rawtile.height;
-  unsigned char* buffer = new unsigned char[rawtile.width * rawtile.height];
 
-  // Calculate using fixed-point arithmetic
-  //  - benchmarks to around 25% faster than floating point
+// Convert 3 channel colour to greyscale
+template <typename T>
+static void greyscale_kernel( const T* in, T* out, unsigned int np ){
 #if defined(__ICC) || defined(__INTEL_COMPILER)
 #pragma ivdep
 #elif defined(_OPENMP)
-#pragma omp parallel for if( rawtile.width*rawtile.height > PARALLEL_THRESHOLD )
+#pragma omp parallel for if( np > PARALLEL_THRESHOLD )
 #endif
   for( unsigned int i=0; i<np; i++ ){
-    unsigned int n = i*rawtile.channels;
-    unsigned char R = ((unsigned char*)rawtile.data)[n++];
-    unsigned char G = ((unsigned char*)rawtile.data)[n++];
-    unsigned char B = ((unsigned char*)rawtile.data)[n++];
-    buffer[i] = (unsigned char)( ( 1254097*R + 2462056*G + 478151*B ) >> 22 );
+    out[i] = luminance( in[i*3], in[i*3+1], in[i*3+2] );
   }
+}
+
+
 
-  // Delete our old data buffer and instead point to our grayscale data
-  delete[] (unsigned char*) rawtile.data;
-  rawtile.data = (void*) buffer;
+// Convert colour to grayscale
+// Note that we don't linearize before converting
+void filter_greyscale( RawTile& rawtile ){
 
-  // Update our number of channels and data length
+  if( rawtile.channels != 3 ) return;
+
+  unsigned int np = rawtile.width * rawtile.height;
+  unsigned int bytes = rawtile.bpc / 8;
+  void* buffer = NULL;
+
+  if( rawtile.bpc == 8 ){
+    buffer = MemoryPool::allocate( np * bytes );
+    greyscale_kernel<unsigned char>( (const unsigned char*) rawtile.data, (unsigned char*) buffer, np );
+  }
+  else if( rawtile.bpc == 16 ){
+    buffer = MemoryPool::allocate( np * bytes );
+    greyscale_kernel<unsigned short>( (const unsigned short*) rawtile.data, (unsigned short*) buffer, np );
+  }
+  else if( rawtile.bpc == 32 && rawtile.sampleType == FLOATINGPOINT ){
+    buffer = MemoryPool::allocate( np * bytes );
+    greyscale_kernel<float>( (const float*) rawtile.data, (float*) buffer, np );
+  }
+  else return;
+
+  // Replace our old data buffer with our grayscale data
+  rawtile.adopt( buffer, np * bytes );
+
+  // Update our number of channels
   rawtile.channels = 1;
-  rawtile.dataLength = np;
 }
 
 
@@ -787,11 +1036,11 @@ void filter_twist( RawTile& rawtile, const vector< vector<float> >& matrix ){
   unsigned long np = rawtile.width * rawtile.height;
 
   // Create temporary buffer for our calculated values
-  float* pixel = new float[rawtile.channels];
+  float* pixel = (float*) Arena::allocate( rawtile.channels*sizeof(float) );
 
   // Calculate the number of columns - limit to our number of channels if necessary
   unsigned int ncols = (matrix.size()>(unsigned int)rawtile.channels) ? rawtile.channels : matrix.size();
-  unsigned int* nrows = new unsigned int[ncols];
+  unsigned int* nrows = (unsigned int*) Arena::allocate( ncols*sizeof(unsigned int) );
 
   // Pre-calculate the size of each row
   for( unsigned int i=0; i<ncols; i++ ){
@@ -821,8 +1070,31 @@ void filter_twist( RawTile& rawtile, const vector< vector<float> >& matrix ){
     for( int k=0; k<rawtile.channels; k++ ) ((float*)rawtile.data)[n++] = pixel[k];
 
   }
-  delete[] nrows;
-  delete[] pixel;
+}
+
+
+
+// Strip away bands in place: B bands are kept from each pixel of C channels
+template <typename T, int C, int B>
+static void flatten_kernel( T* data, unsigned long np, int channels, int bands ){
+  const unsigned int nc = C ? C : channels;
+  const unsigned int nb = B ? B : bands;
+  // Simply loop through assigning to the same buffer
+  for( unsigned long i=0; i<np; i++ ){
+    for( unsigned int k=0; k<nb; k++ ) data[i*nb+k] = data[i*nc+k];
+  }
+}
+
+
+
+// Dispatch our band stripping on the number of input and output channels
+template <typename T>
+static void flatten_channels( RawTile& in, int bands ){
+  T* data = (T*) in.data;
+  unsigned long np = (unsigned long) in.width * in.height;
+  if( in.channels == 2 && bands == 1 ) flatten_kernel<T,2,1>( data, np, 2, 1 );
+  else if( in.channels == 4 && bands == 3 ) flatten_kernel<T,4,3>( data, np, 4, 3 );
+  else flatten_kernel<T,0,0>( data, np, in.channels, bands );
 }
 
 
@@ -834,67 +1106,74 @@ void filter_flatten( RawTile& in, int bands ){
   // We cannot increase the number of channels
   if( bands >= in.channels ) return;
 
-  unsigned long np = in.width * in.height;
-  unsigned long ni = 0;
-  unsigned long no = 0;
-  unsigned int gap = in.channels - bands;
+  // We strip bands in place, so make sure we are not modifying a borrowed buffer
+  in.detach();
 
-  // Simply loop through assigning to the same buffer
-  for( unsigned long i=0; i<np; i++ ){
-    for( int k=0; k<bands; k++ ){
-      ((unsigned char*)in.data)[ni++] = ((unsigned char*)in.data)[no++];
-    }
-    no += gap;
+  switch( in.bpc ){
+    case 32: flatten_channels<unsigned int>( in, bands ); break;
+    case 16: flatten_channels<unsigned short>( in, bands ); break;
+    default: flatten_channels<unsigned char>( in, bands ); break;
   }
 
   in.channels = bands;
-  in.dataLength = ni * in.bpc/8;
+  in.dataLength = in.width * in.height * bands * in.bpc/8;
 }
 
 
 
 
-// Flip image in horizontal or vertical direction (0=horizontal,1=vertical)
-void filter_flip( RawTile& rawtile, int orientation ){
-
-  unsigned char* buffer = new unsigned char[rawtile.width * rawtile.height * rawtile.channels];
-
-  // Vertical
-  if( orientation == 2 ){
+// Mirror each row of pixels horizontally
+template <typename T, int C>
+static void flip_kernel( const T* in, T* out, unsigned int width, unsigned int height, int channels ){
+  const unsigned int nc = C ? C : channels;
 #if defined(__ICC) || defined(__INTEL_COMPILER)
 #pragma ivdep
 #elif defined(_OPENMP)
-#pragma omp parallel for if( rawtile.width*rawtile.height > PARALLEL_THRESHOLD )
+#pragma omp parallel for if( width*height > PARALLEL_THRESHOLD )
 #endif
-    for( int j=rawtile.height-1; j>=0; j-- ){
-      unsigned long n = j*rawtile.width*rawtile.channels;
-      for( unsigned int i=0; i<rawtile.width; i++ ){
-        unsigned long index = (rawtile.width*j + i)*rawtile.channels;
-        for( int k=0; k<rawtile.channels; k++ ){
-          buffer[n++] = ((unsigned char*)rawtile.data)[index++];
-        }
-      }
+  for( unsigned int j=0; j<height; j++ ){
+    reverse_row<T,C>( &in[(size_t)j*width*nc], &out[(size_t)j*width*nc], width, nc );
+  }
+}
+
+
+
+// Dispatch our horizontal flip on the number of channels
+template <typename T>
+static void flip_channels( const RawTile& in, void* buffer ){
+  const T* data = (const T*) in.data;
+  switch( in.channels ){
+    case 1: flip_kernel<T,1>( data, (T*) buffer, in.width, in.height, 1 ); break;
+    case 3: flip_kernel<T,3>( data, (T*) buffer, in.width, in.height, 3 ); break;
+    case 4: flip_kernel<T,4>( data, (T*) buffer, in.width, in.height, 4 ); break;
+    default: flip_kernel<T,0>( data, (T*) buffer, in.width, in.height, in.channels ); break;
+  }
+}
+
+
+
+// Flip image in horizontal or vertical direction (1=horizontal,2=vertical)
+void filter_flip( RawTile& rawtile, int orientation ){
+
+  void* buffer = MemoryPool::allocate( rawtile.dataLength );
+
+  // Vertical: simply copy whole rows in reverse order
+  if( orientation == 2 ){
+    size_t row = (size_t) rawtile.width * rawtile.channels * rawtile.bpc/8;
+    for( unsigned int j=0; j<rawtile.height; j++ ){
+      memcpy( (unsigned char*) buffer + j*row,
+	      (unsigned char*) rawtile.data + (rawtile.height-1-j)*row, row );
     }
   }
   // Horizontal
   else{
-#if defined(__ICC) || defined(__INTEL_COMPILER)
-#pragma ivdep
-#elif defined(_OPENMP)
-#pragma omp parallel for if( rawtile.width*rawtile.height > PARALLEL_THRESHOLD )
-#endif
-    for( unsigned int j=0; j<rawtile.height; j++ ){
-      unsigned long n = j*rawtile.width*rawtile.channels;
-      for( int i=rawtile.width-1; i>=0; i-- ){
-        unsigned long index = (rawtile.width*j + i)*rawtile.channels;
-        for( int k=0; k<rawtile.channels; k++ ){
-	  buffer[n++] = ((unsigned char*)rawtile.data)[index++];
-        }
-      }
+    switch( rawtile.bpc ){
+      case 32: flip_channels<unsigned int>( rawtile, buffer ); break;
+      case 16: flip_channels<unsigned short>( rawtile, buffer ); break;
+      default: flip_channels<unsigned char>( rawtile, buffer ); break;
     }
   }
 
-  // Delete our old data buffer and instead point to our grayscale data
-  delete[] (unsigned char*) rawtile.data;
-  rawtile.data = (void*) buffer;
+  // Replace our old data buffer with our flipped data
+  rawtile.adopt( buffer, rawtile.dataLength );
 }
@@ -98,8 +98,8 @@ void filter_interpolate_bilinear( RawTile& in, unsigned int w, unsigned int h );
 void filter_rotate( RawTile& in, float angle );
 
 
-/// Convert image to grayscale
-/** @param in input image */
+/// Convert 3 channel colour image to grayscale
+/** @param in input image: 8 or 16 bit fixed point or 32 bit floating point */
 void filter_greyscale( RawTile& in );
 
 
@@ -119,7 +119,7 @@ void filter_flatten( RawTile& in, int bands );
 
 ///Flip image
 /** @param in input image
-    @param o orientation (0=horizontal,1=vertical)
+    @param o orientation (1=horizontal,2=vertical)
 */
 void filter_flip( RawTile& in, int o );
 
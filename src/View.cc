@@ -21,6 +21,7 @@
 
 #include "View.h"
 #include <cmath>
+#include <sstream>
 using namespace std;
 
 
@@ -265,3 +266,29 @@ int View::getLayers(){
 
   return layers;
 }
+
+
+
+string View::canonical(){
+
+  ostringstream key;
+
+  // Rotations differing by whole turns are equivalent
+  float r = fmod( rotation, 360.0f );
+  if( r < 0 ) r += 360.0f;
+
+  key << xangle << "," << yangle << ";" << getLayers() << ";" << output_format << ";" << embedICC() << ";"
+      << r << ";" << flip << ";" << colourspace << ";" << contrast << ";" << gamma << ";" << inverted << ";";
+
+  // Only include parameters of filters which are active
+  if( cmapped ) key << cmap;
+  key << ";";
+  if( shaded ) key << shade[0] << "," << shade[1];
+  key << ";";
+  for( size_t i = 0; i < ctw.size(); i++ ){
+    for( size_t j = 0; j < ctw[i].size(); j++ ) key << ctw[i][j] << ",";
+    key << ";";
+  }
+
+  return key.str();
+}
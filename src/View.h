@@ -24,6 +24,7 @@
 
 
 #include <cstddef>
+#include <string>
 #include <vector>
 
 #include "Transforms.h"
@@ -275,6 +276,13 @@ class View{
   /* @return requested rotation angle in degrees */
   float getRotation(){ return rotation; };
 
+  /// Return a normalised description of everything other than the region which affects our output
+  /** Equivalent requests made through different protocols or with different but equivalent
+      parameters give the same description, so that they can share response cache entries
+      @return canonical view key
+   */
+  std::string canonical();
+
   /// Whether view requires floating point processing
   bool floatProcessing(){
     if( contrast != 1.0 || gamma != 1.0 || cmapped || shaded || inverted || ctw.size() ){
@@ -86,6 +86,57 @@ void Watermark::init()
 
 
 
+// Add our 8 bit watermark to a single sample with clipping: 16 bit data needs to be multiplied
+// up, whereas TIFFReadRGBAImage always scales to 8bit, so never any need for downscaling.
+// We do our maths in unsigned int to allow us to clip correctly
+static inline void blend( unsigned char& d, unsigned char w ){
+  unsigned int t = d + w;
+  d = (unsigned char)( t > 255 ? 255 : t );
+}
+
+static inline void blend( unsigned short& d, unsigned char w ){
+  unsigned int t = d + w*256;
+  d = (unsigned short)( t > 65535 ? 65535 : t );
+}
+
+
+
+// Apply our 3 channel watermark to an image with C channels. For greyscale images, only
+// the first watermark channel is used and extra channels such as alpha are left untouched
+template <typename T, int C>
+static void watermark_kernel( T* data, const unsigned char* watermark, unsigned int wm_width,
+			      unsigned int width, unsigned int xoffset, unsigned int yoffset,
+			      unsigned int xlimit, unsigned int ylimit, int channels ){
+
+  const unsigned int nc = C ? C : channels;
+  const unsigned int nw = (nc < 3) ? nc : 3;
+
+  for( unsigned int j=0; j<ylimit; j++ ){
+    T* d = &data[((j+yoffset)*width + xoffset)*nc];
+    const unsigned char* w = &watermark[j*wm_width*3];
+    for( unsigned int i=0; i<xlimit; i++ ){
+      for( unsigned int k=0; k<nw; k++ ) blend( d[i*nc+k], w[i*3+k] );
+    }
+  }
+}
+
+
+
+// Dispatch our watermark kernel on the number of channels
+template <typename T>
+static void watermark_channels( void* data, const unsigned char* watermark, unsigned int wm_width,
+				unsigned int width, unsigned int xoffset, unsigned int yoffset,
+				unsigned int xlimit, unsigned int ylimit, unsigned int channels ){
+  T* d = (T*) data;
+  switch( channels ){
+    case 1: watermark_kernel<T,1>( d, watermark, wm_width, width, xoffset, yoffset, xlimit, ylimit, 1 ); break;
+    case 3: watermark_kernel<T,3>( d, watermark, wm_width, width, xoffset, yoffset, xlimit, ylimit, 3 ); break;
+    default: watermark_kernel<T,0>( d, watermark, wm_width, width, xoffset, yoffset, xlimit, ylimit, channels ); break;
+  }
+}
+
+
+
 // Apply the watermark to a buffer of data
 void Watermark::apply( void* data, unsigned int width, unsigned int height, unsigned int channels, unsigned int bpc )
 {
@@ -118,30 +169,11 @@ void Watermark::apply( void* data, unsigned int width, unsigned int height, unsi
     if( _width > width ) xlimit = width;
     if( _height > height ) ylimit = height;
 
-    for( unsigned int j=0; j<ylimit; j++ ){
-      for( unsigned int i=0; i<xlimit; i++ ){
-	for( unsigned int k=0; k<channels; k++ ){
-
-	  unsigned int id = (j+yoffset)*width*channels + (i+xoffset)*channels + k;
-
-	  // For 16bit images we need to multiply up as our watermark data is always 8bit
-	  // We do our maths in unsigned int to allow us to clip correctly
-	  if( bpc == 16 ){
-	    unsigned short* d = (unsigned short*) data;
-	    unsigned int t = (unsigned int)( d[id] + _watermark[j*_width*_channels + i*_channels + k]*256 );
-	    if( t > 65535 ) t = 65535;
-	    d[id] = (unsigned short) t;
-	  }
-	  // TIFFReadRGBAImage always scales to 8bit, so never any need for downscaling, but clip to 255
-	  // We do our maths in unsigned short to allow us to clip correctly after
-	  else{
-	    unsigned char* d = (unsigned char*) data;
- 	    unsigned short t = (unsigned short)( d[id] + _watermark[j*_width*_channels + i*_channels + k] );
-	    if( t > 255 ) t = 255;
- 	    d[id] = (unsigned char) t;
-	  }
-	}
-      }
+    if( bpc == 16 ){
+      watermark_channels<unsigned short>( data, _watermark, _width, width, xoffset, yoffset, xlimit, ylimit, channels );
+    }
+    else{
+      watermark_channels<unsigned char>( data, _watermark, _width, width, xoffset, yoffset, xlimit, ylimit, channels );
     }
   }
 
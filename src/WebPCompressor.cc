@@ -0,0 +1,240 @@
+/*  WebP class wrapper to libwebp library
+
+    Copyright (C) 2017 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include <cstring>
+#include <sstream>
+#include "WebPCompressor.h"
+
+
+// Maximum size of working buffer we retain between images
+#define MAX_RETAINED_BUFFER 4*1024*1024
+
+
+using namespace std;
+
+
+
+/*
+ * Append data to our growable output buffer
+ */
+
+static int iip_webp_write( const uint8_t* data, size_t size, const WebPPicture* picture )
+{
+  webp_destination* dest = (webp_destination*) picture->custom_ptr;
+
+  if( dest->size + size > dest->capacity ){
+    size_t capacity = ( dest->capacity > 0 ) ? dest->capacity * 2 : 65536;
+    while( capacity < dest->size + size ) capacity *= 2;
+    unsigned char* buffer = (unsigned char*) MemoryPool::allocate( capacity );
+    if( dest->size > 0 ) memcpy( buffer, dest->buffer, dest->size );
+    if( dest->buffer ) MemoryPool::release( dest->buffer );
+    dest->buffer = buffer;
+    dest->capacity = capacity;
+  }
+
+  memcpy( &dest->buffer[dest->size], data, size );
+  dest->size += size;
+
+  return 1;
+}
+
+
+
+/*
+ * Write little-endian values for our RIFF container
+ */
+
+static void put32( string& s, unsigned int n )
+{
+  s += (char) ( n & 0xff );
+  s += (char) ( (n >> 8) & 0xff );
+  s += (char) ( (n >> 16) & 0xff );
+  s += (char) ( (n >> 24) & 0xff );
+}
+
+
+static void put24( string& s, unsigned int n )
+{
+  s += (char) ( n & 0xff );
+  s += (char) ( (n >> 8) & 0xff );
+  s += (char) ( (n >> 16) & 0xff );
+}
+
+
+static void putChunk( string& s, const char* fourcc, const string& payload )
+{
+  s.append( fourcc, 4 );
+  put32( s, payload.size() );
+  s.append( payload );
+  if( payload.size() & 1 ) s += '\0';
+}
+
+
+
+
+WebPCompressor::WebPCompressor( int quality )
+{
+  if( !WebPConfigInit( &config ) ){
+    throw string( "WebPCompressor :: libwebp version mismatch" );
+  }
+  setQuality( quality );
+  dest.buffer = NULL;
+  dest.capacity = 0;
+  dest.size = 0;
+}
+
+
+
+WebPCompressor::~WebPCompressor()
+{
+  if( dest.buffer ) MemoryPool::release( dest.buffer );
+}
+
+
+
+string WebPCompressor::addMetadata( unsigned int width, unsigned int height )
+{
+  // Skip the RIFF header of our encoded image
+  const char* chunks = (const char*) &dest.buffer[12];
+  size_t length = dest.size - 12;
+  unsigned char flags = 0;
+
+  // Replace any extended format header written by the encoder, keeping its flags
+  if( length >= 18 && memcmp( chunks, "VP8X", 4 ) == 0 ){
+    flags = chunks[8];
+    chunks += 18;
+    length -= 18;
+  }
+
+  if( !icc.empty() ) flags |= 0x20;
+  if( !xmp.empty() ) flags |= 0x04;
+
+  // Chunks must be in the order VP8X, ICCP, image data and finally XMP
+  string out( "RIFF\0\0\0\0WEBP", 12 );
+
+  string vp8x;
+  vp8x += (char) flags;
+  vp8x.append( 3, '\0' );
+  put24( vp8x, width - 1 );
+  put24( vp8x, height - 1 );
+  putChunk( out, "VP8X", vp8x );
+
+  if( !icc.empty() ) putChunk( out, "ICCP", icc );
+  out.append( chunks, length );
+  if( !xmp.empty() ) putChunk( out, "XMP ", xmp );
+
+  // Fill in our RIFF size
+  string size;
+  put32( size, out.size() - 8 );
+  out.replace( 4, 4, size );
+
+  return out;
+}
+
+
+
+int WebPCompressor::Compress( RawTile& rawtile, bool cache )
+{
+  unsigned int width = rawtile.width;
+  unsigned int height = rawtile.height;
+  unsigned int channels = rawtile.channels;
+
+  // WebP can only handle 8 bit greyscale or RGB images with or without alpha
+  if( rawtile.bpc != 8 ) throw string( "WebPCompressor :: WebP can only handle 8 bit images" );
+  if( channels < 1 || channels > 4 ){
+    throw string( "WebPCompressor :: WebP can only handle images with between 1 and 4 channels" );
+  }
+
+  WebPPicture picture;
+  if( !WebPPictureInit( &picture ) ) throw string( "WebPCompressor :: libwebp version mismatch" );
+
+  picture.width = width;
+  picture.height = height;
+  picture.writer = iip_webp_write;
+  picture.custom_ptr = &dest;
+
+  config.quality = (float) Q;
+
+  // WebP has no greyscale mode, so expand greyscale images to RGB
+  const unsigned char* data = (const unsigned char*) rawtile.data;
+  unsigned int bands = ( channels < 3 ) ? channels + 2 : channels;
+
+  if( channels < 3 ){
+    size_t np = (size_t) width * height;
+    unsigned char* rgb = (unsigned char*) Arena::allocate( np * bands );
+    for( size_t n = 0; n < np; n++ ){
+      unsigned char v = data[n*channels];
+      rgb[n*bands] = rgb[n*bands+1] = rgb[n*bands+2] = v;
+      if( bands == 4 ) rgb[n*bands+3] = data[n*channels+1];
+    }
+    data = rgb;
+  }
+
+  int imported = ( bands == 3 ) ?
+    WebPPictureImportRGB( &picture, data, width * bands ) :
+    WebPPictureImportRGBA( &picture, data, width * bands );
+
+  if( !imported ){
+    WebPPictureFree( &picture );
+    throw string( "WebPCompressor :: Unable to import image data" );
+  }
+
+  dest.size = 0;
+  int ok = WebPEncode( &config, &picture );
+  WebPPictureFree( &picture );
+
+  if( !ok ){
+    ostringstream error;
+    error << "WebPCompressor :: Encoding error " << picture.error_code;
+    throw error.str();
+  }
+
+  // Copy the WebP data into a buffer of exactly the right size, which replaces
+  // the tile's raw data, which may be a borrowed view of data we do not own
+  void* buffer;
+  unsigned int size;
+
+  if( icc.empty() && xmp.empty() ){
+    size = dest.size;
+    buffer = MemoryPool::allocate( size );
+    memcpy( buffer, dest.buffer, size );
+  }
+  else{
+    string output = addMetadata( width, height );
+    size = output.size();
+    buffer = MemoryPool::allocate( size );
+    memcpy( buffer, output.data(), size );
+  }
+
+  // Don't hold on to exceptionally large working buffers
+  if( dest.capacity > MAX_RETAINED_BUFFER ){
+    MemoryPool::release( dest.buffer );
+    dest.buffer = NULL;
+    dest.capacity = 0;
+  }
+  dest.size = 0;
+
+  // Set the tile compression parameters
+  rawtile.adopt( buffer, size );
+  rawtile.compressionType = WEBP;
+  rawtile.quality = Q;
+
+  return size;
+}
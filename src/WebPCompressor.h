@@ -0,0 +1,112 @@
+/*  WebP class wrapper to libwebp library
+
+    Copyright (C) 2017 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+
+#ifndef _WEBPCOMPRESSOR_H
+#define _WEBPCOMPRESSOR_H
+
+
+#include "Compressor.h"
+#include <webp/encode.h>
+
+
+
+/// Growable in-memory destination for libwebp output
+
+typedef struct {
+  unsigned char *buffer;             /**< pooled output buffer */
+  size_t capacity;                   /**< allocated size of buffer */
+  size_t size;                       /**< size of output data */
+} webp_destination;
+
+
+
+/// Wrapper class to libwebp
+/** Provides lossy WebP output for 8 bit greyscale or RGB images with or without
+    an alpha channel. WebP cannot be encoded strip by strip, so images are always
+    compressed whole. Any ICC profile or XMP metadata is added by wrapping the
+    encoded bitstream within an extended format (VP8X) container.
+*/
+class WebPCompressor: public Compressor{
+
+ private:
+
+  /// Encoder settings
+  WebPConfig config;
+
+  /// Output data collected from libwebp
+  webp_destination dest;
+
+  /// Add our ICC profile and XMP metadata to the encoded image
+  /** @param width image width
+      @param height image height
+      @return encoded image with metadata
+   */
+  std::string addMetadata( unsigned int width, unsigned int height );
+
+  /// Copy constructor and assignment - not permitted
+  WebPCompressor( const WebPCompressor& );
+  WebPCompressor& operator= ( const WebPCompressor& );
+
+
+ public:
+
+  /// Constructor
+  /** @param quality WebP quality factor (0-100) */
+  WebPCompressor( int quality );
+
+  /// Destructor
+  ~WebPCompressor();
+
+  /// Set the compression quality
+  /** @param quality WebP quality factor (0-100) */
+  void setQuality( int quality ){
+    if( quality < 0 ) Q = 0;
+    else if( quality > 100 ) Q = 100;
+    else Q = quality;
+  };
+
+  /// Set the compression method
+  /** @param method trade-off between speed and compression from 0 (fastest) to 6 (smallest) */
+  void setMethod( int method ){
+    if( method < 0 ) config.method = 0;
+    else if( method > 6 ) config.method = 6;
+    else config.method = method;
+  };
+
+  /// Compress an entire buffer of image data at once in one command
+  /** @param t tile of image data
+      @param cache whether the tile is to be cached - unused for WebP
+   */
+  int Compress( RawTile& t, bool cache = false );
+
+  /// WebP images must always be compressed whole
+  bool useWholeImage( unsigned int width, unsigned int height ){ return true; };
+
+  /// Return the WebP mime type
+  inline const char* getMimeType() { return "image/webp"; }
+
+  /// Return the image filename suffix
+  inline const char* getSuffix() { return "webp"; }
+
+};
+
+
+#endif
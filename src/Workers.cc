@@ -0,0 +1,261 @@
+/*  IIP Server: Pre-forked worker processes for standalone mode
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <netdb.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "Workers.h"
+
+
+using namespace std;
+
+
+// Workers which fail sooner than this after starting are not restarted, as they are unlikely to fare better next time
+#define MIN_WORKER_LIFETIME 10
+
+
+// Signals received by the supervising parent, which it passes on to its workers: those which
+// stop the workers and those, such as a memory report request, which the workers handle themselves
+static volatile sig_atomic_t stop_signal = 0;
+static volatile sig_atomic_t relay_signal = 0;
+
+static void forward( int signal )
+{
+  stop_signal = signal;
+}
+
+static void relay( int signal )
+{
+  relay_signal = signal;
+}
+
+
+
+bool Workers::reusePort( const string& address )
+{
+#ifdef SO_REUSEPORT
+  // As with FCGX_OpenSocket(), addresses without a port are Unix domain socket paths
+  return address.find( ':' ) != string::npos;
+#else
+  return false;
+#endif
+}
+
+
+
+int Workers::listen( const string& address, int backlog )
+{
+  size_t colon = address.find_last_of( ':' );
+  string host = address.substr( 0, colon );
+  string port = address.substr( colon + 1 );
+  if( host == "*" ) host.clear();
+  if( host.size() > 1 && host[0] == '[' && host[host.size()-1] == ']' ) host = host.substr( 1, host.size() - 2 );
+
+  struct addrinfo hints, *result;
+  memset( &hints, 0, sizeof(hints) );
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  int error = getaddrinfo( host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &result );
+  if( error != 0 ){
+    throw string( "Workers :: Unable to resolve '" + address + "': " + gai_strerror( error ) );
+  }
+
+  int fd = -1;
+  for( struct addrinfo* a = result; a && fd == -1; a = a->ai_next ){
+    fd = socket( a->ai_family, a->ai_socktype, a->ai_protocol );
+    if( fd == -1 ) continue;
+    int on = 1;
+    setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+#ifdef SO_REUSEPORT
+    setsockopt( fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on) );
+#endif
+    if( bind( fd, a->ai_addr, a->ai_addrlen ) == -1 || ::listen( fd, backlog ) == -1 ){
+      close( fd );
+      fd = -1;
+    }
+  }
+  freeaddrinfo( result );
+
+  if( fd == -1 ){
+    throw string( "Workers :: Unable to listen on '" + address + "': " + strerror( errno ) );
+  }
+  return fd;
+}
+
+
+
+pid_t Workers::spawn( unsigned int slot, int loglevel, ofstream* logfile )
+{
+  // Anything still buffered would otherwise be written by both processes
+  logfile->flush();
+
+  pid_t pid = fork();
+
+  if( pid == -1 ){
+    if( loglevel >= 1 ) *logfile << "Unable to start worker " << slot << ": " << strerror( errno ) << endl;
+    return -1;
+  }
+
+  if( pid == 0 ){
+    index = slot;
+    pids.clear();
+    started.clear();
+    signal( SIGTERM, SIG_DFL );
+    signal( SIGINT, SIG_DFL );
+    signal( SIGHUP, SIG_DFL );
+    signal( SIGUSR1, SIG_DFL );
+    // Ignore memory report requests until our request loop is ready to handle them
+    signal( SIGUSR2, SIG_IGN );
+    if( affinity ) pin();
+    return 0;
+  }
+
+  pids[slot] = pid;
+  started[slot] = time( NULL );
+  if( loglevel >= 1 ) *logfile << "Started worker " << slot << " with pid " << pid << endl;
+  return pid;
+}
+
+
+
+void Workers::pin()
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+  // Choose among the CPUs we are allowed to run on, so that an outer affinity mask or cpuset is respected
+  cpu_set_t allowed;
+  if( sched_getaffinity( 0, sizeof(allowed), &allowed ) != 0 ) return;
+  int n = CPU_COUNT( &allowed );
+  if( n == 0 ) return;
+
+  int target = index % n;
+  for( int c = 0; c < CPU_SETSIZE; c++ ){
+    if( !CPU_ISSET( c, &allowed ) ) continue;
+    if( target-- > 0 ) continue;
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    CPU_SET( c, &set );
+    if( sched_setaffinity( 0, sizeof(set), &set ) == 0 ) cpu = c;
+    return;
+  }
+#endif
+}
+
+
+
+int Workers::start( int loglevel, ofstream* logfile )
+{
+  if( count <= 1 ){
+    index = 0;
+    if( affinity ) pin();
+    return 0;
+  }
+
+  pids.assign( count, 0 );
+  started.assign( count, 0 );
+
+  // Catch our signals before forking so that none are missed. Workers restore the defaults
+  signal( SIGTERM, forward );
+  signal( SIGINT, forward );
+  signal( SIGHUP, forward );
+  signal( SIGUSR1, forward );
+  signal( SIGUSR2, relay );
+
+  unsigned int running = 0;
+  for( unsigned int slot = 0; slot < count; slot++ ){
+    pid_t pid = spawn( slot, loglevel, logfile );
+    if( pid == 0 ) return index;
+    if( pid > 0 ) running++;
+  }
+
+  bool forwarded = false;
+
+  while( running > 0 ){
+
+    if( stop_signal && !forwarded ){
+      if( loglevel >= 1 ) *logfile << "Caught " << strsignal( stop_signal ) << " signal. Stopping workers" << endl;
+      for( unsigned int slot = 0; slot < count; slot++ ){
+	if( pids[slot] > 0 ) kill( pids[slot], stop_signal );
+      }
+      forwarded = true;
+    }
+
+    if( relay_signal ){
+      int sig = relay_signal;
+      relay_signal = 0;
+      if( loglevel >= 2 ) *logfile << "Passing " << strsignal( sig ) << " signal on to workers" << endl;
+      for( unsigned int slot = 0; slot < count; slot++ ){
+	if( pids[slot] > 0 ) kill( pids[slot], sig );
+      }
+    }
+
+    int status;
+    pid_t pid = waitpid( -1, &status, WNOHANG );
+    if( pid == -1 ){
+      if( errno == EINTR ) continue;
+      break;
+    }
+    // Signals interrupt our sleep, so they are passed on without delay
+    if( pid == 0 ){
+      sleep( 1 );
+      continue;
+    }
+
+    unsigned int slot = 0;
+    while( slot < count && pids[slot] != pid ) slot++;
+    if( slot == count ) continue;
+    pids[slot] = 0;
+    running--;
+
+    if( loglevel >= 1 ){
+      *logfile << "Worker " << slot << " with pid " << pid;
+      if( WIFSIGNALED( status ) ) *logfile << " killed by " << strsignal( WTERMSIG( status ) ) << " signal" << endl;
+      else *logfile << " exited with status " << WEXITSTATUS( status ) << endl;
+    }
+
+    // Restart workers which fail after running for a while, but not ones which fail at start-up
+    if( !stop_signal && time( NULL ) - started[slot] >= MIN_WORKER_LIFETIME ){
+      pid = spawn( slot, loglevel, logfile );
+      if( pid == 0 ) return index;
+      if( pid > 0 ) running++;
+    }
+  }
+
+  return -1;
+}
+
+
+
+string Workers::getStatistics() const
+{
+  char where[64], tmp[256];
+  if( cpu >= 0 ) snprintf( where, sizeof(where), "pid %d, CPU %d", (int) getpid(), cpu );
+  else snprintf( where, sizeof(where), "pid %d", (int) getpid() );
+  snprintf( tmp, sizeof(tmp), "worker %d of %u (%s): %lu requests accepted, %.3f ms mean wait in accept",
+	    index, count, where, accepts, accepts ? waited / ( 1000.0 * accepts ) : 0.0 );
+  return string( tmp );
+}
@@ -0,0 +1,118 @@
+/*  IIP Server: Pre-forked worker processes for standalone mode
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _WORKERS_H
+#define _WORKERS_H
+
+
+#include <ctime>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+
+
+/// Pre-forked worker processes for --bind and --http modes
+/** The parent process forks one worker per requested slot and then only supervises them:
+ *  signals are passed on and workers which exit unexpectedly are restarted. Where the
+ *  kernel supports SO_REUSEPORT, each worker opens its own listening socket on the same
+ *  TCP port, so that the kernel spreads connections across separate accept queues rather
+ *  than waking every worker blocked on one shared queue. Workers can also be pinned to
+ *  their own CPU so that each process and its caches stay on one core.
+ */
+
+class Workers {
+
+ private:
+
+  /// Number of workers, whether to pin them to CPUs and our own worker index
+  unsigned int count;
+  bool affinity;
+  int index;
+
+  /// Process IDs and start times of our workers, indexed by worker
+  std::vector<pid_t> pids;
+  std::vector<time_t> started;
+
+  /// CPU to which we are pinned or -1
+  int cpu;
+
+  /// Accept statistics for this worker
+  unsigned long accepts;
+  unsigned long long waited;
+
+  /// Fork the worker for a slot
+  /** @return 0 in the new worker, its process ID in the parent or -1 on error */
+  pid_t spawn( unsigned int slot, int loglevel, std::ofstream* logfile );
+
+  /// Pin ourselves to the CPU for our slot
+  void pin();
+
+
+ public:
+
+  /// Constructor
+  /** @param n number of workers
+      @param a whether to pin each worker to its own CPU
+   */
+  Workers( unsigned int n, bool a ) :
+    count( n ), affinity( a ), index( 0 ), cpu( -1 ), accepts( 0 ), waited( 0 ) {};
+
+  /// Whether each worker can open its own listener on an address
+  /** This is the case for TCP "host:port" or ":port" addresses when SO_REUSEPORT is supported */
+  static bool reusePort( const std::string& address );
+
+  /// Open a listening TCP socket with SO_REUSEPORT
+  /** @param address address in the form "host:port" or ":port"
+      @param backlog listen backlog
+      @return socket, throwing a string on error
+   */
+  static int listen( const std::string& address, int backlog );
+
+  /// Start our workers
+  /** With a single worker, no process is forked. Otherwise the parent only returns once
+      all workers have exited after a TERM, INT or HUP signal or have failed to start
+      @param loglevel logging level
+      @param logfile log file
+      @return our worker index in a worker or -1 in the parent
+   */
+  int start( int loglevel, std::ofstream* logfile );
+
+  /// Return the number of workers
+  unsigned int getNumWorkers() const { return count; }
+
+  /// Return our worker index
+  int getIndex() const { return index; }
+
+  /// Return the CPU to which we are pinned or -1 if none
+  int getCPU() const { return cpu; }
+
+  /// Record an accepted request
+  /** @param wait time in microseconds spent waiting for it */
+  void accepted( long wait ){ accepts++; if( wait > 0 ) waited += wait; }
+
+  /// Return a summary of our accept statistics
+  std::string getStatistics() const;
+
+};
+
+
+#endif
@@ -25,14 +25,60 @@
 
 #include <fcgiapp.h>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 
 
 /// Virtual base class for various writers
+/** Output is passed straight through to the underlying stream. A copy is kept only while
+    a response cache has asked for one with capture(), and only up to the size that cache
+    can accept: larger responses are never copied.
+ */
 class Writer {
 
+ private:
+
+  /// Copy of our output since capture() was first called
+  char* buffer;
+  size_t sz, capacity;
+
+  /// Size beyond which we stop copying and whether we are copying
+  size_t limit;
+  bool capturing;
+
+
+ protected:
+
+  /// Add the message to our copy of our output if we are capturing
+  void cpy2buf( const char* msg, size_t len ){
+    if( !capturing || len == 0 ) return;
+    if( sz + len > limit ){
+      // Too large for any cache: stop copying and release what we have
+      release();
+      return;
+    }
+    if( sz + len > capacity ){
+      size_t c = capacity ? capacity : 65536;
+      while( c < sz + len ) c *= 2;
+      if( c > limit ) c = limit;
+      char* b = (char*) realloc( buffer, c );
+      if( !b ){
+	release();
+	return;
+      }
+      buffer = b;
+      capacity = c;
+    }
+    memcpy( &buffer[sz], msg, len );
+    sz += len;
+  };
+
+
  public:
 
-  virtual ~Writer() = 0;
+  Writer() : buffer( NULL ), sz( 0 ), capacity( 0 ), limit( 0 ), capturing( false ) {};
+
+  virtual ~Writer(){ if( buffer ) free( buffer ); };
 
   /// Write out a binary string
   /** \param msg message string
@@ -40,66 +86,96 @@ class Writer {
   */
   virtual int putStr( const char* msg, int len ) = 0;
 
+  /// Write out a header and body together
+  /** \param header header string
+      \param hlen header length
+      \param body body data
+      \param blen body length
+      \return number of body bytes written or -1 on error
+  */
+  virtual int putStr( const char* header, int hlen, const char* body, int blen ) = 0;
+
   /// Write out a string
   /** \param msg message string */
   virtual int putS( const char* msg ) = 0;
 
   /// Write out a string
-  /** \param msg message string */
+  /** The string is written as it is and is never interpreted as a format
+      \param msg message string */
   virtual int printf( const char* msg ) = 0;
 
   /// Flush the output buffer
   virtual int flush() = 0;
 
-};
+  /// Start keeping a copy of our output for a response cache
+  /** If we are already capturing, the existing copy is kept and the larger limit applies
+      \param max size beyond which we stop copying
+      \return position in our copy at which any subsequent output begins
+  */
+  size_t capture( size_t max ){
+    if( max == 0 ) return sz;
+    if( !capturing ){
+      capturing = true;
+      limit = 0;
+    }
+    if( max > limit ) limit = max;
+    return sz;
+  };
 
+  /// Discard any copy of our output and stop capturing
+  void release(){
+    free( buffer );
+    buffer = NULL;
+    sz = capacity = limit = 0;
+    capturing = false;
+  };
+
+  /// Return our copy of our output from a position
+  /** \param start position returned by capture()
+      \param len set to the number of bytes available
+      \return copy of our output or NULL if we were not capturing or exceeded our limit
+  */
+  const char* captured( size_t start, size_t& len ) const {
+    len = 0;
+    if( !capturing || !buffer || sz <= start ) return NULL;
+    len = sz - start;
+    return buffer + start;
+  };
+
+};
 
 
 /// FCGI Writer Class
-class FCGIWriter {
+class FCGIWriter : public Writer {
 
  private:
 
-  
   FCGX_Stream *out;
-  static const unsigned int bufsize = 65536;
-
-  /// Add the message to our buffer
-  void cpy2buf( const char* msg, size_t len ){
-    if( sz+len > bufsize ) buffer = (char*) realloc( buffer, sz+len );
-    if( buffer ){
-      memcpy( &buffer[sz], msg, len );
-      sz += len;
-    }
-  };
 
 
  public:
 
-  char* buffer;
-  size_t sz;
-
   /// Constructor
-  FCGIWriter( FCGX_Stream* o ){
-    out = o;
-    buffer = (char*) malloc(bufsize);
-    sz = 0;
-  };
-
-  /// Destructor
-  ~FCGIWriter(){ if(buffer) free(buffer); };
+  FCGIWriter( FCGX_Stream* o ){ out = o; };
 
   int putStr( const char* msg, int len ){
     cpy2buf( msg, len );
     return FCGX_PutStr( msg, len, out );
   };
+  int putStr( const char* header, int hlen, const char* body, int blen ){
+    cpy2buf( header, hlen );
+    cpy2buf( body, blen );
+    // Both parts go into the same stream buffer and are sent to the web server together on flush
+    if( FCGX_PutStr( header, hlen, out ) != hlen ) return -1;
+    return FCGX_PutStr( body, blen, out );
+  };
   int putS( const char* msg ){
     cpy2buf( msg, strlen(msg) );
     return FCGX_PutS( msg, out );
   }
   int printf( const char* msg ){
     cpy2buf( msg, strlen(msg) );
-    return FCGX_FPrintF( out, msg );
+    return FCGX_PutS( msg, out );
   };
   int flush(){
     return FCGX_FFlush( out );
@@ -110,7 +186,7 @@ class FCGIWriter {
 
 
 /// File Writer Class
-class FileWriter {
+class FileWriter : public Writer {
 
  private:
 
@@ -121,12 +197,21 @@ class FileWriter {
   FileWriter( FILE* o ){ out = o; };
 
   int putStr( const char* msg, int len ){
+    cpy2buf( msg, len );
     return fwrite( (void*) msg, sizeof(char), len, out );
   };
+  int putStr( const char* header, int hlen, const char* body, int blen ){
+    cpy2buf( header, hlen );
+    cpy2buf( body, blen );
+    if( (int) fwrite( (void*) header, sizeof(char), hlen, out ) != hlen ) return -1;
+    return fwrite( (void*) body, sizeof(char), blen, out );
+  };
   int putS( const char* msg ){
+    cpy2buf( msg, strlen(msg) );
     return fputs( msg, out );
   }
   int printf( const char* msg ){
+    cpy2buf( msg, strlen(msg) );
     return fprintf( out, "%s", msg );
   };
   int flush(){
@@ -134,7 +219,7 @@ class FileWriter {
   };
 
 };
-  
+
 
 
 #endif
@@ -33,6 +33,9 @@
 #pragma comment(lib, "ws2_32.lib")
 #endif
 
+/// Largest value accepted by a default memcached configuration
+#define MEMCACHED_MAX_ITEM (1024*1024)
+
 /// Cache to store raw tile data
 
 class Memcache {
@@ -58,14 +61,20 @@ class Memcache {
   /// Flag whether we are connected
   bool _connected;
 
+  /// Read statistics
+  unsigned long _hits, _misses;
+
 
  public:
 
   /// Constructor
   /** @param servernames list of memcached servers
       @param timeout memcached timeout - defaults to 1 hour (3600 seconds)
+      @param readTimeout unused: reads and writes are synchronous on Windows
   */
-  Memcache( const std::string& servernames = "localhost", unsigned int timeout = 3600 ) {
+  Memcache( const std::string& servernames = "localhost", unsigned int timeout = 3600, unsigned int readTimeout = 50 ) {
+
+    _hits = _misses = 0;
 
 	// Create our memcached object
 	_memc = new MemCacheClient;
@@ -132,8 +141,11 @@ class Memcache {
 	MemCacheClient::MemRequest req;
 	req.mKey = "iipsrv::" + key;
 	int result = _memc->Get(req);
-	if (result == 0)//if 0 items retrieved
+	if (result == 0){//if 0 items retrieved
+		_misses++;
 		return NULL;
+	}
+	_hits++;
 	_rc = req.mResult;
 	_length = req.mData.GetReadSize();
 	char * returnData = new char[_length];
@@ -155,6 +167,14 @@ class Memcache {
   /// Tell us whether we are connected to any memcached servers
   bool connected(){ return _connected; };
 
+
+  /// Return a summary of our statistics
+  std::string getStatistics(){
+    std::ostringstream s;
+    s << _hits << " hits, " << _misses << " misses";
+    return s.str();
+  }
+
 };
 
 #endif